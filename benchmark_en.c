@@ -0,0 +1,1531 @@
+#include <string.h>
+#include <time.h>
+#include "image_functions_en.c" // Library under test (single file, includes stb)
+
+/*
+ * Benchmark for the functions in image_functions_en.c
+ *
+ * Build:  gcc -O2 -o benchmark benchmark_en.c -lm -lpthread
+ * Run:    ./benchmark [--images DIR] [--sizes 4k,8k,16k] [--ops name,...]
+ *                     [--warmup N] [--reps N] [--json FILE]
+ *         ./benchmark --check [--images DIR] [--results DIR]
+ *
+ * Every operation is timed on each image of the test set and on synthetic 4K/8K/16K images.
+ * After the warm-up runs, the median of the repetitions is reported as ns/pixel and MB/s
+ * (input bytes processed per second), and all results are written as JSON to the given file.
+ *
+ * With --check nothing is timed: every code path (each dispatch level, single and multithreaded)
+ * is compared against the reference images in test_results, or against a reference computed from the
+ * input image for the paths that have none, and the exit code is the number of failures. IMAGE_DISPATCH and IMAGE_THREADS restrict the check to one dispatch level/thread count.
+ */
+
+#define MAX_RESULTS 1024
+#define MAX_REPETITIONS 1000
+
+// Operation that will be timed, param is the level passed to blur/sharpen
+typedef struct {
+    const char *name;
+    Image *(*run)(const Image *img, int param);
+    int param;
+} BenchOperation;
+
+// Result of timing one operation on one image
+typedef struct {
+    char image[128];
+    char operation[32];
+    int width;
+    int height;
+    int channels;
+    int repetitions;
+    double medianNs;
+    double minNs;
+    double nsPerPixel;
+    double megabytesPerSecond;
+} BenchResult;
+
+// Synthetic image sizes, UHD frame sizes
+typedef struct {
+    const char *name;
+    int width;
+    int height;
+} SyntheticSize;
+
+static const SyntheticSize syntheticSizes[] = {
+    {"4k", 3840, 2160},
+    {"8k", 7680, 4320},
+    {"16k", 15360, 8640},
+};
+
+static Image *runInvert(const Image *img, int param) {
+    (void)param;
+    return invertPixels(img);
+}
+
+static Image *runBnW(const Image *img, int param) {
+    (void)param;
+    return convertBnW(img);
+}
+
+static Image *runBlur(const Image *img, int param) {
+    return applyBlur(img, param);
+}
+
+// Includes the conversions to and from the planar layout
+static Image *runPlanar(const Image *img, PlanarImage *(*filter)(const PlanarImage *planar, int param), int param) {
+    PlanarImage *planar = convertToPlanar(img);
+    if (!planar)
+        return NULL;
+    PlanarImage *filtered = filter(planar, param);
+    freePlanarImage(planar);
+    if (!filtered)
+        return NULL;
+    Image *output = convertFromPlanar(filtered);
+    freePlanarImage(filtered);
+    return output;
+}
+
+static Image *runBlurPlanar(const Image *img, int param) {
+    return runPlanar(img, applyBlurPlanar, param);
+}
+
+// Includes the conversions to and from float pixels
+static Image *runBlurFloat(const Image *img, int param) {
+    Image *values = convertPixelType(img, PIXEL_F32);
+    if (!values)
+        return NULL;
+    Image *blurred = applyBlur(values, param);
+    freeImage(values);
+    if (!blurred)
+        return NULL;
+    Image *output = convertPixelType(blurred, PIXEL_U8);
+    freeImage(blurred);
+    return output;
+}
+
+static Image *runSharpen(const Image *img, int param) {
+    return applySharpen(img, param);
+}
+
+static Image *runGaussian(const Image *img, int param) {
+    return applyGaussianBlur(img, (float)param);
+}
+
+static Image *runBoxGaussian(const Image *img, int param) {
+    return applyBoxGaussianBlur(img, (float)param, 3);
+}
+
+static Image *runMedian(const Image *img, int param) {
+    return applyMedianFilter(img, param);
+}
+
+static Image *runBilateral(const Image *img, int param) {
+    return applyBilateralFilter(img, (float)param, 20.0f);
+}
+
+static Image *runGuided(const Image *img, int param) {
+    return applyGuidedFilter(img, param, 100.0f);
+}
+
+static Image *runErosion(const Image *img, int param) {
+    return applyErosion(img, param, param);
+}
+
+static Image *runEdges(const Image *img, int param) {
+    (void)param;
+    return applyEdgeDetection(img);
+}
+
+static Image *runEdgesMode(const Image *img, int param) {
+    return applyEdgeDetectionMode(img, (EdgeMode)param);
+}
+
+// The five step chain convertBnW, invertPixels, applyBlur, applySharpen, applyEdgeDetection, one call at a time
+static Image *runChainEager(const Image *img, int param) {
+    Image *steps[5];
+    steps[0] = convertBnW(img);
+    steps[1] = steps[0] ? invertPixels(steps[0]) : NULL;
+    steps[2] = steps[1] ? applyBlur(steps[1], param) : NULL;
+    steps[3] = steps[2] ? applySharpen(steps[2], param) : NULL;
+    steps[4] = steps[3] ? applyEdgeDetection(steps[3]) : NULL;
+    for (int i = 0; i < 4; i++) {
+        if (steps[i])
+            freeImage(steps[i]);
+    }
+    return steps[4];
+}
+
+// The same chain, recorded in a pipeline, rendered at full size or as a preview a quarter of the size in each axis
+static Image *runChain(const Image *img, int param, bool preview) {
+    Pipeline *pipeline = createPipeline(img);
+    if (!pipeline)
+        return NULL;
+    int node = pipelineBnW(pipeline, PIPELINE_SOURCE_NODE);
+    node = pipelineInvert(pipeline, node);
+    node = pipelineBlur(pipeline, node, param);
+    node = pipelineSharpen(pipeline, node, param);
+    node = pipelineEdgeDetection(pipeline, node);
+    Image *output = preview ? pipelineRenderPreview(pipeline, node, (img->width + 3) / 4, (img->height + 3) / 4)
+                            : pipelineRender(pipeline, node);
+    freePipeline(pipeline);
+    return output;
+}
+
+static Image *runChainPipeline(const Image *img, int param) {
+    return runChain(img, param, false);
+}
+
+static Image *runChainPreview(const Image *img, int param) {
+    return runChain(img, param, true);
+}
+
+// A normalized disk kernel of the given size, which is not separable
+static Image *runDiskKernel(const Image *img, int param) {
+    float *kernel = malloc(param * param * sizeof(float));
+    if (!kernel)
+        return NULL;
+    int radius = param / 2;
+    int taps = 0;
+    for (int y = 0; y < param; y++)
+        for (int x = 0; x < param; x++) {
+            bool inside = (x - radius) * (x - radius) + (y - radius) * (y - radius) <= radius * radius;
+            kernel[y * param + x] = inside ? 1.0f : 0.0f;
+            taps += inside;
+        }
+    for (int i = 0; i < param * param; i++)
+        kernel[i] /= taps;
+    Image *output = applyKernelWithMethod(img, kernel, param, CONVOLUTION_AUTO);
+    free(kernel);
+    return output;
+}
+
+// Half the width and height, with the given filter
+static Image *runResizeHalf(const Image *img, int param) {
+    return resizeImage(img, (img->width + 1) / 2, (img->height + 1) / 2, (ResizeFilter)param);
+}
+
+// Build every Laplacian level and reconstruct the image from them
+static Image *runPyramidRoundTrip(const Image *img, int param) {
+    Pyramid *pyramid = createPyramid(img, param, PYRAMID_LAPLACIAN);
+    if (!pyramid)
+        return NULL;
+    Image *output = reconstructPyramid(pyramid);
+    freePyramid(pyramid);
+    return output;
+}
+
+static Image *runCanny(const Image *img, int param) {
+    (void)param;
+    return applyCannyEdgeDetection(img, 1.4f, 20, 60);
+}
+
+static const BenchOperation operations[] = {
+    {"invertPixels", runInvert, 0},
+    {"convertBnW", runBnW, 0},
+    {"applyBlur_1", runBlur, 1},
+    {"applyBlur_3", runBlur, 3},
+    {"applyBlur_7", runBlur, 7},
+    {"applyBlurPlanar_3", runBlurPlanar, 3},
+    {"applyBlurFloat_3", runBlurFloat, 3},
+    {"applySharpen_1", runSharpen, 1},
+    {"applySharpen_3", runSharpen, 3},
+    {"applySharpen_9", runSharpen, 9},
+    {"applyEdgeDetection", runEdges, 0},
+    {"applyEdgeDetectionMode_luma", runEdgesMode, EDGE_LUMA},
+    {"applyEdgeDetectionMode_max", runEdgesMode, EDGE_MAX_GRADIENT},
+    {"applyGaussianBlur_2", runGaussian, 2},
+    {"applyGaussianBlur_50", runGaussian, 50},
+    {"applyBoxGaussianBlur_2", runBoxGaussian, 2},
+    {"applyBoxGaussianBlur_50", runBoxGaussian, 50},
+    {"applyMedianFilter_2", runMedian, 2},
+    {"applyMedianFilter_10", runMedian, 10},
+    {"applyBilateralFilter_8", runBilateral, 8},
+    {"applyBilateralFilter_32", runBilateral, 32},
+    {"applyGuidedFilter_4", runGuided, 4},
+    {"applyErosion_3", runErosion, 3},
+    {"applyErosion_31", runErosion, 31},
+    {"applyCannyEdgeDetection", runCanny, 0},
+    {"applyKernelWithMethod_disk31", runDiskKernel, 31},
+    {"resizeImage_half_bilinear", runResizeHalf, RESIZE_BILINEAR},
+    {"resizeImage_half_lanczos3", runResizeHalf, RESIZE_LANCZOS3},
+    {"chain5_eager", runChainEager, 1},
+    {"chain5_pipeline", runChainPipeline, 1},
+    {"chain5_preview_quarter", runChainPreview, 4}, // Levels of 1 on the proxy
+    {"pyramid_laplacian_roundtrip", runPyramidRoundTrip, 8},
+};
+
+static const int operationCount = sizeof(operations) / sizeof(operations[0]);
+
+// Reference image in test_results, named <image>_<suffix>.png, and the code path compared against it
+typedef struct {
+    const char *suffix;
+    const char *variant; // Shown after the reference name, NULL for the plain function
+    Image *(*run)(const Image *img, int param);
+    int param;
+} GoldenCase;
+
+// Box kernel of a blur level through a convolution method, with the kernel object of applyBlur
+static Image *runBoxKernelWithMethod(const Image *img, int level, ConvolutionMethod method) {
+    const Kernel *kernel = acquireKernel(KERNEL_BOX, level);
+    if (!kernel)
+        return NULL;
+    Image *output = applyKernelObject(img, kernel, method);
+    releaseKernel(kernel);
+    return output;
+}
+
+static Image *runBlurDirect(const Image *img, int param) {
+    return runBoxKernelWithMethod(img, param, CONVOLUTION_DIRECT);
+}
+
+static Image *runBlurSeparable(const Image *img, int param) {
+    return runBoxKernelWithMethod(img, param, CONVOLUTION_SEPARABLE);
+}
+
+static Image *runBlurFFT(const Image *img, int param) {
+    return runBoxKernelWithMethod(img, param, CONVOLUTION_FFT);
+}
+
+static PlanarImage *edgesPlanar(const PlanarImage *planar, int param) {
+    (void)param;
+    return applyEdgeDetectionPlanar(planar);
+}
+
+static Image *runSharpenPlanar(const Image *img, int param) {
+    return runPlanar(img, applySharpenPlanar, param);
+}
+
+static Image *runEdgesPlanar(const Image *img, int param) {
+    return runPlanar(img, edgesPlanar, param);
+}
+
+// The filter that runs on the gray image with an alpha channel added (ALPHA_PASSTHROUGH must not mix it in)
+typedef enum {
+    GOLDEN_BLUR,
+    GOLDEN_SHARPEN,
+    GOLDEN_EDGES,
+} GoldenFilter;
+
+static Image *runAlphaPassthrough(const Image *img, GoldenFilter filter, int param) {
+    Image *withAlpha = createImage(img->width, img->height, 2);
+    if (!withAlpha)
+        return NULL;
+    for (int i = 0; i < img->width * img->height; i++) {
+        withAlpha->pixels[i * 2] = img->pixels[i];
+        withAlpha->pixels[i * 2 + 1] = (unsigned char)(255 - i % 97);
+    }
+
+    Image *filtered = NULL;
+    if (filter == GOLDEN_BLUR) {
+        const Kernel *kernel = acquireKernel(KERNEL_BOX, param);
+        filtered = kernel ? applyKernelAlpha(withAlpha, kernel->weights, kernel->size, ALPHA_PASSTHROUGH) : NULL;
+        if (kernel)
+            releaseKernel(kernel);
+    } else if (filter == GOLDEN_SHARPEN) {
+        filtered = applySharpenAlpha(withAlpha, param, ALPHA_PASSTHROUGH);
+    } else {
+        filtered = applyEdgeDetectionAlpha(withAlpha, ALPHA_PASSTHROUGH);
+    }
+    freeImage(withAlpha);
+    if (!filtered)
+        return NULL;
+
+    Image *output = createImage(img->width, img->height, 1);
+    for (int i = 0; output && i < img->width * img->height; i++)
+        output->pixels[i] = filtered->pixels[i * 2];
+    freeImage(filtered);
+    return output;
+}
+
+static Image *runBlurAlpha(const Image *img, int param) {
+    return runAlphaPassthrough(img, GOLDEN_BLUR, param);
+}
+
+static Image *runSharpenAlpha(const Image *img, int param) {
+    return runAlphaPassthrough(img, GOLDEN_SHARPEN, param);
+}
+
+static Image *runEdgesAlpha(const Image *img, int param) {
+    return runAlphaPassthrough(img, GOLDEN_EDGES, param);
+}
+
+// The filter on 16 bit pixels that hold the 8 bit values unscaled, which must truncate and clamp the same way
+static Image *runU16(const Image *img, GoldenFilter filter, int param) {
+    Image *values = createImageOfType(img->width, img->height, 1, PIXEL_U16);
+    if (!values)
+        return NULL;
+    for (int i = 0; i < img->width * img->height; i++)
+        ((unsigned short *)values->pixels)[i] = img->pixels[i];
+
+    Image *filtered = filter == GOLDEN_BLUR      ? applyBlur(values, param)
+                      : filter == GOLDEN_SHARPEN ? applySharpen(values, param)
+                                                 : applyEdgeDetection(values);
+    freeImage(values);
+    if (!filtered)
+        return NULL;
+
+    Image *output = createImage(img->width, img->height, 1);
+    for (int i = 0; output && i < img->width * img->height; i++)
+        output->pixels[i] = (unsigned char)clamp(((unsigned short *)filtered->pixels)[i], 0, 255);
+    freeImage(filtered);
+    return output;
+}
+
+static Image *runBlurU16(const Image *img, int param) {
+    return runU16(img, GOLDEN_BLUR, param);
+}
+
+static Image *runSharpenU16(const Image *img, int param) {
+    return runU16(img, GOLDEN_SHARPEN, param);
+}
+
+static Image *runEdgesU16(const Image *img, int param) {
+    return runU16(img, GOLDEN_EDGES, param);
+}
+
+// A pipeline with a single operation, which must give the same result as the function it records
+static Image *runPipelineNode(const Image *img, GoldenFilter filter, int param) {
+    Pipeline *pipeline = createPipeline(img);
+    if (!pipeline)
+        return NULL;
+    int node = filter == GOLDEN_BLUR      ? pipelineBlur(pipeline, PIPELINE_SOURCE_NODE, param)
+               : filter == GOLDEN_SHARPEN ? pipelineSharpen(pipeline, PIPELINE_SOURCE_NODE, param)
+                                          : pipelineEdgeDetection(pipeline, PIPELINE_SOURCE_NODE);
+    Image *output = node >= 0 ? pipelineRender(pipeline, node) : NULL;
+    freePipeline(pipeline);
+    return output;
+}
+
+static Image *runBlurPipeline(const Image *img, int param) {
+    return runPipelineNode(img, GOLDEN_BLUR, param);
+}
+
+static Image *runSharpenPipeline(const Image *img, int param) {
+    return runPipelineNode(img, GOLDEN_SHARPEN, param);
+}
+
+static Image *runEdgesPipeline(const Image *img, int param) {
+    return runPipelineNode(img, GOLDEN_EDGES, param);
+}
+
+static Image *runInvertPipeline(const Image *img, int param) {
+    (void)param;
+    Pipeline *pipeline = createPipeline(img);
+    if (!pipeline)
+        return NULL;
+    int node = pipelineInvert(pipeline, PIPELINE_SOURCE_NODE);
+    Image *output = node >= 0 ? pipelineRender(pipeline, node) : NULL;
+    freePipeline(pipeline);
+    return output;
+}
+
+// Same size, so every output pixel takes a single tap
+static Image *runResizeSameSize(const Image *img, int param) {
+    return resizeImage(img, img->width, img->height, (ResizeFilter)param);
+}
+
+// Box upsizing by 3/2 (every other output pixel is centered on an edge between two source pixels), then every
+// source pixel read back from the output pixel at 3/2 of its position. The reference images have even sizes.
+static Image *runResizeBoxUpsize(const Image *img, int param) {
+    (void)param;
+    const int width = img->width * 3 / 2, height = img->height * 3 / 2;
+    Image *upsized = resizeImage(img, width, height, RESIZE_BOX);
+    Image *output = upsized ? createImage(img->width, img->height, img->channels) : NULL;
+    for (int y = 0; output && y < img->height; y++)
+        for (int x = 0; x < img->width; x++)
+            memcpy(output->pixels + ((size_t)y * img->width + x) * img->channels,
+                   upsized->pixels + ((size_t)(y * 3 / 2) * width + x * 3 / 2) * img->channels, img->channels);
+    if (upsized)
+        freeImage(upsized);
+    return output;
+}
+
+// The references were made from the grayscale image, with blur/sharpen numbered by kernel size (blur_07 is level 3).
+// blur_01 and sharp_01 were made with a 1 x 1 kernel, so they are the unfiltered image, which the paths that must
+// give back their input are checked against.
+static const GoldenCase goldenCases[] = {
+    {"invert", NULL, runInvert, 0},
+    {"invert", "pipeline", runInvertPipeline, 0},
+    {"blur_01", "resize same size", runResizeSameSize, RESIZE_LANCZOS3},
+    {"blur_01", "box upsize", runResizeBoxUpsize, 0},
+    {"sharp_01", "laplacian pyramid", runPyramidRoundTrip, 8},
+    {"blur_03", NULL, runBlur, 1},
+    {"blur_03", "direct", runBlurDirect, 1},
+    {"blur_07", NULL, runBlur, 3},
+    {"blur_07", "direct", runBlurDirect, 3},
+    {"blur_07", "separable", runBlurSeparable, 3},
+    {"blur_07", "fft", runBlurFFT, 3},
+    {"blur_07", "planar", runBlurPlanar, 3},
+    {"blur_07", "alpha passthrough", runBlurAlpha, 3},
+    {"blur_07", "16 bit", runBlurU16, 3},
+    {"blur_07", "pipeline", runBlurPipeline, 3},
+    {"sharp_03", NULL, runSharpen, 1},
+    {"sharp_09", NULL, runSharpen, 4},
+    {"sharp_09", "planar", runSharpenPlanar, 4},
+    {"sharp_09", "alpha passthrough", runSharpenAlpha, 4},
+    {"sharp_09", "16 bit", runSharpenU16, 4},
+    {"sharp_09", "pipeline", runSharpenPipeline, 4},
+    {"edges", NULL, runEdges, 0},
+    {"edges", "planar", runEdgesPlanar, 0},
+    {"edges", "alpha passthrough", runEdgesAlpha, 0},
+    {"edges", "16 bit", runEdgesU16, 0},
+    {"edges", "luma", runEdgesMode, EDGE_LUMA},
+    {"edges", "pipeline", runEdgesPipeline, 0},
+};
+
+static const char *goldenImages[] = {"chess", "mushroom", "twocats"};
+
+// Code path checked against a reference computed here from the color image, for the paths without a reference image.
+// The check runs once per dispatch level and thread count and returns whether the output matched.
+typedef struct {
+    const char *name;
+    bool (*check)(const Image *img, int param);
+    int param;
+} ReferenceCheck;
+
+#define CHECK_JPEG_FILE "benchmark_check.jpg"
+
+/** @brief Average each d x d block of an image, with the pixels past the right and bottom edges repeating the last
+ * column and row like the padding of the JPEG encoder
+ *
+ * @param img The image to average
+ * @param denominator The size d of the blocks
+ *
+ * @return An image of ceil(width / d) x ceil(height / d) pixels, or NULL if the memory could not be allocated
+ */
+static Image *blockMeans(const Image *img, int denominator) {
+    const int width = (img->width + denominator - 1) / denominator, height = (img->height + denominator - 1) / denominator;
+    const int channels = img->channels, area = denominator * denominator;
+    Image *output = createImage(width, height, channels);
+    if (!output)
+        return NULL;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < channels; c++) {
+                int sum = 0;
+                for (int dy = 0; dy < denominator; dy++) {
+                    int sy = y * denominator + dy < img->height ? y * denominator + dy : img->height - 1;
+                    for (int dx = 0; dx < denominator; dx++) {
+                        int sx = x * denominator + dx < img->width ? x * denominator + dx : img->width - 1;
+                        sum += img->pixels[((size_t)sy * img->width + sx) * channels + c];
+                    }
+                }
+                output->pixels[((size_t)y * width + x) * channels + c] = (unsigned char)((sum + area / 2) / area);
+            }
+        }
+    }
+    return output;
+}
+
+/** @brief Encode an image as JPEG, then compare loadImageScaled against the block means of the full decode, at the
+ * size of the image and cropped to odd sizes
+ *
+ * stb_image_write subsamples the chroma (4:2:0) up to quality 90 and keeps it (4:4:4) above. The 1/8 decode of a 4:4:4
+ * file is the DC of each block, so it must be within rounding of the mean. The other scales drop high frequencies
+ * and replicate the chroma instead of interpolating it, so they are held to a PSNR. On every dispatch level the output
+ * must also be the same as the scalar decode.
+ *
+ * @param img The image to encode, with 3 channels
+ * @param quality The JPEG quality
+ * @param denominator The scale of the decode, 2, 4 or 8
+ *
+ * @return true if every size matched
+ */
+static bool checkScaledJpeg(const Image *img, int quality, int denominator) {
+    const bool subsampled = quality <= 90;
+    const DispatchLevel level = getDispatchLevel();
+    bool matched = true;
+
+    for (int odd = 0; odd < 2 && matched; odd++) {
+        const int width = odd ? (img->width - 3) | 1 : img->width, height = odd ? (img->height - 5) | 1 : img->height;
+        Image *source = createImage(width, height, 3);
+        if (!source)
+            return false;
+        for (int y = 0; y < height; y++)
+            memcpy(source->pixels + (size_t)y * width * 3, img->pixels + (size_t)y * img->width * 3, (size_t)width * 3);
+        bool written = stbi_write_jpg(CHECK_JPEG_FILE, width, height, 3, source->pixels, quality) != 0;
+        freeImage(source);
+        if (!written)
+            return false;
+
+        Image *full = loadImage(CHECK_JPEG_FILE);
+        Image *scaled = loadImageScaled(CHECK_JPEG_FILE, denominator);
+        setDispatchLevel(DISPATCH_SCALAR);
+        Image *scalar = loadImageScaled(CHECK_JPEG_FILE, denominator);
+        setDispatchLevel(level);
+        Image *means = full ? blockMeans(full, denominator) : NULL;
+
+        ImageDiff diff;
+        matched = scaled && scalar && means && compareImagesTolerance(scaled, scalar, 0) && compareImagesDetailed(scaled, means, 255, &diff);
+        if (matched && !subsampled && denominator == 8)
+            matched = diff.maxAbsDiff <= 2;
+        else if (matched)
+            matched = diff.psnr >= (subsampled ? 32.0 : 36.0);
+
+        if (full)
+            freeImage(full);
+        if (scaled)
+            freeImage(scaled);
+        if (scalar)
+            freeImage(scalar);
+        if (means)
+            freeImage(means);
+    }
+
+    remove(CHECK_JPEG_FILE);
+    return matched;
+}
+
+static bool checkScaledJpeg444(const Image *img, int param) {
+    return checkScaledJpeg(img, 95, param);
+}
+
+static bool checkScaledJpeg420(const Image *img, int param) {
+    return checkScaledJpeg(img, 90, param);
+}
+
+// Value of a channel with the coordinates clamped to the image
+static int clampedValue(const Image *img, int x, int y, int c) {
+    x = x < 0 ? 0 : (x >= img->width ? img->width - 1 : x);
+    y = y < 0 ? 0 : (y >= img->height ? img->height - 1 : y);
+    return img->pixels[((size_t)y * img->width + x) * img->channels + c];
+}
+
+/** @brief Copy an image with deterministic noise of up to amplitude added to every channel
+ *
+ * @param img The image to copy
+ * @param amplitude The largest change of a channel
+ *
+ * @return The noisy copy, or NULL if the memory could not be allocated
+ */
+static Image *createNoisyCopy(const Image *img, int amplitude) {
+    Image *output = createImage(img->width, img->height, img->channels);
+    if (!output)
+        return NULL;
+
+    unsigned int seed = 12345;
+    size_t count = (size_t)img->width * img->height * img->channels;
+    for (size_t i = 0; i < count; i++) {
+        seed = seed * 1103515245u + 12345u;
+        int value = img->pixels[i] + (int)((seed >> 16) % (2 * amplitude + 1)) - amplitude;
+        output->pixels[i] = (unsigned char)(value < 0 ? 0 : (value > 255 ? 255 : value));
+    }
+    return output;
+}
+
+/** @brief Check applyMedianFilter against the middle value of each window, counted one pixel at a time
+ *
+ * @param img The image to filter
+ * @param radius The radius of the window
+ *
+ * @return true if every value matched
+ */
+static bool checkMedian(const Image *img, int radius) {
+    Image *output = applyMedianFilter(img, radius);
+    if (!output)
+        return false;
+
+    const int target = (2 * radius + 1) * (2 * radius + 1) / 2;
+    bool matched = true;
+    for (int y = 0; y < img->height && matched; y++) {
+        for (int x = 0; x < img->width && matched; x++) {
+            for (int c = 0; c < img->channels && matched; c++) {
+                int counts[256] = {0};
+                for (int dy = -radius; dy <= radius; dy++)
+                    for (int dx = -radius; dx <= radius; dx++)
+                        counts[clampedValue(img, x + dx, y + dy, c)]++;
+
+                // The value with target smaller values before it in the sorted window
+                int value = 0;
+                for (int below = counts[0]; below <= target; below += counts[++value])
+                    ;
+                matched = output->pixels[((size_t)y * img->width + x) * img->channels + c] == value;
+            }
+        }
+    }
+
+    freeImage(output);
+    return matched;
+}
+
+/** @brief Check erosion or dilation against the minimum or maximum of each window, ignoring the pixels outside
+ *
+ * @param img The image to filter
+ * @param width The width of the structuring element
+ * @param height The height of the structuring element
+ * @param isMax Check dilation if true, erosion otherwise
+ *
+ * @return true if every value matched
+ */
+static bool checkMorphology(const Image *img, int width, int height, bool isMax) {
+    Image *output = isMax ? applyDilation(img, width, height) : applyErosion(img, width, height);
+    if (!output)
+        return false;
+
+    bool matched = true;
+    for (int y = 0; y < img->height && matched; y++) {
+        for (int x = 0; x < img->width && matched; x++) {
+            for (int c = 0; c < img->channels && matched; c++) {
+                int extreme = isMax ? 0 : 255;
+                for (int wy = y - height / 2; wy < y - height / 2 + height; wy++) {
+                    for (int wx = x - width / 2; wx < x - width / 2 + width; wx++) {
+                        if (wx < 0 || wx >= img->width || wy < 0 || wy >= img->height)
+                            continue;
+                        int value = img->pixels[((size_t)wy * img->width + wx) * img->channels + c];
+                        extreme = isMax ? (value > extreme ? value : extreme) : (value < extreme ? value : extreme);
+                    }
+                }
+                matched = output->pixels[((size_t)y * img->width + x) * img->channels + c] == extreme;
+            }
+        }
+    }
+
+    freeImage(output);
+    return matched;
+}
+
+// param is the width of the structuring element times 100 plus its height
+static bool checkErosion(const Image *img, int param) {
+    return checkMorphology(img, param / 100, param % 100, false);
+}
+
+static bool checkDilation(const Image *img, int param) {
+    return checkMorphology(img, param / 100, param % 100, true);
+}
+
+#define CHECK_CANNY_LOW 20
+#define CHECK_CANNY_HIGH 50
+
+/** @brief Check applyCannyEdgeDetection against the steps of the detector run one after the other on whole images
+ *
+ * The Gaussian adds its taps in the same order as the detector, so the smoothed image is the same to the bit. Each
+ * step then runs on the whole image: Sobel, non-maximum suppression, double threshold, and hysteresis by sweeping
+ * the image until no weak edge next to an edge is left.
+ *
+ * @param img The image
+ * @param param The sigma of the Gaussian in tenths of a pixel
+ *
+ * @return true if every pixel matched
+ */
+static bool checkCanny(const Image *img, int param) {
+    const float sigma = param / 10.0f;
+    const int width = img->width, height = img->height;
+    const int radius = (int)ceilf(CANNY_GAUSSIAN_RADII * sigma);
+    const int size = 2 * radius + 1;
+    const size_t count = (size_t)width * height;
+
+    Image *output = applyCannyEdgeDetection(img, sigma, CHECK_CANNY_LOW, CHECK_CANNY_HIGH);
+    float *weights = (float *)malloc(size * sizeof(float));
+    float *luma = (float *)malloc(count * 2 * sizeof(float));
+    int *magnitudes = (int *)malloc(count * sizeof(int));
+    unsigned char *gray = (unsigned char *)malloc(count * 3);
+    bool matched = output && weights && luma && magnitudes && gray;
+    if (!matched) {
+        if (output)
+            freeImage(output);
+        free(weights);
+        free(luma);
+        free(magnitudes);
+        free(gray);
+        return false;
+    }
+    float *blurred = luma + count;
+    unsigned char *directions = gray + count;
+    unsigned char *edges = gray + 2 * count;
+
+    float total = 0.0f;
+    for (int k = -radius; k <= radius; k++) {
+        weights[k + radius] = expf(-(float)(k * k) / (2.0f * sigma * sigma));
+        total += weights[k + radius];
+    }
+    for (int k = 0; k < size; k++)
+        weights[k] /= total;
+
+    // Gaussian of the luma along the rows, then along the columns, with the edges repeated
+    for (size_t i = 0; i < count; i++)
+        luma[i] = pixelLuma(img->pixels + i * img->channels, img->channels);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float sum = 0.0f;
+            for (int k = 0; k < size; k++)
+                sum += luma[(size_t)y * width + clamp(x + k - radius, 0, width - 1)] * weights[k];
+            blurred[(size_t)y * width + x] = sum;
+        }
+    }
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float sum = 0.0f;
+            for (int k = 0; k < size; k++)
+                sum += blurred[(size_t)clamp(y + k - radius, 0, height - 1) * width + x] * weights[k];
+            gray[(size_t)y * width + x] = (unsigned char)clamp((int)(sum + 0.5f), 0, 255);
+        }
+    }
+
+    // Sobel gradient with the edges repeated, as a squared magnitude and one of 4 directions
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int s[3][3];
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++)
+                    s[dy + 1][dx + 1] = gray[(size_t)clamp(y + dy, 0, height - 1) * width + clamp(x + dx, 0, width - 1)];
+            int gx = (s[0][2] + 2 * s[1][2] + s[2][2]) - (s[0][0] + 2 * s[1][0] + s[2][0]);
+            int gy = (s[2][0] + 2 * s[2][1] + s[2][2]) - (s[0][0] + 2 * s[0][1] + s[0][2]);
+            // Angle of the gradient against tan(22.5) and tan(67.5) in 1/32768, the rounding the detector defines
+            long long ax = abs(gx), ay = abs(gy);
+            size_t i = (size_t)y * width + x;
+            magnitudes[i] = gx * gx + gy * gy;
+            directions[i] = ay * 32768 <= ax * 13573 ? 0 : (ay * 32768 >= ax * 79109 ? 2 : ((gx > 0) == (gy > 0) ? 1 : 3));
+        }
+    }
+
+    // Non-maximum suppression along the gradient (no neighbour outside the image) and double threshold
+    static const int steps[4][2] = {{1, 0}, {1, 1}, {0, 1}, {-1, 1}};
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            size_t i = (size_t)y * width + x;
+            int dx = steps[directions[i]][0], dy = steps[directions[i]][1];
+            bool beforeInside = x - dx >= 0 && x - dx < width && y - dy >= 0;
+            bool afterInside = x + dx >= 0 && x + dx < width && y + dy < height;
+            int before = beforeInside ? magnitudes[i - (size_t)dy * width - dx] : 0;
+            int after = afterInside ? magnitudes[i + (size_t)dy * width + dx] : 0;
+            if (magnitudes[i] < CHECK_CANNY_LOW * CHECK_CANNY_LOW || magnitudes[i] < before || magnitudes[i] <= after)
+                edges[i] = 0;
+            else
+                edges[i] = magnitudes[i] >= CHECK_CANNY_HIGH * CHECK_CANNY_HIGH ? CANNY_EDGE : CANNY_WEAK;
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t i = (size_t)y * width + x;
+                for (int n = 0; n < 9 && edges[i] == CANNY_WEAK; n++) {
+                    int nx = x + n % 3 - 1, ny = y + n / 3 - 1;
+                    if (nx >= 0 && nx < width && ny >= 0 && ny < height && edges[(size_t)ny * width + nx] == CANNY_EDGE) {
+                        edges[i] = CANNY_EDGE;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count && matched; i++)
+        matched = output->pixels[i] == (edges[i] == CANNY_EDGE ? 255 : 0);
+
+    freeImage(output);
+    free(weights);
+    free(luma);
+    free(magnitudes);
+    free(gray);
+    return matched;
+}
+
+/** @brief Check computeSSIM against the SSIM of every window computed from its samples, against a noisy copy
+ *
+ * @param img The image
+ * @param param The amplitude of the noise
+ *
+ * @return true if the SSIM is within 1e-4 of the reference
+ */
+static bool checkSsim(const Image *img, int param) {
+    Image *noisy = createNoisyCopy(img, param);
+    if (!noisy)
+        return false;
+
+    const int window = 2 * SSIM_RADIUS + 1;
+    const double c1 = (0.01 * 255) * (0.01 * 255), c2 = (0.03 * 255) * (0.03 * 255);
+    const int colorChannels = colorChannelCount(img);
+    double total = 0.0;
+    long long windows = 0;
+    for (int y = 0; y + window <= img->height; y++) {
+        for (int x = 0; x + window <= img->width; x++) {
+            for (int c = 0; c < colorChannels; c++) {
+                double meanX = 0.0, meanY = 0.0;
+                for (int wy = y; wy < y + window; wy++) {
+                    for (int wx = x; wx < x + window; wx++) {
+                        meanX += clampedValue(img, wx, wy, c);
+                        meanY += clampedValue(noisy, wx, wy, c);
+                    }
+                }
+                meanX /= window * window;
+                meanY /= window * window;
+
+                double varianceX = 0.0, varianceY = 0.0, covariance = 0.0;
+                for (int wy = y; wy < y + window; wy++) {
+                    for (int wx = x; wx < x + window; wx++) {
+                        double dx = clampedValue(img, wx, wy, c) - meanX, dy = clampedValue(noisy, wx, wy, c) - meanY;
+                        varianceX += dx * dx;
+                        varianceY += dy * dy;
+                        covariance += dx * dy;
+                    }
+                }
+                varianceX /= window * window;
+                varianceY /= window * window;
+                covariance /= window * window;
+
+                total += (2.0 * meanX * meanY + c1) / (meanX * meanX + meanY * meanY + c1) * (2.0 * covariance + c2) /
+                         (varianceX + varianceY + c2);
+                windows++;
+            }
+        }
+    }
+
+    double ssim = computeSSIM(img, noisy);
+    freeImage(noisy);
+    return fabs(ssim - total / windows) <= 1e-4;
+}
+
+/** @brief Check compareImagesDetailed and compareImagesTolerance against a comparison one value at a time, with a
+ * noisy copy
+ *
+ * @param img The image
+ * @param param The tolerance, the noise goes up to twice as far
+ *
+ * @return true if every statistic matched
+ */
+static bool checkComparison(const Image *img, int param) {
+    Image *noisy = createNoisyCopy(img, 2 * param + 1);
+    if (!noisy)
+        return false;
+
+    int maxAbsDiff = 0;
+    long long sumAbs = 0, sumSquares = 0, beyond = 0;
+    size_t pixels = (size_t)img->width * img->height;
+    for (size_t i = 0; i < pixels; i++) {
+        bool pixelBeyond = false;
+        for (int c = 0; c < img->channels; c++) {
+            int diff = abs(img->pixels[i * img->channels + c] - noisy->pixels[i * img->channels + c]);
+            maxAbsDiff = diff > maxAbsDiff ? diff : maxAbsDiff;
+            sumAbs += diff;
+            sumSquares += diff * diff;
+            pixelBeyond = pixelBeyond || diff > param;
+        }
+        beyond += pixelBeyond;
+    }
+    double values = (double)pixels * img->channels;
+
+    ImageDiff diff;
+    bool within = compareImagesDetailed(img, noisy, param, &diff);
+    bool matched = within == (beyond == 0) && diff.maxAbsDiff == maxAbsDiff && diff.pixelsBeyondTolerance == beyond &&
+                   fabs(diff.meanAbsError - sumAbs / values) <= 1e-9 && fabs(diff.mse - sumSquares / values) <= 1e-9 &&
+                   fabs(diff.psnr - 10.0 * log10(255.0 * 255.0 * values / sumSquares)) <= 1e-9;
+
+    // The early exit mode, on both sides of the largest difference, and an image against itself
+    matched = matched && compareImagesTolerance(img, noisy, maxAbsDiff) && !compareImagesTolerance(img, noisy, maxAbsDiff - 1);
+    matched = matched && compareImagesDetailed(img, img, 0, &diff) && diff.maxAbsDiff == 0 && isinf(diff.psnr);
+
+    freeImage(noisy);
+    return matched;
+}
+
+/** @brief Blur the rows, then the columns, of values with a kernel, repeating the edge values
+ *
+ * @param values The values, blurred in place
+ * @param width The width of the image
+ * @param height The height of the image
+ * @param channels The number of channels
+ * @param kernel The 2 * radius + 1 weights
+ * @param radius The radius of the kernel
+ *
+ * @return true if the memory for a copy of the values could be allocated
+ */
+static bool blurWithKernel(double *values, int width, int height, int channels, const double *kernel, int radius) {
+    const size_t rowValues = (size_t)width * channels;
+    double *copy = (double *)malloc(rowValues * height * sizeof(double));
+    if (!copy)
+        return false;
+
+    for (int y = 0; y < height; y++) {
+        double *row = values + y * rowValues;
+        memcpy(copy, row, rowValues * sizeof(double));
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < channels; c++) {
+                double sum = 0.0;
+                for (int k = -radius; k <= radius; k++)
+                    sum += kernel[k + radius] * copy[clamp(x + k, 0, width - 1) * channels + c];
+                row[x * channels + c] = sum;
+            }
+        }
+    }
+
+    memcpy(copy, values, rowValues * height * sizeof(double));
+    for (int y = 0; y < height; y++) {
+        double *row = values + y * rowValues;
+        for (size_t i = 0; i < rowValues; i++)
+            row[i] = 0.0;
+        for (int k = -radius; k <= radius; k++) {
+            const double *source = copy + clamp(y + k, 0, height - 1) * rowValues;
+            for (size_t i = 0; i < rowValues; i++)
+                row[i] += kernel[k + radius] * source[i];
+        }
+    }
+    free(copy);
+    return true;
+}
+
+/** @brief Compare an image against float values rounded to the nearest integer
+ *
+ * @return The statistics of the difference
+ */
+static ImageDiff diffFromValues(const Image *img, const double *values) {
+    ImageDiff diff = {0, 0.0, 0.0, INFINITY, 0};
+    Image *reference = createImage(img->width, img->height, img->channels);
+    if (!reference) {
+        diff.maxAbsDiff = 255;
+        return diff;
+    }
+    size_t count = (size_t)img->width * img->height * img->channels;
+    for (size_t i = 0; i < count; i++)
+        reference->pixels[i] = (unsigned char)clamp((int)floor(values[i] + 0.5), 0, 255);
+    compareImagesDetailed(img, reference, 255, &diff);
+    freeImage(reference);
+    return diff;
+}
+
+/** @brief Check applyGaussianBlur against a direct convolution with the sampled Gaussian, out to 4 sigma
+ *
+ * The recursive filter approximates the Gaussian, so each value must be within 8 levels and the PSNR at least 44 dB.
+ *
+ * @param img The image to blur
+ * @param param The sigma in tenths of a pixel
+ *
+ * @return true if the blur is close enough to the reference
+ */
+static bool checkGaussian(const Image *img, int param) {
+    const double sigma = param / 10.0;
+    const int radius = (int)ceil(4.0 * sigma);
+    const size_t count = (size_t)img->width * img->height * img->channels;
+    double *kernel = (double *)malloc((2 * radius + 1) * sizeof(double));
+    double *values = (double *)malloc(count * sizeof(double));
+    Image *output = applyGaussianBlur(img, (float)sigma);
+    bool matched = kernel && values && output;
+
+    if (matched) {
+        double total = 0.0;
+        for (int k = -radius; k <= radius; k++)
+            total += kernel[k + radius] = exp(-k * k / (2.0 * sigma * sigma));
+        for (int k = 0; k <= 2 * radius; k++)
+            kernel[k] /= total;
+        for (size_t i = 0; i < count; i++)
+            values[i] = img->pixels[i];
+        ImageDiff diff = {255, 0.0, 0.0, 0.0, 0};
+        if (blurWithKernel(values, img->width, img->height, img->channels, kernel, radius))
+            diff = diffFromValues(output, values);
+        matched = diff.maxAbsDiff <= 8 && diff.psnr >= 44.0;
+    }
+
+    free(kernel);
+    free(values);
+    if (output)
+        freeImage(output);
+    return matched;
+}
+
+/** @brief Check applyBoxGaussianBlur with 3, 4 and 5 passes against direct convolutions with the extended boxes
+ *
+ * The running sums add up in float, so each value must be within 1 level of the reference.
+ *
+ * @param img The image to blur
+ * @param param The sigma in tenths of a pixel
+ *
+ * @return true if every value matched
+ */
+static bool checkBoxGaussian(const Image *img, int param) {
+    const float sigma = param / 10.0f;
+    const size_t count = (size_t)img->width * img->height * img->channels;
+    double *values = (double *)malloc(count * sizeof(double));
+    bool matched = values != NULL;
+
+    for (int passes = 3; passes <= 5 && matched; passes++) {
+        ExtendedBox box = extendedBoxForSigma(sigma / sqrtf((float)passes));
+        double *kernel = (double *)malloc((2 * box.radius + 3) * sizeof(double));
+        Image *output = applyBoxGaussianBlur(img, sigma, passes);
+        matched = kernel && output;
+
+        if (matched) {
+            for (int k = 0; k < 2 * box.radius + 3; k++)
+                kernel[k] = k == 0 || k == 2 * box.radius + 2 ? box.c2 : box.c1;
+            for (size_t i = 0; i < count; i++)
+                values[i] = img->pixels[i];
+            // The passes along the rows and along the columns commute, so they can alternate
+            for (int pass = 0; pass < passes && matched; pass++)
+                matched = blurWithKernel(values, img->width, img->height, img->channels, kernel, box.radius + 1);
+            matched = matched && diffFromValues(output, values).maxAbsDiff <= 1;
+        }
+
+        free(kernel);
+        if (output)
+            freeImage(output);
+    }
+
+    free(values);
+    return matched;
+}
+
+static const ReferenceCheck referenceChecks[] = {
+    {"loadImageScaled_2 (4:4:4)", checkScaledJpeg444, 2},
+    {"loadImageScaled_4 (4:4:4)", checkScaledJpeg444, 4},
+    {"loadImageScaled_8 (4:4:4)", checkScaledJpeg444, 8},
+    {"loadImageScaled_2 (4:2:0)", checkScaledJpeg420, 2},
+    {"loadImageScaled_4 (4:2:0)", checkScaledJpeg420, 4},
+    {"loadImageScaled_8 (4:2:0)", checkScaledJpeg420, 8},
+    {"applyMedianFilter radius 1", checkMedian, 1},
+    {"applyMedianFilter radius 4", checkMedian, 4},
+    {"applyMedianFilter radius 10", checkMedian, 10},
+    {"applyErosion 5 x 3", checkErosion, 503},
+    {"applyErosion 4 x 6", checkErosion, 406},
+    {"applyErosion 16 x 9", checkErosion, 1609},
+    {"applyDilation 5 x 3", checkDilation, 503},
+    {"applyDilation 4 x 6", checkDilation, 406},
+    {"applyDilation 16 x 9", checkDilation, 1609},
+    {"applyCannyEdgeDetection sigma 1.0", checkCanny, 10},
+    {"applyCannyEdgeDetection sigma 2.5", checkCanny, 25},
+    {"computeSSIM noise 8", checkSsim, 8},
+    {"computeSSIM noise 40", checkSsim, 40},
+    {"compareImagesDetailed tolerance 0", checkComparison, 0},
+    {"compareImagesDetailed tolerance 10", checkComparison, 10},
+    {"applyGaussianBlur sigma 3.0", checkGaussian, 30},
+    {"applyGaussianBlur sigma 30.0", checkGaussian, 300},
+    {"applyGaussianBlur sigma 12.0", checkGaussian, 120},
+    {"applyBoxGaussianBlur sigma 1.5", checkBoxGaussian, 15},
+    {"applyBoxGaussianBlur sigma 6.0", checkBoxGaussian, 60},
+};
+
+static BenchResult results[MAX_RESULTS];
+static int resultCount = 0;
+
+/** @brief Read a monotonic clock
+ *
+ * @return The current time in nanoseconds
+ */
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/** @brief Check if a name is present in a comma separated list
+ *
+ * @param list The comma separated list, NULL matches everything
+ * @param name The name to look for
+ *
+ * @return Returns true if the name is in the list
+ */
+static bool inList(const char *list, const char *name) {
+    if (!list)
+        return true;
+
+    size_t nameLength = strlen(name);
+    const char *start = list;
+    while (*start) {
+        const char *end = strchr(start, ',');
+        size_t length = end ? (size_t)(end - start) : strlen(start);
+        if (length == nameLength && strncmp(start, name, length) == 0)
+            return true;
+        if (!end)
+            break;
+        start = end + 1;
+    }
+    return false;
+}
+
+/** @brief Store a result and print it as a table row
+ *
+ * @param imageName The name of the benchmarked image
+ * @param operationName The name of the benchmarked operation
+ * @param img The input image (for the dimensions)
+ * @param times The time of each repetition in nanoseconds (will be sorted)
+ * @param repetitions The number of repetitions
+ */
+static void recordResult(const char *imageName, const char *operationName, const Image *img, double *times, int repetitions) {
+    if (resultCount >= MAX_RESULTS) {
+        printf("Too many results, ignoring %s on %s\n", operationName, imageName);
+        return;
+    }
+
+    qsort(times, repetitions, sizeof(double), compareDoubles);
+    double median = (repetitions % 2) ? times[repetitions / 2] : 0.5 * (times[repetitions / 2 - 1] + times[repetitions / 2]);
+    double pixelCount = (double)img->width * img->height;
+    double byteCount = pixelCount * img->channels;
+
+    BenchResult *result = &results[resultCount++];
+    snprintf(result->image, sizeof(result->image), "%s", imageName);
+    snprintf(result->operation, sizeof(result->operation), "%s", operationName);
+    result->width = img->width;
+    result->height = img->height;
+    result->channels = img->channels;
+    result->repetitions = repetitions;
+    result->medianNs = median;
+    result->minNs = times[0];
+    result->nsPerPixel = median / pixelCount;
+    result->megabytesPerSecond = byteCount / (median * 1e-9) / 1e6;
+
+    printf("%-24s %-20s %6d x %-6d %2d ch  %12.3f ns/px  %10.2f MB/s\n", imageName, operationName, img->width, img->height,
+           img->channels, result->nsPerPixel, result->megabytesPerSecond);
+    fflush(stdout);
+}
+
+/** @brief Time every selected filter operation on an image
+ *
+ * @param imageName The name that will be reported for the image
+ * @param img The input image
+ * @param opsFilter The comma separated list of operations to run, NULL runs all
+ * @param warmup The number of untimed runs
+ * @param repetitions The number of timed runs
+ */
+static void benchmarkFilters(const char *imageName, const Image *img, const char *opsFilter, int warmup, int repetitions) {
+    double times[MAX_REPETITIONS];
+
+    for (int op = 0; op < operationCount; op++) {
+        if (!inList(opsFilter, operations[op].name))
+            continue;
+
+        for (int i = 0; i < warmup; i++) {
+            Image *output = operations[op].run(img, operations[op].param);
+            if (output)
+                freeImage(output);
+        }
+
+        for (int i = 0; i < repetitions; i++) {
+            double start = nowNs();
+            Image *output = operations[op].run(img, operations[op].param);
+            times[i] = nowNs() - start;
+            if (output)
+                freeImage(output);
+        }
+
+        recordResult(imageName, operations[op].name, img, times, repetitions);
+    }
+}
+
+/** @brief Time loadImageScaled at each scale of a JPEG file written from an image
+ *
+ * @param imageName The name that will be reported for the image
+ * @param img The image to encode
+ * @param opsFilter The comma separated list of operations to run, NULL runs all
+ * @param warmup The number of untimed runs
+ * @param repetitions The number of timed runs
+ */
+static void benchmarkScaledLoad(const char *imageName, const Image *img, const char *opsFilter, int warmup, int repetitions) {
+    const char *tempFile = "benchmark_tmp.jpg";
+    double times[MAX_REPETITIONS];
+    bool written = false;
+
+    for (int denominator = 2; denominator <= 8; denominator *= 2) {
+        char name[32];
+        snprintf(name, sizeof(name), "loadImageScaled_%d", denominator);
+        if (!inList(opsFilter, name))
+            continue;
+        if (!written && !stbi_write_jpg(tempFile, img->width, img->height, img->channels, img->pixels, 90)) {
+            printf("Error writing %s\n", tempFile);
+            return;
+        }
+        written = true;
+
+        for (int i = 0; i < warmup + repetitions; i++) {
+            double start = nowNs();
+            Image *loaded = loadImageScaled(tempFile, denominator);
+            if (i >= warmup)
+                times[i - warmup] = nowNs() - start;
+            if (loaded)
+                freeImage(loaded);
+        }
+        recordResult(imageName, name, img, times, repetitions);
+    }
+
+    if (written)
+        remove(tempFile);
+}
+
+/** @brief Time saveImage and loadImage of an image through a temporary file, and loadImageScaled through a JPEG file
+ *
+ * @param imageName The name that will be reported for the image
+ * @param img The image to save and load back
+ * @param opsFilter The comma separated list of operations to run, NULL runs all
+ * @param warmup The number of untimed runs
+ * @param repetitions The number of timed runs
+ */
+static void benchmarkIO(const char *imageName, const Image *img, const char *opsFilter, int warmup, int repetitions) {
+    const char *tempFile = "benchmark_tmp.png";
+    double times[MAX_REPETITIONS];
+    bool runSave = inList(opsFilter, "saveImage");
+    bool runLoad = inList(opsFilter, "loadImage");
+
+    benchmarkScaledLoad(imageName, img, opsFilter, warmup, repetitions);
+    if (!runSave && !runLoad)
+        return;
+
+    for (int i = 0; i < warmup; i++)
+        saveImage(tempFile, img);
+    for (int i = 0; i < repetitions; i++) {
+        double start = nowNs();
+        saveImage(tempFile, img);
+        times[i] = nowNs() - start;
+    }
+    if (runSave)
+        recordResult(imageName, "saveImage", img, times, repetitions);
+
+    if (runLoad) {
+        for (int i = 0; i < warmup; i++) {
+            Image *loaded = loadImage(tempFile);
+            if (loaded)
+                freeImage(loaded);
+        }
+        for (int i = 0; i < repetitions; i++) {
+            double start = nowNs();
+            Image *loaded = loadImage(tempFile);
+            times[i] = nowNs() - start;
+            if (loaded)
+                freeImage(loaded);
+        }
+        recordResult(imageName, "loadImage", img, times, repetitions);
+    }
+
+    remove(tempFile);
+}
+
+/** @brief Create a deterministic RGB test image (gradients plus noise)
+ *
+ * @param width The width of the image
+ * @param height The height of the image
+ *
+ * @return The synthetic image, or NULL if the memory could not be allocated
+ */
+static Image *createSyntheticImage(int width, int height) {
+    Image *img = (Image *)malloc(sizeof(Image));
+    if (!img) {
+        printf("Error allocating memory for synthetic image\n");
+        return NULL;
+    }
+
+    img->width = width;
+    img->height = height;
+    img->channels = 3;
+    img->pixelType = PIXEL_U8;
+    img->pixels = (unsigned char *)malloc((size_t)width * height * 3);
+    if (!img->pixels) {
+        free(img);
+        printf("Error allocating memory for synthetic image pixels\n");
+        return NULL;
+    }
+
+    unsigned int seed = 12345;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            seed = seed * 1103515245u + 12345u;
+            unsigned char *pixel = img->pixels + ((size_t)y * width + x) * 3;
+            pixel[0] = (unsigned char)((x * 255) / width);
+            pixel[1] = (unsigned char)((y * 255) / height);
+            pixel[2] = (unsigned char)(seed >> 24);
+        }
+    }
+
+    return img;
+}
+
+/** @brief Write all results as JSON
+ *
+ * @param filename The name of the JSON file
+ * @param warmup The number of warm-up runs used
+ * @param repetitions The number of timed runs used
+ */
+static void writeJson(const char *filename, int warmup, int repetitions) {
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        printf("Error opening JSON output: %s\n", filename);
+        return;
+    }
+
+    fprintf(file, "{\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"results\": [\n", warmup, repetitions);
+    for (int i = 0; i < resultCount; i++) {
+        const BenchResult *r = &results[i];
+        fprintf(file,
+                "    {\"image\": \"%s\", \"operation\": \"%s\", \"width\": %d, \"height\": %d, \"channels\": %d, "
+                "\"repetitions\": %d, \"median_ns\": %.0f, \"min_ns\": %.0f, \"ns_per_pixel\": %.4f, \"mb_per_s\": %.3f}%s\n",
+                r->image, r->operation, r->width, r->height, r->channels, r->repetitions, r->medianNs, r->minNs, r->nsPerPixel,
+                r->megabytesPerSecond, i + 1 < resultCount ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+
+    printf("Results written to %s\n", filename);
+}
+
+/** @brief Compare the output of every code path against the reference images, and the paths without one against
+ * the references of referenceChecks
+ *
+ * @param imageDir The folder with the input images
+ * @param resultsDir The folder with the reference images
+ *
+ * @return The number of failed comparisons
+ */
+static int checkGoldens(const char *imageDir, const char *resultsDir) {
+    int failures = 0;
+    int checks = 0;
+
+    // Dispatch levels and thread counts to cover, unless forced by the environment
+    int firstLevel = getenv("IMAGE_DISPATCH") ? getDispatchLevel() : DISPATCH_SCALAR;
+    int lastLevel = getenv("IMAGE_DISPATCH") ? getDispatchLevel() : getMaxDispatchLevel();
+    int threadOptions[2] = {1, getThreadCount() > 1 ? getThreadCount() : 4};
+    int threadOptionCount = getenv("IMAGE_THREADS") ? 1 : 2;
+    if (getenv("IMAGE_THREADS"))
+        threadOptions[0] = getThreadCount();
+
+    for (size_t i = 0; i < sizeof(goldenImages) / sizeof(goldenImages[0]); i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s.png", imageDir, goldenImages[i]);
+        Image *original = loadImage(path);
+        if (!original) {
+            failures++;
+            continue;
+        }
+        Image *img = convertBnW(original);
+
+        for (size_t c = 0; c < sizeof(goldenCases) / sizeof(goldenCases[0]); c++) {
+            snprintf(path, sizeof(path), "%s/%s_%s.png", resultsDir, goldenImages[i], goldenCases[c].suffix);
+            Image *expected = loadImage(path);
+            if (!expected) {
+                failures++;
+                continue;
+            }
+
+            for (int level = firstLevel; level <= lastLevel; level++) {
+                for (int t = 0; t < threadOptionCount; t++) {
+                    setDispatchLevel((DispatchLevel)level);
+                    setThreadCount(threadOptions[t]);
+
+                    Image *output = goldenCases[c].run(img, goldenCases[c].param);
+                    bool same = output && compareImages(output, expected);
+                    printf("%s %s_%s%s%s%s [%s, %d threads]\n", same ? "PASS" : "FAIL", goldenImages[i], goldenCases[c].suffix,
+                           goldenCases[c].variant ? " (" : "", goldenCases[c].variant ? goldenCases[c].variant : "",
+                           goldenCases[c].variant ? ")" : "", dispatchLevelName((DispatchLevel)level), threadOptions[t]);
+                    checks++;
+                    if (!same)
+                        failures++;
+                    if (output)
+                        freeImage(output);
+                }
+            }
+            freeImage(expected);
+        }
+        freeImage(img);
+
+        for (size_t c = 0; c < sizeof(referenceChecks) / sizeof(referenceChecks[0]); c++) {
+            for (int level = firstLevel; level <= lastLevel; level++) {
+                for (int t = 0; t < threadOptionCount; t++) {
+                    setDispatchLevel((DispatchLevel)level);
+                    setThreadCount(threadOptions[t]);
+
+                    bool matched = referenceChecks[c].check(original, referenceChecks[c].param);
+                    printf("%s %s %s [%s, %d threads]\n", matched ? "PASS" : "FAIL", goldenImages[i], referenceChecks[c].name,
+                           dispatchLevelName((DispatchLevel)level), threadOptions[t]);
+                    checks++;
+                    if (!matched)
+                        failures++;
+                }
+            }
+        }
+        freeImage(original);
+    }
+
+    printf("%d of %d checks passed\n", checks - failures, checks);
+    return failures;
+}
+
+static void printUsage(const char *program) {
+    printf("Usage: %s [--images DIR] [--sizes 4k,8k,16k|none] [--ops name,...] [--warmup N] [--reps N] [--json FILE]\n", program);
+    printf("       %s --check [--images DIR] [--results DIR]\n", program);
+    printf("Operations: loadImage, saveImage, loadImageScaled_2, loadImageScaled_4, loadImageScaled_8");
+    for (int op = 0; op < operationCount; op++)
+        printf(", %s", operations[op].name);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    const char *imageDir = "test_images";
+    const char *resultsDir = "test_results";
+    bool check = false;
+    const char *sizes = "4k,8k,16k";
+    const char *opsFilter = NULL;
+    const char *jsonFile = "benchmark_results.json";
+    int warmup = 1;
+    int repetitions = 5;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--check") == 0) {
+            check = true;
+        } else if (strcmp(argv[i], "--results") == 0 && hasValue) {
+            resultsDir = argv[++i];
+        } else if (strcmp(argv[i], "--images") == 0 && hasValue) {
+            imageDir = argv[++i];
+        } else if (strcmp(argv[i], "--sizes") == 0 && hasValue) {
+            sizes = argv[++i];
+        } else if (strcmp(argv[i], "--ops") == 0 && hasValue) {
+            opsFilter = argv[++i];
+        } else if (strcmp(argv[i], "--warmup") == 0 && hasValue) {
+            warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--reps") == 0 && hasValue) {
+            repetitions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0 && hasValue) {
+            jsonFile = argv[++i];
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (check)
+        return checkGoldens(imageDir, resultsDir) ? 1 : 0;
+
+    if (warmup < 0 || repetitions < 1 || repetitions > MAX_REPETITIONS) {
+        printf("Warm-up must be at least 0 and repetitions between 1 and %d\n", MAX_REPETITIONS);
+        return 1;
+    }
+
+    // Images of the test set
+    static const char *testImages[] = {
+        "blob.png", "bluegill.png", "cat.png", "centered_pixel.png", "chess.png", "construct.png", "mushroom.png",
+        "pattern.png", "pigbird.png", "python.png", "sparrowchick.png", "tree.png", "twocats.png",
+    };
+    for (size_t i = 0; i < sizeof(testImages) / sizeof(testImages[0]); i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", imageDir, testImages[i]);
+
+        Image *img = loadImage(path);
+        if (!img)
+            continue;
+
+        benchmarkIO(testImages[i], img, opsFilter, warmup, repetitions);
+        benchmarkFilters(testImages[i], img, opsFilter, warmup, repetitions);
+        freeImage(img);
+    }
+
+    // Synthetic images
+    for (size_t i = 0; i < sizeof(syntheticSizes) / sizeof(syntheticSizes[0]); i++) {
+        if (!inList(sizes, syntheticSizes[i].name))
+            continue;
+
+        Image *img = createSyntheticImage(syntheticSizes[i].width, syntheticSizes[i].height);
+        if (!img)
+            continue;
+
+        char name[64];
+        snprintf(name, sizeof(name), "synthetic_%s", syntheticSizes[i].name);
+        benchmarkIO(name, img, opsFilter, warmup, repetitions);
+        benchmarkFilters(name, img, opsFilter, warmup, repetitions);
+        freeImage(img);
+    }
+
+    writeJson(jsonFile, warmup, repetitions);
+    return 0;
+}
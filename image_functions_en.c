@@ -2,19 +2,67 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h" // For loading images
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h" // For saving images
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_X86_SIMD
+#include <immintrin.h> // For the SSE2/AVX2 code paths
+#endif
+
+#if defined(_WIN32) && !defined(IMAGE_NO_THREADS)
+#define IMAGE_NO_THREADS
+#endif
+#ifndef IMAGE_NO_THREADS
+#include <pthread.h> // For the multithreaded code paths
+#include <unistd.h>
+#endif
+
+#define MAX_THREADS 64
+
+// Types the pixel values can be stored as
+typedef enum {
+    PIXEL_U8,  // 0 to 255
+    PIXEL_U16, // 0 to 65535
+    PIXEL_F32, // 0 to 1, values outside the range are kept
+} PixelType;
+
 // Structure to hold image information
 typedef struct {
     int width;
     int height;
     int channels;
-    unsigned char *pixels;
+    unsigned char *pixels; // Holds unsigned short or float values for PIXEL_U16 and PIXEL_F32 images
+    PixelType pixelType;
 } Image;
 
+/** @brief Get the size of one pixel value of a type
+ *
+ * @param type The pixel type
+ *
+ * @return The size in bytes
+ */
+size_t pixelTypeSize(PixelType type) {
+    return type == PIXEL_U8 ? 1 : (type == PIXEL_U16 ? sizeof(unsigned short) : sizeof(float));
+}
+
+/** @brief Check that an image stores 8 bit values, for the functions that only handle those
+ *
+ * @param img The image
+ * @param function The name of the function, for the error message
+ *
+ * @return True if the image is PIXEL_U8
+ */
+static bool requirePixelU8(const Image *img, const char *function) {
+    if (img->pixelType == PIXEL_U8)
+        return true;
+    printf("%s only supports 8 bit images\n", function);
+    return false;
+}
+
 /** @brief Load an image from a file
  *
  * @param filename The name of the file to load
@@ -41,19 +89,178 @@ Image *loadImage(const char *filename) {
     img->height = height;
     img->channels = channels;
     img->pixels = imgData;
+    img->pixelType = PIXEL_U8;
+
+    printf("Image loaded: %s, dimensions: %d x %d, channels: %d\n", filename, width, height, channels);
+    return img;
+}
+
+/** @brief Load an image from a file, with its values stored as a given pixel type
+ *
+ * 16 bit files keep their precision as PIXEL_U16 or PIXEL_F32; 8 bit files are scaled to the range of the type.
+ * HDR files loaded as PIXEL_F32 keep their linear values.
+ *
+ * @param filename The name of the file to load
+ * @param type The pixel type of the loaded image
+ *
+ * @return Returns a pointer to the loaded image, or NULL if the image could not be loaded
+ */
+Image *loadImageAs(const char *filename, PixelType type) {
+    if (type == PIXEL_U8)
+        return loadImage(filename);
+
+    int width, height, channels;
+    void *imgData;
+    bool hdr = type == PIXEL_F32 && stbi_is_hdr(filename);
+    if (hdr)
+        imgData = stbi_loadf(filename, &width, &height, &channels, 0);
+    else
+        imgData = stbi_load_16(filename, &width, &height, &channels, 0);
+    if (!imgData) {
+        printf("Error loading image: %s\n", filename);
+        return NULL;
+    }
+
+    Image *img = (Image *)malloc(sizeof(Image));
+    if (!img) {
+        printf("Error allocating memory for image structure.\n");
+        stbi_image_free(imgData);
+        return NULL;
+    }
+
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->pixelType = type;
+    img->pixels = (unsigned char *)imgData;
+
+    if (type == PIXEL_F32 && !hdr) {
+        // Scale the 16 bit values into their own buffer (reusing the memory would alias the two types)
+        size_t count = (size_t)width * height * channels;
+        float *floats = (float *)malloc(count * sizeof(float));
+        if (!floats) {
+            printf("Error allocating memory for image pixels\n");
+            stbi_image_free(imgData);
+            free(img);
+            return NULL;
+        }
+        const unsigned short *words = (const unsigned short *)imgData;
+        for (size_t i = 0; i < count; i++)
+            floats[i] = words[i] / 65535.0f;
+        stbi_image_free(imgData);
+        img->pixels = (unsigned char *)floats;
+    }
 
     printf("Image loaded: %s, dimensions: %d x %d, channels: %d\n", filename, width, height, channels);
     return img;
 }
 
+/** @brief Write a 16 bit PNG file (stb_image_write only writes 8 bit PNG)
+ *
+ * Uses the compressor and the chunk helpers of stb_image_write, with the "up" filter on every row.
+ * PIXEL_F32 values are clamped to 0-1.
+ *
+ * @param filename The name the file will be saved as
+ * @param img A PIXEL_U16 or PIXEL_F32 image
+ *
+ * @return True if the file was written
+ */
+static bool writePng16(const char *filename, const Image *img) {
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    static const unsigned char colorTypes[5] = {0, 0, 4, 2, 6};
+    const size_t rowBytes = (size_t)img->width * img->channels * 2;
+    const size_t filteredSize = (rowBytes + 1) * img->height;
+    if (img->channels < 1 || img->channels > 4 || filteredSize > 0x7FFFFFFF)
+        return false;
+
+    unsigned char *filtered = (unsigned char *)malloc(filteredSize);
+    if (!filtered)
+        return false;
+
+    // Big endian samples, each row preceded by its filter type
+    for (int y = 0; y < img->height; y++) {
+        unsigned char *row = filtered + y * (rowBytes + 1);
+        row[0] = y > 0 ? 2 : 0;
+        for (size_t i = 0; i < rowBytes / 2; i++) {
+            size_t index = (size_t)y * (rowBytes / 2) + i;
+            unsigned int value;
+            if (img->pixelType == PIXEL_U16) {
+                value = ((const unsigned short *)img->pixels)[index];
+            } else {
+                float scaled = ((const float *)img->pixels)[index] * 65535.0f + 0.5f;
+                value = (unsigned int)(scaled < 0.0f ? 0.0f : (scaled > 65535.0f ? 65535.0f : scaled));
+            }
+            row[1 + 2 * i] = (unsigned char)(value >> 8);
+            row[2 + 2 * i] = (unsigned char)value;
+        }
+    }
+    for (int y = img->height - 1; y > 0; y--) {
+        unsigned char *row = filtered + y * (rowBytes + 1) + 1;
+        for (size_t i = 0; i < rowBytes; i++)
+            row[i] -= row[i - (rowBytes + 1)];
+    }
+
+    int zlibSize;
+    unsigned char *zlib = stbi_zlib_compress(filtered, (int)filteredSize, &zlibSize, stbi_write_png_compression_level);
+    free(filtered);
+    if (!zlib)
+        return false;
+
+    // Each chunk has 12 bytes of length, tag and CRC around its data
+    int fileSize = 8 + 12 + 13 + 12 + zlibSize + 12;
+    unsigned char *file = (unsigned char *)malloc(fileSize);
+    if (!file) {
+        STBIW_FREE(zlib);
+        return false;
+    }
+
+    unsigned char *o = file;
+    memcpy(o, signature, 8);
+    o += 8;
+    stbiw__wp32(o, 13);
+    stbiw__wptag(o, "IHDR");
+    stbiw__wp32(o, img->width);
+    stbiw__wp32(o, img->height);
+    *o++ = 16;
+    *o++ = colorTypes[img->channels];
+    *o++ = 0;
+    *o++ = 0;
+    *o++ = 0;
+    stbiw__wpcrc(&o, 13);
+
+    stbiw__wp32(o, zlibSize);
+    stbiw__wptag(o, "IDAT");
+    memcpy(o, zlib, zlibSize);
+    o += zlibSize;
+    STBIW_FREE(zlib);
+    stbiw__wpcrc(&o, zlibSize);
+
+    stbiw__wp32(o, 0);
+    stbiw__wptag(o, "IEND");
+    stbiw__wpcrc(&o, 0);
+
+    FILE *f = fopen(filename, "wb");
+    bool written = f && fwrite(file, 1, fileSize, f) == (size_t)fileSize;
+    if (f)
+        written = fclose(f) == 0 && written;
+    free(file);
+    return written;
+}
+
 /** @brief Save an image to a file
+ *
+ * 16 bit and float images are saved as 16 bit PNG.
  *
  * @param filename The name the file will be saved as
  * @param img The image that will be saved
  *
  */
 void saveImage(const char *filename, const Image *img) {
-    bool imageSaved = stbi_write_png(filename, img->width, img->height, img->channels, img->pixels, img->width * img->channels);
+    bool imageSaved;
+    if (img->pixelType == PIXEL_U8)
+        imageSaved = stbi_write_png(filename, img->width, img->height, img->channels, img->pixels, img->width * img->channels);
+    else
+        imageSaved = writePng16(filename, img);
 
     if (imageSaved) {
         printf("Image saved successfully: %s\n", filename);
@@ -71,6 +278,48 @@ void freeImage(Image *img) {
     free(img);
 }
 
+/** @brief Create an image with uninitialized pixels of a given type
+ *
+ * @param width The width of the image
+ * @param height The height of the image
+ * @param channels The number of channels
+ * @param type The pixel type
+ *
+ * @return The new image, or NULL if the memory could not be allocated
+ */
+Image *createImageOfType(int width, int height, int channels, PixelType type) {
+    Image *img = (Image *)malloc(sizeof(Image));
+    if (!img) {
+        printf("Error allocating memory for image\n");
+        return NULL;
+    }
+
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->pixelType = type;
+    img->pixels = (unsigned char *)malloc((size_t)width * height * channels * pixelTypeSize(type));
+    if (!img->pixels) {
+        free(img);
+        printf("Error allocating memory for image pixels\n");
+        return NULL;
+    }
+
+    return img;
+}
+
+/** @brief Create an image with uninitialized pixels
+ *
+ * @param width The width of the image
+ * @param height The height of the image
+ * @param channels The number of channels
+ *
+ * @return The new image, or NULL if the memory could not be allocated
+ */
+Image *createImage(int width, int height, int channels) {
+    return createImageOfType(width, height, channels, PIXEL_U8);
+}
+
 /** @brief Clamp a value to a range
  *
  * @param value The value that will be clamped
@@ -87,200 +336,2361 @@ int clamp(int value, int min, int max) {
     return value;
 }
 
-/** @brief Invert the colors of an image
+// Code paths that the optimized functions can run
+typedef enum {
+    DISPATCH_SCALAR,
+    DISPATCH_SSE2,
+    DISPATCH_AVX2,
+} DispatchLevel;
+
+static int dispatchLevel = -1;
+static int threadCount = 0;
+
+/** @brief Get the name of a dispatch level
  *
- * @param img The image that will be inverted
+ * @param level The dispatch level
  *
- * @return The inverted image
+ * @return The name used by the IMAGE_DISPATCH environment variable
  */
-Image *invertPixels(const Image *img) {
-    Image *invertedImage = (Image *)malloc(sizeof(Image));
-    if (!invertedImage) {
-        printf("Error allocating memory for inverted image\n");
-        return NULL;
-    }
-
-    invertedImage->width = img->width;
-    invertedImage->height = img->height;
-    invertedImage->channels = img->channels;
-    invertedImage->pixels = (unsigned char *)malloc(img->width * img->height * img->channels * sizeof(unsigned char));
-    if (!invertedImage->pixels) {
-        free(invertedImage);
-        printf("Error allocating memory for inverted image pixels\n");
-        return NULL;
+const char *dispatchLevelName(DispatchLevel level) {
+    switch (level) {
+    case DISPATCH_SSE2:
+        return "sse2";
+    case DISPATCH_AVX2:
+        return "avx2";
+    default:
+        return "scalar";
     }
+}
 
-    // Invert the pixel values
-    for (int i = 0; i < img->width * img->height * img->channels; ++i) {
-        invertedImage->pixels[i] = 255 - img->pixels[i];
-    }
+/** @brief Get the best dispatch level supported by the CPU
+ *
+ * @return The highest dispatch level that can run on this machine
+ */
+DispatchLevel getMaxDispatchLevel(void) {
+#ifdef IMAGE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return DISPATCH_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return DISPATCH_SSE2;
+#endif
+    return DISPATCH_SCALAR;
+}
 
-    return invertedImage;
+/** @brief Force a dispatch level (it is limited to what the CPU supports)
+ *
+ * @param level The dispatch level that will be used
+ */
+void setDispatchLevel(DispatchLevel level) {
+    DispatchLevel maxLevel = getMaxDispatchLevel();
+    dispatchLevel = level > maxLevel ? maxLevel : level;
 }
 
-/** @brief Convert an image to black and white
+/** @brief Get the dispatch level used by the optimized functions
  *
- * @param img The image that will be converted
+ * The first call reads the IMAGE_DISPATCH environment variable (scalar, sse2 or avx2),
+ * otherwise the best level supported by the CPU is used.
  *
- * @return The black and white image
+ * @return The current dispatch level
  */
-Image *convertBnW(const Image *img) {
-    Image *convertedImage = (Image *)malloc(sizeof(Image));
-    if (!convertedImage) {
-        printf("Error allocating memory for converted image\n");
-        return NULL;
+DispatchLevel getDispatchLevel(void) {
+    if (dispatchLevel < 0) {
+        DispatchLevel level = getMaxDispatchLevel();
+        const char *forced = getenv("IMAGE_DISPATCH");
+        if (forced) {
+            for (int i = DISPATCH_SCALAR; i <= DISPATCH_AVX2; i++) {
+                if (strcmp(forced, dispatchLevelName((DispatchLevel)i)) == 0)
+                    level = (DispatchLevel)i;
+            }
+        }
+        setDispatchLevel(level);
     }
+    return (DispatchLevel)dispatchLevel;
+}
 
-    unsigned char *BnWPixels = (unsigned char *)malloc(img->width * img->height * sizeof(unsigned char));
-    if (!BnWPixels) {
-        printf("Error allocating memory for BnW pixels\n");
-        free(convertedImage);
-        return NULL;
-    }
+/** @brief Set the number of threads used by the multithreaded functions
+ *
+ * @param count The number of threads (1 disables threading)
+ */
+void setThreadCount(int count) {
+    threadCount = clamp(count, 1, MAX_THREADS);
+}
 
-    // Convert the pixel to black and white based on the number of channels
-    for (int i = 0; i < img->width * img->height; ++i) {
-        if (img->channels == 3 || img->channels == 4) {
-            unsigned char r = img->pixels[i * img->channels];
-            unsigned char g = img->pixels[i * img->channels + 1];
-            unsigned char b = img->pixels[i * img->channels + 2];
-            BnWPixels[i] = (unsigned char)round(0.299 * r + 0.587 * g + 0.114 * b);
-        } else if (img->channels == 2) {
-            BnWPixels[i] = img->pixels[i * img->channels];
-        } else if (img->channels == 1) {
-            BnWPixels[i] = img->pixels[i];
-        } else {
-            printf("Unsupported image type");
-            free(BnWPixels);
-            free(convertedImage);
-            return NULL;
-        }
+/** @brief Get the number of threads used by the multithreaded functions
+ *
+ * The first call reads the IMAGE_THREADS environment variable, otherwise the number of online CPUs is used.
+ *
+ * @return The current number of threads
+ */
+int getThreadCount(void) {
+    if (threadCount < 1) {
+        int count = 1;
+#ifndef IMAGE_NO_THREADS
+        count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        const char *forced = getenv("IMAGE_THREADS");
+        if (forced && atoi(forced) > 0)
+            count = atoi(forced);
+        setThreadCount(count);
     }
+    return threadCount;
+}
 
-    convertedImage->width = img->width;
-    convertedImage->height = img->height;
-    convertedImage->channels = 1;
-    convertedImage->pixels = BnWPixels;
+// Function that processes the range [start, end) of a parallel loop
+typedef void (*ParallelTask)(void *context, int start, int end);
 
-    return convertedImage;
+// Part of a parallel loop given to one thread
+typedef struct {
+    ParallelTask task;
+    void *context;
+    int start;
+    int end;
+} ParallelChunk;
+
+#ifndef IMAGE_NO_THREADS
+static void *runParallelChunk(void *arg) {
+    ParallelChunk *chunk = (ParallelChunk *)arg;
+    chunk->task(chunk->context, chunk->start, chunk->end);
+    return NULL;
 }
+#endif
 
-/** @brief Apply a kernel to an image
+/** @brief Run a loop over [0, count) split in contiguous chunks, one per thread
  *
- * @param img The image that will be applied the kernel
- * @param kernel The kernel that will be applied to the image
- * @param kernelSize The size of one side of the kernel
- *
- * @return The image after the kernel has been applied
+ * @param count The number of iterations (e.g. rows of an image)
+ * @param minChunk The minimum number of iterations given to a thread
+ * @param task The function that processes a chunk
+ * @param context The data passed to the task
  */
-Image *applyKernel(const Image *img, const float *kernel, const int kernelSize) {
-    Image *output = (Image *)malloc(sizeof(Image));
-    if (!output) {
-        printf("Error allocating memory for output image\n");
-        return NULL;
+void parallelFor(int count, int minChunk, ParallelTask task, void *context) {
+    int threads = getThreadCount();
+    if (minChunk < 1)
+        minChunk = 1;
+    if (threads > count / minChunk)
+        threads = count / minChunk;
+
+    if (threads <= 1) {
+        if (count > 0)
+            task(context, 0, count);
+        return;
     }
 
-    output->width = img->width;
-    output->height = img->height;
-    output->channels = img->channels;
-    output->pixels = (unsigned char *)malloc(img->width * img->height * img->channels * sizeof(unsigned char));
-    if (!output->pixels) {
-        free(output);
-        printf("Error allocating memory for output image\n");
-        return NULL;
+#ifdef IMAGE_NO_THREADS
+    task(context, 0, count);
+#else
+    ParallelChunk chunks[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    bool started[MAX_THREADS];
+
+    for (int i = 0; i < threads; i++) {
+        chunks[i].task = task;
+        chunks[i].context = context;
+        chunks[i].start = (int)((long long)count * i / threads);
+        chunks[i].end = (int)((long long)count * (i + 1) / threads);
     }
 
-    // Traverse each pixel in the image
-    for (int imgY = 0; imgY < img->height; imgY++) {
-        for (int imgX = 0; imgX < img->width; imgX++) {
-            // Process each channel (e.g., R, G, B for RGB)
-            for (int channelIndex = 0; channelIndex < img->channels; channelIndex++) {
-                float pixelValue = 0.0f;
+    // The calling thread runs the first chunk, and any chunk whose thread could not be created
+    for (int i = 1; i < threads; i++) {
+        started[i] = pthread_create(&ids[i], NULL, runParallelChunk, &chunks[i]) == 0;
+    }
+    task(context, chunks[0].start, chunks[0].end);
+    for (int i = 1; i < threads; i++) {
+        if (started[i])
+            pthread_join(ids[i], NULL);
+        else
+            task(context, chunks[i].start, chunks[i].end);
+    }
+#endif
+}
 
-                // Traverse each position in the kernel
-                for (int kernelY = -kernelSize / 2; kernelY <= kernelSize / 2; kernelY++) {
-                    for (int kernelX = -kernelSize / 2; kernelX <= kernelSize / 2; kernelX++) {
+/** @brief Invert a sequence of bytes (255 - value)
+ *
+ * @param src The bytes that will be inverted
+ * @param dst Where the inverted bytes will be written
+ * @param count The number of bytes
+ */
+static void invertBytesScalar(const unsigned char *src, unsigned char *dst, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = 255 - src[i];
+    }
+}
 
-                        // Calculate the position of the neighboring pixel, clamped to image boundaries
-                        int pixelX = clamp(imgX + kernelX, 0, img->width - 1);
-                        int pixelY = clamp(imgY + kernelY, 0, img->height - 1);
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("sse2"))) static void invertBytesSSE2(const unsigned char *src, unsigned char *dst, size_t count) {
+    const __m128i ones = _mm_set1_epi8((char)0xFF);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i value = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(value, ones));
+    }
+    invertBytesScalar(src + i, dst + i, count - i);
+}
 
-                        // Calculate the position (index) in the image and kernel
-                        int pixelIndex = (pixelY * img->width + pixelX) * img->channels + channelIndex;
-                        int kernelIndex = (kernelY + kernelSize / 2) * kernelSize + (kernelX + kernelSize / 2);
+__attribute__((target("avx2"))) static void invertBytesAVX2(const unsigned char *src, unsigned char *dst, size_t count) {
+    const __m256i ones = _mm256_set1_epi8((char)0xFF);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i value = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(value, ones));
+    }
+    invertBytesScalar(src + i, dst + i, count - i);
+}
+#endif
 
-                        pixelValue += img->pixels[pixelIndex] * kernel[kernelIndex];
-                    }
-                }
+// Data shared by the threads of invertPixels
+typedef struct {
+    const unsigned char *src;
+    unsigned char *dst;
+    size_t rowBytes;
+    DispatchLevel level;
+} InvertTask;
 
-                // Clamp the pixel value to the 0-255 range
-                pixelValue = clamp((int)pixelValue, 0, 255);
+static void invertRows(void *context, int startRow, int endRow) {
+    InvertTask *task = (InvertTask *)context;
+    const unsigned char *src = task->src + startRow * task->rowBytes;
+    unsigned char *dst = task->dst + startRow * task->rowBytes;
+    size_t count = (endRow - startRow) * task->rowBytes;
 
-                // Set the output pixel value
-                int outputIndex = (imgY * img->width + imgX) * img->channels + channelIndex;
-                output->pixels[outputIndex] = (unsigned char)pixelValue;
-            }
-        }
+#ifdef IMAGE_X86_SIMD
+    if (task->level == DISPATCH_AVX2) {
+        invertBytesAVX2(src, dst, count);
+        return;
     }
-
-    return output;
+    if (task->level == DISPATCH_SSE2) {
+        invertBytesSSE2(src, dst, count);
+        return;
+    }
+#endif
+    invertBytesScalar(src, dst, count);
 }
 
-/** @brief Apply a blur effect to an image, based on a value of blurLevel that will transform in a kernel of size (blurLevel * 2 + 1)
+/** @brief Create the kernel of applyBlur: (level * 2 + 1) squared equal weights
  *
- * @param img The image that will be applied the blur
- * @param blurLevel: The amount of blur applied (starting at 1)
+ * @param level The blur level (at least 1)
  *
- * @return The blurred image
+ * @return The kernel, or NULL if the memory could not be allocated
  */
-Image *applyBlur(const Image *img, int blurLevel) {
-    if (blurLevel < 1) {
-        printf("Blur level must be at least 1\n");
-        return NULL;
-    }
-
-    int kernelSize = blurLevel * 2 + 1;
+static float *createBoxKernel(int level) {
+    int kernelSize = level * 2 + 1;
     float *kernel = (float *)malloc(kernelSize * kernelSize * sizeof(float));
     if (!kernel) {
         printf("Error allocating memory for kernel\n");
         return NULL;
     }
 
-    // Create a kernel with equal weights
     float weight = 1.0f / (kernelSize * kernelSize);
-    for (int i = 0; i < kernelSize * kernelSize; i++) {
+    for (int i = 0; i < kernelSize * kernelSize; i++)
         kernel[i] = weight;
-    }
-
-    Image *blurredImage = applyKernel(img, kernel, kernelSize);
+    return kernel;
+}
 
-    free(kernel);
+// A kernel written as a sum of products of a column and a row, K[y][x] = sum of columns[t][y] * rows[t][x]
+typedef struct {
+    int size;
+    int rank;       // The number of terms kept
+    float *columns; // rank columns of size weights, the first one the most significant
+    float *rows;    // rank rows of size weights
+} KernelAnalysis;
 
-    return blurredImage;
-}
+#define KERNEL_SVD_SWEEPS 32     // Maximum number of Jacobi sweeps of the kernel SVD
+#define SEPARABLE_TOLERANCE 1e-5 // Relative error allowed when writing a kernel as a sum of separable terms
+#define KERNEL_CACHE_SIZE 64     // Number of named kernels kept for the whole process
 
-/** @brief Apply a sharpen effect to an image
+/** @brief Decompose a kernel with a one-sided Jacobi SVD, and keep the terms needed to represent it
  *
- * @param img The image that will be applied the sharpen effect
- * @param sharpenLevel The amount of sharpen applied
+ * Terms are dropped while the norm of the dropped singular values stays below SEPARABLE_TOLERANCE of the norm of
+ * the kernel, so a kernel of rank r (up to float rounding) gives r terms.
  *
- * @return The sharpened image
+ * @param kernel The kernel
+ * @param size The size of one side of the kernel
+ * @param analysis Filled with the terms, its columns must be freed with freeKernelAnalysis
+ *
+ * @return True on success, false if the memory could not be allocated
  */
-Image *applySharpen(const Image *img, int sharpenLevel) {
-    if (sharpenLevel < 1) {
-        printf("Sharpen level must be at least 1\n");
-        return NULL;
+static bool analyzeKernel(const float *kernel, int size, KernelAnalysis *analysis) {
+    const int n = size;
+    double *u = (double *)malloc((size_t)2 * n * n * sizeof(double) + n * sizeof(double) + n * sizeof(int));
+    analysis->columns = (float *)malloc((size_t)2 * n * n * sizeof(float));
+    if (!u || !analysis->columns) {
+        free(u);
+        free(analysis->columns);
+        return false;
     }
+    double *v = u + n * n;
+    double *energies = v + n * n; // Squared singular values
+    int *order = (int *)(energies + n);
 
-    Image *sharpenedImage = (Image *)malloc(sizeof(Image));
-    if (!sharpenedImage) {
-        printf("Error allocating memory for sharpened image\n");
-        return NULL;
+    // The columns of u converge to A V, whose norms are the singular values
+    for (int i = 0; i < n * n; i++) {
+        u[i] = kernel[i];
+        v[i] = (i / n == i % n) ? 1.0 : 0.0;
+    }
+    for (int sweep = 0; sweep < KERNEL_SVD_SWEEPS; sweep++) {
+        bool rotated = false;
+        for (int p = 0; p < n - 1; p++) {
+            for (int q = p + 1; q < n; q++) {
+                double alpha = 0.0, beta = 0.0, gamma = 0.0;
+                for (int i = 0; i < n; i++) {
+                    alpha += u[i * n + p] * u[i * n + p];
+                    beta += u[i * n + q] * u[i * n + q];
+                    gamma += u[i * n + p] * u[i * n + q];
+                }
+                if (fabs(gamma) <= 1e-15 * sqrt(alpha * beta))
+                    continue;
+                rotated = true;
+                double zeta = (beta - alpha) / (2.0 * gamma);
+                double t = (zeta >= 0.0 ? 1.0 : -1.0) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+                double c = 1.0 / sqrt(1.0 + t * t);
+                double sn = c * t;
+                for (int i = 0; i < n; i++) {
+                    double up = u[i * n + p], uq = u[i * n + q];
+                    u[i * n + p] = c * up - sn * uq;
+                    u[i * n + q] = sn * up + c * uq;
+                    double vp = v[i * n + p], vq = v[i * n + q];
+                    v[i * n + p] = c * vp - sn * vq;
+                    v[i * n + q] = sn * vp + c * vq;
+                }
+            }
+        }
+        if (!rotated)
+            break;
     }
 
-    sharpenedImage->width = img->width;
+    double total = 0.0;
+    for (int j = 0; j < n; j++) {
+        double energy = 0.0;
+        for (int i = 0; i < n; i++)
+            energy += u[i * n + j] * u[i * n + j];
+        energies[j] = energy;
+        total += energy;
+        order[j] = j;
+    }
+    // Largest singular values first (insertion sort, the kernel sides are small)
+    for (int j = 1; j < n; j++) {
+        int current = order[j];
+        int i = j - 1;
+        for (; i >= 0 && energies[order[i]] < energies[current]; i--)
+            order[i + 1] = order[i];
+        order[i + 1] = current;
+    }
+
+    int rank = n;
+    double dropped = 0.0;
+    while (rank > 1 && dropped + energies[order[rank - 1]] <= SEPARABLE_TOLERANCE * SEPARABLE_TOLERANCE * total) {
+        dropped += energies[order[rank - 1]];
+        rank--;
+    }
+
+    analysis->size = n;
+    analysis->rank = rank;
+    analysis->rows = analysis->columns + n * n;
+    for (int t = 0; t < rank; t++) {
+        for (int i = 0; i < n; i++) {
+            analysis->columns[t * n + i] = (float)u[i * n + order[t]];
+            analysis->rows[t * n + i] = (float)v[i * n + order[t]];
+        }
+    }
+
+    free(u);
+    return true;
+}
+
+static void freeKernelAnalysis(KernelAnalysis *analysis) {
+    free(analysis->columns);
+    analysis->columns = NULL;
+    analysis->rows = NULL;
+}
+
+// Kernels that can be requested by name, with their parameter
+typedef enum {
+    KERNEL_CUSTOM, // Weights given to createKernel, never cached
+    KERNEL_BOX,    // (level * 2 + 1) squared equal weights, the kernel of applyBlur
+} KernelType;
+
+// Weights of a kernel with what the filters precompute from them
+typedef struct {
+    KernelType type;
+    int param;
+    int size;
+    float *weights;         // size * size weights
+    KernelAnalysis factors; // Separable terms of the weights
+    bool cached;            // Owned by the cache, otherwise freed by releaseKernel
+} Kernel;
+
+static Kernel *kernelCache[KERNEL_CACHE_SIZE];
+static int kernelCacheCount = 0;
+#ifndef IMAGE_NO_THREADS
+static pthread_mutex_t kernelCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/** @brief Make a kernel object from weights, taking ownership of them
+ *
+ * @return The kernel, or NULL if the memory could not be allocated (the weights are freed)
+ */
+static Kernel *wrapKernel(float *weights, int size, KernelType type, int param) {
+    Kernel *kernel = (Kernel *)malloc(sizeof(Kernel));
+    bool factored = false;
+    if (kernel && type == KERNEL_BOX) {
+        // Equal weights are the product of two equal rows, no need for the SVD
+        kernel->factors.columns = (float *)malloc((size_t)2 * size * sizeof(float));
+        factored = kernel->factors.columns != NULL;
+        if (factored) {
+            kernel->factors.size = size;
+            kernel->factors.rank = 1;
+            kernel->factors.rows = kernel->factors.columns + size;
+            for (int i = 0; i < 2 * size; i++)
+                kernel->factors.columns[i] = 1.0f / size;
+        }
+    } else if (kernel) {
+        factored = analyzeKernel(weights, size, &kernel->factors);
+    }
+    if (!factored) {
+        printf("Error allocating memory for kernel\n");
+        free(kernel);
+        free(weights);
+        return NULL;
+    }
+    kernel->type = type;
+    kernel->param = param;
+    kernel->size = size;
+    kernel->weights = weights;
+    kernel->cached = false;
+    return kernel;
+}
+
+/** @brief Make a kernel object from custom weights, to apply it many times with applyKernelObject
+ *
+ * @param weights The size * size weights, copied
+ * @param size The size of one side of the kernel (odd)
+ *
+ * @return The kernel, to be freed with releaseKernel, or NULL on error
+ */
+Kernel *createKernel(const float *weights, int size) {
+    if (size < 1 || size % 2 == 0) {
+        printf("Kernel size must be odd\n");
+        return NULL;
+    }
+    float *copy = (float *)malloc((size_t)size * size * sizeof(float));
+    if (!copy) {
+        printf("Error allocating memory for kernel\n");
+        return NULL;
+    }
+    memcpy(copy, weights, (size_t)size * size * sizeof(float));
+    return wrapKernel(copy, size, KERNEL_CUSTOM, 0);
+}
+
+static Kernel *findCachedKernel(KernelType type, int param) {
+    for (int i = 0; i < kernelCacheCount; i++) {
+        if (kernelCache[i]->type == type && kernelCache[i]->param == param)
+            return kernelCache[i];
+    }
+    return NULL;
+}
+
+/** @brief Give back a kernel from acquireKernel or createKernel, freeing it unless it is cached
+ *
+ * @param kernel The kernel (can be NULL)
+ */
+void releaseKernel(const Kernel *kernel) {
+    if (!kernel || kernel->cached)
+        return;
+    Kernel *owned = (Kernel *)kernel;
+    freeKernelAnalysis(&owned->factors);
+    free(owned->weights);
+    free(owned);
+}
+
+/** @brief Get a named kernel, made on the first request and kept for the whole process
+ *
+ * Once the cache is full, new kernels are made for every request.
+ *
+ * @param type The kind of kernel
+ * @param param Its parameter (the level for KERNEL_BOX, at least 1)
+ *
+ * @return The kernel, to be given back with releaseKernel, or NULL on error
+ */
+const Kernel *acquireKernel(KernelType type, int param) {
+    if (type != KERNEL_BOX) {
+        printf("Only named kernels can be acquired\n");
+        return NULL;
+    }
+    if (param < 1) {
+        printf("Box kernel level must be at least 1\n");
+        return NULL;
+    }
+
+#ifndef IMAGE_NO_THREADS
+    pthread_mutex_lock(&kernelCacheLock);
+#endif
+    Kernel *kernel = findCachedKernel(type, param);
+#ifndef IMAGE_NO_THREADS
+    pthread_mutex_unlock(&kernelCacheLock);
+#endif
+    if (kernel)
+        return kernel;
+
+    // Made outside of the lock, a thread that made the same kernel meanwhile wins
+    float *weights = createBoxKernel(param);
+    kernel = weights ? wrapKernel(weights, param * 2 + 1, type, param) : NULL;
+    if (!kernel)
+        return NULL;
+
+#ifndef IMAGE_NO_THREADS
+    pthread_mutex_lock(&kernelCacheLock);
+#endif
+    Kernel *existing = findCachedKernel(type, param);
+    if (!existing && kernelCacheCount < KERNEL_CACHE_SIZE) {
+        kernel->cached = true;
+        kernelCache[kernelCacheCount++] = kernel;
+    }
+#ifndef IMAGE_NO_THREADS
+    pthread_mutex_unlock(&kernelCacheLock);
+#endif
+    if (existing) {
+        releaseKernel(kernel);
+        return existing;
+    }
+    return kernel;
+}
+
+
+// Filters that have 16 bit and float, alpha aware and planar variants
+typedef enum {
+    FILTER_KERNEL,
+    FILTER_SHARPEN,
+    FILTER_EDGES,
+} FilterKind;
+
+// Truncate and clamp like the 8 bit filters, floats are kept as they are
+#define STORE_U16(value) ((unsigned short)clamp((int)(value), 0, 65535))
+#define STORE_F32(value) (value)
+
+// Conversions between rows of 16 bit or float values and float rows, defined once per type
+#define DEFINE_ROW_CONVERSIONS(suffix, type, store)                                                     \
+    static void loadRow##suffix(const unsigned char *pixels, size_t start, size_t count, float *values) { \
+        const type *source = (const type *)pixels + start;                                              \
+        for (size_t i = 0; i < count; i++)                                                              \
+            values[i] = source[i];                                                                      \
+    }                                                                                                   \
+    static void storeRow##suffix(const float *values, unsigned char *pixels, size_t start, size_t count) { \
+        type *target = (type *)pixels + start;                                                          \
+        for (size_t i = 0; i < count; i++)                                                              \
+            target[i] = store(values[i]);                                                               \
+    }
+
+DEFINE_ROW_CONVERSIONS(U16, unsigned short, STORE_U16)
+DEFINE_ROW_CONVERSIONS(F32, float, STORE_F32)
+
+/** @brief Convert count values of a 16 bit or float image to floats
+ */
+static void loadRow(const Image *img, size_t start, size_t count, float *values) {
+    if (img->pixelType == PIXEL_U16)
+        loadRowU16(img->pixels, start, count, values);
+    else
+        loadRowF32(img->pixels, start, count, values);
+}
+
+/** @brief Store count floats in a 16 bit or float image
+ */
+static void storeRow(const float *values, Image *img, size_t start, size_t count) {
+    if (img->pixelType == PIXEL_U16)
+        storeRowU16(values, img->pixels, start, count);
+    else
+        storeRowF32(values, img->pixels, start, count);
+}
+
+// Data shared by the threads of the 16 bit and float filters
+typedef struct {
+    const Image *img;
+    Image *output;
+    const float *kernel;
+    const float *kernelY; // Second kernel of the edge detection
+    int kernelSize;
+    FilterKind filter;
+    volatile int failed;
+} TypedFilterTask;
+
+/** @brief Filter some rows of a 16 bit or float image
+ *
+ * Each tap of the kernel is accumulated over a whole row at once, from a float row padded with the clamped
+ * border pixels, so the inner loops are contiguous and vectorize. The taps are added in the order of applyKernel.
+ */
+static void typedFilterRows(void *context, int startRow, int endRow) {
+    TypedFilterTask *task = (TypedFilterTask *)context;
+    const int width = task->img->width;
+    const int height = task->img->height;
+    const int channels = task->img->channels;
+    const int half = task->kernelSize / 2;
+    const int rowLength = width * channels;
+
+    float *padded = (float *)malloc(((size_t)(width + 2 * half) * channels + 2 * (size_t)rowLength) * sizeof(float));
+    if (!padded) {
+        task->failed = 1;
+        return;
+    }
+    float *sums = padded + (size_t)(width + 2 * half) * channels;
+    float *sumsY = sums + rowLength;
+
+    for (int y = startRow; y < endRow; y++) {
+        memset(sums, 0, 2 * (size_t)rowLength * sizeof(float));
+
+        for (int kernelY = -half; kernelY <= half; kernelY++) {
+            loadRow(task->img, (size_t)clamp(y + kernelY, 0, height - 1) * rowLength, rowLength, padded + half * channels);
+            for (int x = 0; x < half; x++) {
+                for (int c = 0; c < channels; c++) {
+                    padded[x * channels + c] = padded[half * channels + c];
+                    padded[(half + width + x) * channels + c] = padded[(half + width - 1) * channels + c];
+                }
+            }
+
+            for (int kernelX = -half; kernelX <= half; kernelX++) {
+                const float *source = padded + (kernelX + half) * channels;
+                const int kernelIndex = (kernelY + half) * task->kernelSize + (kernelX + half);
+                const float weight = task->kernel[kernelIndex];
+                for (int i = 0; i < rowLength; i++)
+                    sums[i] += source[i] * weight;
+                if (task->filter == FILTER_EDGES) {
+                    const float weightY = task->kernelY[kernelIndex];
+                    for (int i = 0; i < rowLength; i++)
+                        sumsY[i] += source[i] * weightY;
+                }
+            }
+        }
+
+        const size_t start = (size_t)y * rowLength;
+        if (task->filter == FILTER_SHARPEN) {
+            // Store the blur first, so it is quantized like the blurred image of applySharpen
+            storeRow(sums, task->output, start, rowLength);
+            loadRow(task->output, start, rowLength, sums);
+            loadRow(task->img, start, rowLength, sumsY);
+            for (int i = 0; i < rowLength; i++)
+                sums[i] = 2.0f * sumsY[i] - sums[i];
+        } else if (task->filter == FILTER_EDGES) {
+            for (int i = 0; i < rowLength; i++)
+                sums[i] = sqrtf(sums[i] * sums[i] + sumsY[i] * sumsY[i]);
+        }
+        storeRow(sums, task->output, start, rowLength);
+    }
+
+    free(padded);
+}
+
+/** @brief Run one of the filters on a 16 bit or float image
+ *
+ * @return The filtered image, with the pixel type of img, or NULL if the memory could not be allocated
+ */
+static Image *runTypedFilter(const Image *img, FilterKind filter, const float *kernel, const float *kernelY, int kernelSize) {
+    Image *output = createImageOfType(img->width, img->height, img->channels, img->pixelType);
+    if (!output)
+        return NULL;
+
+    TypedFilterTask task = {img, output, kernel, kernelY, kernelSize, filter, 0};
+    parallelFor(img->height, 16, typedFilterRows, &task);
+    if (task.failed) {
+        printf("Error allocating memory for filter rows\n");
+        freeImage(output);
+        return NULL;
+    }
+    return output;
+}
+
+/** @brief Get the largest value of a pixel type (the value of white)
+ */
+static float pixelTypeMax(PixelType type) {
+    return type == PIXEL_U8 ? 255.0f : (type == PIXEL_U16 ? 65535.0f : 1.0f);
+}
+
+/** @brief Convert an image to another pixel type, scaling the values to its range
+ *
+ * @param img The image
+ * @param type The pixel type of the new image
+ *
+ * @return The converted image, or NULL if the memory could not be allocated
+ */
+Image *convertPixelType(const Image *img, PixelType type) {
+    Image *output = createImageOfType(img->width, img->height, img->channels, type);
+    if (!output)
+        return NULL;
+
+    size_t count = (size_t)img->width * img->height * img->channels;
+    float scale = pixelTypeMax(type) / pixelTypeMax(img->pixelType);
+    float rounding = type == PIXEL_F32 ? 0.0f : 0.5f;
+    float *values = (float *)malloc(4096 * sizeof(float));
+    if (!values) {
+        printf("Error allocating memory for pixel conversion\n");
+        freeImage(output);
+        return NULL;
+    }
+
+    for (size_t start = 0; start < count; start += 4096) {
+        size_t length = count - start < 4096 ? count - start : 4096;
+        for (size_t i = 0; i < length; i++) {
+            if (img->pixelType == PIXEL_U8)
+                values[i] = img->pixels[start + i];
+            else if (img->pixelType == PIXEL_U16)
+                values[i] = ((const unsigned short *)img->pixels)[start + i];
+            else
+                values[i] = ((const float *)img->pixels)[start + i];
+            values[i] = values[i] * scale + rounding;
+        }
+        if (type == PIXEL_U8) {
+            for (size_t i = 0; i < length; i++)
+                output->pixels[start + i] = (unsigned char)(values[i] < 0.0f ? 0.0f : (values[i] > 255.0f ? 255.0f : values[i]));
+        } else {
+            storeRow(values, output, start, length);
+        }
+    }
+
+    free(values);
+    return output;
+}
+
+/** @brief Invert the colors of a 16 bit or float image
+ */
+static Image *invertTypedPixels(const Image *img) {
+    Image *output = createImageOfType(img->width, img->height, img->channels, img->pixelType);
+    if (!output)
+        return NULL;
+
+    size_t count = (size_t)img->width * img->height * img->channels;
+    if (img->pixelType == PIXEL_U16) {
+        const unsigned short *source = (const unsigned short *)img->pixels;
+        unsigned short *target = (unsigned short *)output->pixels;
+        for (size_t i = 0; i < count; i++)
+            target[i] = 65535 - source[i];
+    } else {
+        const float *source = (const float *)img->pixels;
+        float *target = (float *)output->pixels;
+        for (size_t i = 0; i < count; i++)
+            target[i] = 1.0f - source[i];
+    }
+    return output;
+}
+
+/** @brief Convert a 16 bit or float image to black and white
+ */
+static Image *convertTypedBnW(const Image *img) {
+    Image *output = createImageOfType(img->width, img->height, 1, img->pixelType);
+    if (!output)
+        return NULL;
+
+    const size_t pixelCount = (size_t)img->width * img->height;
+    const int channels = img->channels;
+    float *values = (float *)malloc(4096 * sizeof(float));
+    float *gray = (float *)malloc(4096 / 4 * sizeof(float));
+    if (!values || !gray) {
+        printf("Error allocating memory for BnW pixels\n");
+        free(values);
+        free(gray);
+        freeImage(output);
+        return NULL;
+    }
+
+    const float rounding = img->pixelType == PIXEL_U16 ? 0.5f : 0.0f;
+    for (size_t start = 0; start < pixelCount; start += 1024) {
+        size_t length = pixelCount - start < 1024 ? pixelCount - start : 1024;
+        loadRow(img, start * channels, length * channels, values);
+        for (size_t i = 0; i < length; i++) {
+            const float *pixel = values + i * channels;
+            gray[i] = channels >= 3 ? 0.299f * pixel[0] + 0.587f * pixel[1] + 0.114f * pixel[2] + rounding : pixel[0];
+        }
+        storeRow(gray, output, start, length);
+    }
+
+    free(values);
+    free(gray);
+    return output;
+}
+
+/** @brief Invert the colors of an image
+ *
+ * @param img The image that will be inverted
+ *
+ * @return The inverted image
+ */
+Image *invertPixels(const Image *img) {
+    if (img->pixelType != PIXEL_U8)
+        return invertTypedPixels(img);
+
+    Image *invertedImage = (Image *)malloc(sizeof(Image));
+    if (!invertedImage) {
+        printf("Error allocating memory for inverted image\n");
+        return NULL;
+    }
+
+    invertedImage->width = img->width;
+    invertedImage->height = img->height;
+    invertedImage->channels = img->channels;
+    invertedImage->pixelType = PIXEL_U8;
+    invertedImage->pixels = (unsigned char *)malloc(img->width * img->height * img->channels * sizeof(unsigned char));
+    if (!invertedImage->pixels) {
+        free(invertedImage);
+        printf("Error allocating memory for inverted image pixels\n");
+        return NULL;
+    }
+
+    // Invert the pixel values, in bands of rows
+    InvertTask task = {img->pixels, invertedImage->pixels, (size_t)img->width * img->channels, getDispatchLevel()};
+    parallelFor(img->height, 64, invertRows, &task);
+
+    return invertedImage;
+}
+
+/** @brief Convert an image to black and white
+ *
+ * @param img The image that will be converted
+ *
+ * @return The black and white image
+ */
+Image *convertBnW(const Image *img) {
+    if (img->pixelType != PIXEL_U8)
+        return convertTypedBnW(img);
+
+    Image *convertedImage = (Image *)malloc(sizeof(Image));
+    if (!convertedImage) {
+        printf("Error allocating memory for converted image\n");
+        return NULL;
+    }
+
+    unsigned char *BnWPixels = (unsigned char *)malloc(img->width * img->height * sizeof(unsigned char));
+    if (!BnWPixels) {
+        printf("Error allocating memory for BnW pixels\n");
+        free(convertedImage);
+        return NULL;
+    }
+
+    // Convert the pixel to black and white based on the number of channels
+    for (int i = 0; i < img->width * img->height; ++i) {
+        if (img->channels == 3 || img->channels == 4) {
+            unsigned char r = img->pixels[i * img->channels];
+            unsigned char g = img->pixels[i * img->channels + 1];
+            unsigned char b = img->pixels[i * img->channels + 2];
+            BnWPixels[i] = (unsigned char)round(0.299 * r + 0.587 * g + 0.114 * b);
+        } else if (img->channels == 2) {
+            BnWPixels[i] = img->pixels[i * img->channels];
+        } else if (img->channels == 1) {
+            BnWPixels[i] = img->pixels[i];
+        } else {
+            printf("Unsupported image type");
+            free(BnWPixels);
+            free(convertedImage);
+            return NULL;
+        }
+    }
+
+    convertedImage->width = img->width;
+    convertedImage->height = img->height;
+    convertedImage->channels = 1;
+    convertedImage->pixelType = PIXEL_U8;
+    convertedImage->pixels = BnWPixels;
+
+    return convertedImage;
+}
+
+// Ask the compiler to fully unroll a loop with a constant trip count
+#if defined(__clang__)
+#define UNROLL_LOOP _Pragma("unroll")
+#elif defined(__GNUC__)
+#define UNROLL_LOOP _Pragma("GCC unroll 16")
+#else
+#define UNROLL_LOOP
+#endif
+
+// Data shared by the threads of applyKernel
+typedef struct {
+    const Image *img;
+    Image *output;
+    const float *kernel;
+    int kernelSize;
+} KernelTask;
+
+/** @brief Compute one value of applyKernel, with the neighbours clamped to the image boundaries
+ */
+static inline unsigned char kernelValueClamped(const Image *img, const float *kernel, int kernelSize, int imgX, int imgY, int channelIndex) {
+    float pixelValue = 0.0f;
+
+    // Traverse each position in the kernel
+    for (int kernelY = -kernelSize / 2; kernelY <= kernelSize / 2; kernelY++) {
+        for (int kernelX = -kernelSize / 2; kernelX <= kernelSize / 2; kernelX++) {
+
+            // Calculate the position of the neighboring pixel, clamped to image boundaries
+            int pixelX = clamp(imgX + kernelX, 0, img->width - 1);
+            int pixelY = clamp(imgY + kernelY, 0, img->height - 1);
+
+            // Calculate the position (index) in the image and kernel
+            int pixelIndex = (pixelY * img->width + pixelX) * img->channels + channelIndex;
+            int kernelIndex = (kernelY + kernelSize / 2) * kernelSize + (kernelX + kernelSize / 2);
+
+            pixelValue += img->pixels[pixelIndex] * kernel[kernelIndex];
+        }
+    }
+
+    // Clamp the pixel value to the 0-255 range
+    return (unsigned char)clamp((int)pixelValue, 0, 255);
+}
+
+/** @brief Apply a kernel of any size to a range of rows
+ */
+static void kernelRowsGeneric(void *context, int startRow, int endRow) {
+    KernelTask *task = (KernelTask *)context;
+    const Image *img = task->img;
+
+    for (int imgY = startRow; imgY < endRow; imgY++) {
+        for (int imgX = 0; imgX < img->width; imgX++) {
+            for (int channelIndex = 0; channelIndex < img->channels; channelIndex++) {
+                int outputIndex = (imgY * img->width + imgX) * img->channels + channelIndex;
+                task->output->pixels[outputIndex] = kernelValueClamped(img, task->kernel, task->kernelSize, imgX, imgY, channelIndex);
+            }
+        }
+    }
+}
+
+// Rows of applyKernel for a fixed kernel size and channel count, with the taps of the interior pixels unrolled.
+// The sums are made in the same order as kernelValueClamped, so the results are identical.
+#define DEFINE_KERNEL_ROWS(SIZE, CHANNELS)                                                                          \
+    static void kernelRows##SIZE##x##CHANNELS(void *context, int startRow, int endRow) {                           \
+        KernelTask *task = (KernelTask *)context;                                                                  \
+        const Image *img = task->img;                                                                              \
+        const int half = SIZE / 2;                                                                                 \
+        const int stride = img->width * CHANNELS;                                                                  \
+        float weights[SIZE * SIZE];                                                                                \
+        memcpy(weights, task->kernel, sizeof(weights));                                                            \
+                                                                                                                   \
+        for (int y = startRow; y < endRow; y++) {                                                                  \
+            unsigned char *out = task->output->pixels + (size_t)y * stride;                                        \
+            int interiorEnd = (y >= half && y < img->height - half) ? img->width - half : 0;                       \
+            int x = 0;                                                                                             \
+            for (; x < half && x < img->width; x++)                                                                \
+                for (int c = 0; c < CHANNELS; c++)                                                                 \
+                    out[x * CHANNELS + c] = kernelValueClamped(img, weights, SIZE, x, y, c);                       \
+            for (; x < interiorEnd; x++) {                                                                         \
+                const unsigned char *window = img->pixels + (size_t)(y - half) * stride + (x - half) * CHANNELS;  \
+                UNROLL_LOOP for (int c = 0; c < CHANNELS; c++) {                                                   \
+                    float sum = 0.0f;                                                                              \
+                    UNROLL_LOOP for (int ky = 0; ky < SIZE; ky++) {                                                \
+                        UNROLL_LOOP for (int kx = 0; kx < SIZE; kx++) {                                            \
+                            sum += window[ky * stride + kx * CHANNELS + c] * weights[ky * SIZE + kx];              \
+                        }                                                                                          \
+                    }                                                                                              \
+                    out[x * CHANNELS + c] = (unsigned char)clamp((int)sum, 0, 255);                                \
+                }                                                                                                  \
+            }                                                                                                      \
+            for (; x < img->width; x++)                                                                            \
+                for (int c = 0; c < CHANNELS; c++)                                                                 \
+                    out[x * CHANNELS + c] = kernelValueClamped(img, weights, SIZE, x, y, c);                       \
+        }                                                                                                          \
+    }
+
+DEFINE_KERNEL_ROWS(3, 1)
+DEFINE_KERNEL_ROWS(3, 3)
+DEFINE_KERNEL_ROWS(3, 4)
+DEFINE_KERNEL_ROWS(5, 1)
+DEFINE_KERNEL_ROWS(5, 3)
+DEFINE_KERNEL_ROWS(5, 4)
+DEFINE_KERNEL_ROWS(7, 1)
+DEFINE_KERNEL_ROWS(7, 3)
+DEFINE_KERNEL_ROWS(7, 4)
+
+// Specialized rows by kernel size (3, 5, 7) and channel count (1, 3, 4)
+static const ParallelTask kernelRowsTable[3][3] = {
+    {kernelRows3x1, kernelRows3x3, kernelRows3x4},
+    {kernelRows5x1, kernelRows5x3, kernelRows5x4},
+    {kernelRows7x1, kernelRows7x3, kernelRows7x4},
+};
+
+/** @brief Pick the rows function of applyKernel for a kernel size and channel count
+ *
+ * @return A specialized function when there is one, kernelRowsGeneric otherwise
+ */
+static ParallelTask selectKernelRows(int kernelSize, int channels) {
+    int channelIndex = channels == 1 ? 0 : channels == 3 ? 1 : channels == 4 ? 2 : -1;
+    if (kernelSize < 3 || kernelSize > 7 || kernelSize % 2 == 0 || channelIndex < 0)
+        return kernelRowsGeneric;
+    return kernelRowsTable[(kernelSize - 3) / 2][channelIndex];
+}
+
+/** @brief Apply a kernel to an image
+ *
+ * Kernels of size 3, 5 and 7 on images of 1, 3 or 4 channels use unrolled versions, with the same results.
+ *
+ * @param img The image that will be applied the kernel
+ * @param kernel The kernel that will be applied to the image
+ * @param kernelSize The size of one side of the kernel
+ *
+ * @return The image after the kernel has been applied
+ */
+Image *applyKernel(const Image *img, const float *kernel, const int kernelSize) {
+    if (img->pixelType != PIXEL_U8)
+        return runTypedFilter(img, FILTER_KERNEL, kernel, NULL, kernelSize);
+
+    Image *output = (Image *)malloc(sizeof(Image));
+    if (!output) {
+        printf("Error allocating memory for output image\n");
+        return NULL;
+    }
+
+    output->width = img->width;
+    output->height = img->height;
+    output->channels = img->channels;
+    output->pixelType = PIXEL_U8;
+    output->pixels = (unsigned char *)malloc(img->width * img->height * img->channels * sizeof(unsigned char));
+    if (!output->pixels) {
+        free(output);
+        printf("Error allocating memory for output image\n");
+        return NULL;
+    }
+
+    // Traverse each pixel in the image, in bands of rows
+    KernelTask task = {img, output, kernel, kernelSize};
+    parallelFor(img->height, 16, selectKernelRows(kernelSize, img->channels), &task);
+
+    return output;
+}
+
+/** @brief Apply a blur effect to an image, based on a value of blurLevel that will transform in a kernel of size (blurLevel * 2 + 1)
+ *
+ * @param img The image that will be applied the blur
+ * @param blurLevel: The amount of blur applied (starting at 1)
+ *
+ * @return The blurred image
+ */
+Image *applyBlur(const Image *img, int blurLevel) {
+    if (blurLevel < 1) {
+        printf("Blur level must be at least 1\n");
+        return NULL;
+    }
+
+    // The kernel with equal weights is made on the first call with this level
+    const Kernel *kernel = acquireKernel(KERNEL_BOX, blurLevel);
+    if (!kernel)
+        return NULL;
+
+    Image *blurredImage = applyKernel(img, kernel->weights, kernel->size);
+
+    releaseKernel(kernel);
+
+    return blurredImage;
+}
+
+/** @brief Convert the pixels of an image to floats
+ *
+ * @param img The image
+ *
+ * @return The width * height * channels values, or NULL if the memory could not be allocated
+ */
+static float *pixelsToFloat(const Image *img) {
+    size_t count = (size_t)img->width * img->height * img->channels;
+    float *values = (float *)malloc(count * sizeof(float));
+    if (!values) {
+        printf("Error allocating memory for float pixels\n");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        values[i] = img->pixels[i];
+    return values;
+}
+
+/** @brief Create an image from float values, rounded and clamped to the 0-255 range
+ *
+ * @param values The width * height * channels values
+ * @param width The width of the image
+ * @param height The height of the image
+ * @param channels The number of channels
+ *
+ * @return The new image, or NULL if the memory could not be allocated
+ */
+static Image *floatToImage(const float *values, int width, int height, int channels) {
+    Image *output = createImage(width, height, channels);
+    if (!output)
+        return NULL;
+
+    size_t count = (size_t)width * height * channels;
+    for (size_t i = 0; i < count; i++) {
+        float value = values[i] + 0.5f;
+        output->pixels[i] = (unsigned char)(value < 0.0f ? 0.0f : (value > 255.0f ? 255.0f : value));
+    }
+    return output;
+}
+
+// Coefficients of the Young-van Vliet recursive Gaussian: out[n] = b * in[n] + a1 * out[n-1] + a2 * out[n-2] + a3 * out[n-3]
+typedef struct {
+    float b;
+    float a1;
+    float a2;
+    float a3;
+    float end[3][3]; // Anti-causal values at the last position and the 2 after it, from the causal values at the last 3
+} RecursiveGaussian;
+
+/** @brief Compute the coefficients of the recursive Gaussian for a sigma (I.T. Young, L.J. van Vliet, 1995)
+ *
+ * @param sigma The standard deviation, at least 0.5
+ * @param coefficients Where the coefficients will be written, the same for the causal and anti-causal passes
+ *
+ * @return Returns true if the memory to find the values at the end of a line could be allocated
+ */
+static bool recursiveGaussianCoefficients(float sigma, RecursiveGaussian *coefficients) {
+    double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+    double b3 = 0.422205 * q * q * q;
+
+    coefficients->a1 = (float)(b1 / b0);
+    coefficients->a2 = (float)(b2 / b0);
+    coefficients->a3 = (float)(b3 / b0);
+    coefficients->b = 1.0f - (coefficients->a1 + coefficients->a2 + coefficients->a3);
+
+    // Past the end of a line the input repeats the last value, so the causal pass keeps going from its last 3 values
+    // and the anti-causal pass starts from where that tail takes it (B. Triggs, M. Sdika, 2006). Both are linear in the
+    // differences to the last input value, so the response to each of the 3 values is found by running the passes
+    // until the tail has died out.
+    const double a1 = coefficients->a1, a2 = coefficients->a2, a3 = coefficients->a3, b = coefficients->b;
+    const int length = (int)(40.0 * q) + 64;
+    double *causal = (double *)malloc((size_t)length * 2 * sizeof(double));
+    if (!causal)
+        return false;
+    double *antiCausal = causal + length;
+    for (int j = 0; j < 3; j++) {
+        for (int n = 0; n < 3; n++)
+            causal[n] = n == 2 - j ? 1.0 : 0.0;
+        for (int n = 3; n < length; n++)
+            causal[n] = a1 * causal[n - 1] + a2 * causal[n - 2] + a3 * causal[n - 3];
+        for (int n = length - 1; n >= 2; n--)
+            antiCausal[n] = b * causal[n] + (n + 1 < length ? a1 * antiCausal[n + 1] : 0.0) +
+                            (n + 2 < length ? a2 * antiCausal[n + 2] : 0.0) + (n + 3 < length ? a3 * antiCausal[n + 3] : 0.0);
+        for (int k = 0; k < 3; k++)
+            coefficients->end[k][j] = (float)antiCausal[2 + k];
+    }
+    free(causal);
+    return true;
+}
+
+/** @brief Start the anti-causal pass at the end of a line: the last 3 values go from causal to anti-causal
+ *
+ * @param last The causal values at the last position of the line, for every lane
+ * @param step The distance between two positions of the line
+ * @param length The number of positions of the line
+ * @param lanes The number of lanes
+ * @param inputs The input values at the last position, before the causal pass
+ * @param g The coefficients
+ */
+static void recursiveGaussianEnd(float *last, size_t step, int length, int lanes, const float *inputs, const RecursiveGaussian *g) {
+    for (int i = 0; i < lanes; i++) {
+        // Differences of the causal values to the input (before the line they equal the first, which equals its input)
+        float differences[3];
+        for (int j = 0; j < 3; j++)
+            differences[j] = *(last + i - (size_t)(j < length ? j : length - 1) * step) - inputs[i];
+
+        float values[5]; // The anti-causal values from 2 before the last position to 2 after it
+        for (int k = 0; k < 3; k++)
+            values[2 + k] = inputs[i] + g->end[k][0] * differences[0] + g->end[k][1] * differences[1] + g->end[k][2] * differences[2];
+        for (int n = 1; n >= 0 && n + length > 2; n--) {
+            float *value = last + i - (size_t)(2 - n) * step;
+            values[n] = g->b * *value + g->a1 * values[n + 1] + g->a2 * values[n + 2] + g->a3 * values[n + 3];
+            *value = values[n];
+        }
+        last[i] = values[2];
+    }
+}
+
+/** @brief One step of the recursive filter for many independent lanes: out[i] = b * in[i] + a1 * p1[i] + a2 * p2[i] + a3 * p3[i]
+ *
+ * out can be the same as in (the filter runs in place).
+ */
+static void recursiveStepScalar(float *out, const float *in, const float *p1, const float *p2, const float *p3, int count, RecursiveGaussian g) {
+    for (int i = 0; i < count; i++)
+        out[i] = g.b * in[i] + g.a1 * p1[i] + g.a2 * p2[i] + g.a3 * p3[i];
+}
+
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("sse2"))) static void recursiveStepSSE2(float *out, const float *in, const float *p1, const float *p2, const float *p3, int count, RecursiveGaussian g) {
+    const __m128 b = _mm_set1_ps(g.b), a1 = _mm_set1_ps(g.a1), a2 = _mm_set1_ps(g.a2), a3 = _mm_set1_ps(g.a3);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 value = _mm_mul_ps(b, _mm_loadu_ps(in + i));
+        value = _mm_add_ps(value, _mm_mul_ps(a1, _mm_loadu_ps(p1 + i)));
+        value = _mm_add_ps(value, _mm_mul_ps(a2, _mm_loadu_ps(p2 + i)));
+        value = _mm_add_ps(value, _mm_mul_ps(a3, _mm_loadu_ps(p3 + i)));
+        _mm_storeu_ps(out + i, value);
+    }
+    recursiveStepScalar(out + i, in + i, p1 + i, p2 + i, p3 + i, count - i, g);
+}
+
+__attribute__((target("avx2,fma"))) static void recursiveStepAVX2(float *out, const float *in, const float *p1, const float *p2, const float *p3, int count, RecursiveGaussian g) {
+    const __m256 b = _mm256_set1_ps(g.b), a1 = _mm256_set1_ps(g.a1), a2 = _mm256_set1_ps(g.a2), a3 = _mm256_set1_ps(g.a3);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 value = _mm256_mul_ps(b, _mm256_loadu_ps(in + i));
+        value = _mm256_fmadd_ps(a1, _mm256_loadu_ps(p1 + i), value);
+        value = _mm256_fmadd_ps(a2, _mm256_loadu_ps(p2 + i), value);
+        value = _mm256_fmadd_ps(a3, _mm256_loadu_ps(p3 + i), value);
+        _mm256_storeu_ps(out + i, value);
+    }
+    recursiveStepScalar(out + i, in + i, p1 + i, p2 + i, p3 + i, count - i, g);
+}
+#endif
+
+static void recursiveStep(float *out, const float *in, const float *p1, const float *p2, const float *p3, int count, RecursiveGaussian g, DispatchLevel level) {
+#ifdef IMAGE_X86_SIMD
+    if (level == DISPATCH_AVX2) {
+        recursiveStepAVX2(out, in, p1, p2, p3, count, g);
+        return;
+    }
+    if (level == DISPATCH_SSE2) {
+        recursiveStepSSE2(out, in, p1, p2, p3, count, g);
+        return;
+    }
+#endif
+    (void)level;
+    recursiveStepScalar(out, in, p1, p2, p3, count, g);
+}
+
+// Data shared by the threads of the recursive Gaussian
+typedef struct {
+    float *values;
+    int width;
+    int height;
+    int channels;
+    RecursiveGaussian g;
+    DispatchLevel level;
+    volatile int failed;
+} GaussianTask;
+
+/** @brief Causal and anti-causal passes along the rows (the channels of a pixel are filtered together)
+ *
+ * Outside the image the first/last value is repeated: the causal pass starts from the first value, which is
+ * where it settles on a constant input, and the anti-causal pass from where the causal pass would go on past the end.
+ */
+static void gaussianRows(void *context, int startRow, int endRow) {
+    GaussianTask *task = (GaussianTask *)context;
+    const int channels = task->channels;
+    const int last = task->width - 1;
+
+    for (int y = startRow; y < endRow; y++) {
+        float *row = task->values + (size_t)y * task->width * channels;
+        float inputs[4];
+        memcpy(inputs, row + last * channels, channels * sizeof(float));
+        for (int x = 1; x <= last; x++) {
+            float *p1 = row + (x - 1) * channels;
+            float *p2 = row + (x > 1 ? x - 2 : 0) * channels;
+            float *p3 = row + (x > 2 ? x - 3 : 0) * channels;
+            recursiveStepScalar(row + x * channels, row + x * channels, p1, p2, p3, channels, task->g);
+        }
+        recursiveGaussianEnd(row + last * channels, channels, task->width, channels, inputs, &task->g);
+        for (int x = last - 3; x >= 0; x--) {
+            float *p = row + x * channels;
+            recursiveStepScalar(p, p, p + channels, p + 2 * channels, p + 3 * channels, channels, task->g);
+        }
+    }
+}
+
+/** @brief Causal and anti-causal passes along the columns, for the lanes [start, end) of every row
+ *
+ * Each step filters a whole run of a row at once, so the lanes are processed as SIMD vectors.
+ */
+static void gaussianColumns(void *context, int start, int end) {
+    GaussianTask *task = (GaussianTask *)context;
+    const size_t stride = (size_t)task->width * task->channels;
+    const int last = task->height - 1;
+    const int count = end - start;
+    float *values = task->values + start;
+    float *inputs = (float *)malloc(count * sizeof(float));
+    if (!inputs) {
+        task->failed = 1;
+        return;
+    }
+    memcpy(inputs, values + last * stride, count * sizeof(float));
+
+    for (int y = 1; y <= last; y++) {
+        float *p1 = values + (y - 1) * stride;
+        float *p2 = values + (y > 1 ? y - 2 : 0) * stride;
+        float *p3 = values + (y > 2 ? y - 3 : 0) * stride;
+        recursiveStep(values + y * stride, values + y * stride, p1, p2, p3, count, task->g, task->level);
+    }
+    recursiveGaussianEnd(values + last * stride, stride, task->height, count, inputs, &task->g);
+    for (int y = last - 3; y >= 0; y--) {
+        float *p = values + y * stride;
+        recursiveStep(p, p, p + stride, p + 2 * stride, p + 3 * stride, count, task->g, task->level);
+    }
+    free(inputs);
+}
+
+/** @brief Apply a Gaussian blur to an image, with a recursive (IIR) filter whose cost does not depend on sigma
+ *
+ * @param img The image that will be blurred
+ * @param sigma The standard deviation of the Gaussian in pixels (at least 0.5)
+ *
+ * @return The blurred image
+ */
+Image *applyGaussianBlur(const Image *img, float sigma) {
+    if (!requirePixelU8(img, "applyGaussianBlur"))
+        return NULL;
+    if (sigma < 0.5f) {
+        printf("Gaussian sigma must be at least 0.5\n");
+        return NULL;
+    }
+
+    float *values = pixelsToFloat(img);
+    if (!values)
+        return NULL;
+
+    RecursiveGaussian g = {0};
+    bool ready = recursiveGaussianCoefficients(sigma, &g);
+    GaussianTask task = {values, img->width, img->height, img->channels, g, getDispatchLevel(), !ready};
+    if (ready) {
+        parallelFor(img->height, 16, gaussianRows, &task);
+        parallelFor(img->width * img->channels, 256, gaussianColumns, &task);
+    }
+
+    Image *blurredImage = task.failed ? NULL : floatToImage(values, img->width, img->height, img->channels);
+    free(values);
+    if (task.failed)
+        printf("Error allocating memory for Gaussian blur\n");
+
+    return blurredImage;
+}
+
+// Extended box filter: weight c1 on [-radius, radius] and c2 on -radius - 1 and radius + 1
+typedef struct {
+    int radius;
+    float c1;
+    float c2;
+} ExtendedBox;
+
+/** @brief Choose the extended box whose variance is exactly sigma^2 (P. Gwosdek et al., 2011)
+ *
+ * @param sigma The standard deviation of the box
+ *
+ * @return The extended box
+ */
+static ExtendedBox extendedBoxForSigma(float sigma) {
+    double variance = (double)sigma * sigma;
+    int radius = (int)floor(0.5 * sqrt(12.0 * variance + 1.0) - 0.5);
+
+    // A plain box of this radius has variance radius * (radius + 1) / 3, the ends make up the rest
+    double alpha = (2 * radius + 1) * (variance - radius * (radius + 1) / 3.0) / (2.0 * ((radius + 1) * (radius + 1) - variance));
+
+    ExtendedBox box;
+    box.radius = radius;
+    box.c1 = (float)(1.0 / (2 * radius + 1 + 2 * alpha));
+    box.c2 = (float)(alpha * box.c1);
+    return box;
+}
+
+#define BOX_COLUMN_BLOCK 16 // Columns filtered together by the vertical passes
+
+/** @brief Extended box pass for the positions [start, end) of a line, whose neighbours are all inside the line
+ *
+ * Inlined with a constant number of lanes, the lane loop becomes SIMD code.
+ */
+static inline void extendedBoxBody(const float *restrict in, float *restrict out, int start, int end, int lanes, ExtendedBox box, float *restrict sums) {
+    for (int i = start; i < end; i++) {
+        const float *before = in + (i - box.radius - 1) * lanes;
+        const float *after = before + (2 * box.radius + 2) * lanes;
+        const float *leaving = before + lanes;
+        float *output = out + i * lanes;
+        for (int l = 0; l < lanes; l++) {
+            output[l] = box.c1 * sums[l] + box.c2 * (before[l] + after[l]);
+            sums[l] += after[l] - leaving[l];
+        }
+    }
+}
+
+/** @brief Run one extended box pass over lines of length values with lanes independent values each
+ *
+ * The data is laid out as [length][lanes] (e.g. a row with one lane per channel, or a block of
+ * columns with one lane per column). Outside the line the first/last value is repeated.
+ *
+ * @param in The input values
+ * @param out Where the filtered values will be written (can not be the same as in)
+ * @param length The number of positions along the line
+ * @param lanes The number of independent values at each position
+ * @param box The extended box
+ * @param sums A buffer of lanes floats for the running sums
+ */
+static void extendedBoxPass(const float *restrict in, float *restrict out, int length, int lanes, ExtendedBox box, float *restrict sums) {
+    const int last = length - 1;
+    const int radius = box.radius;
+
+    for (int l = 0; l < lanes; l++)
+        sums[l] = 0.0f;
+    for (int i = -radius; i <= radius; i++) {
+        const float *value = in + clamp(i, 0, last) * lanes;
+        for (int l = 0; l < lanes; l++)
+            sums[l] += value[l];
+    }
+
+    // Positions whose neighbours are all inside the line need no clamping
+    int bodyStart = radius + 1 < length ? radius + 1 : length;
+    int bodyEnd = last - radius - 1 > bodyStart ? last - radius - 1 : bodyStart;
+
+    for (int i = 0; i < length; i++) {
+        if (i == bodyStart) {
+            switch (lanes) {
+            case 1:
+                extendedBoxBody(in, out, bodyStart, bodyEnd, 1, box, sums);
+                break;
+            case 3:
+                extendedBoxBody(in, out, bodyStart, bodyEnd, 3, box, sums);
+                break;
+            case 4:
+                extendedBoxBody(in, out, bodyStart, bodyEnd, 4, box, sums);
+                break;
+            case BOX_COLUMN_BLOCK:
+                extendedBoxBody(in, out, bodyStart, bodyEnd, BOX_COLUMN_BLOCK, box, sums);
+                break;
+            default:
+                extendedBoxBody(in, out, bodyStart, bodyEnd, lanes, box, sums);
+            }
+            i = bodyEnd;
+            if (i == length)
+                break;
+        }
+
+        const float *before = in + clamp(i - radius - 1, 0, last) * lanes;
+        const float *after = in + clamp(i + radius + 1, 0, last) * lanes;
+        const float *leaving = in + clamp(i - radius, 0, last) * lanes;
+        float *output = out + i * lanes;
+        for (int l = 0; l < lanes; l++) {
+            output[l] = box.c1 * sums[l] + box.c2 * (before[l] + after[l]);
+            sums[l] += after[l] - leaving[l];
+        }
+    }
+}
+
+// Data shared by the threads of the box cascade
+typedef struct {
+    float *values;
+    int width;
+    int height;
+    int channels;
+    ExtendedBox box;
+    int passes;
+    volatile int failed;
+} BoxCascadeTask;
+
+/** @brief Run all passes along the rows, ping-ponging between two line buffers
+ */
+static void boxCascadeRows(void *context, int startRow, int endRow) {
+    BoxCascadeTask *task = (BoxCascadeTask *)context;
+    const int rowValues = task->width * task->channels;
+
+    float *buffers = (float *)malloc(((size_t)rowValues * 2 + task->channels) * sizeof(float));
+    if (!buffers) {
+        task->failed = 1;
+        return;
+    }
+    float *sums = buffers + 2 * rowValues;
+
+    for (int y = startRow; y < endRow; y++) {
+        float *row = task->values + (size_t)y * rowValues;
+        float *in = row;
+        float *out = buffers;
+        for (int pass = 0; pass < task->passes; pass++) {
+            extendedBoxPass(in, out, task->width, task->channels, task->box, sums);
+            in = out;
+            out = (out == buffers) ? buffers + rowValues : buffers;
+        }
+        memcpy(row, in, rowValues * sizeof(float));
+    }
+
+    free(buffers);
+}
+
+/** @brief Run all passes along the columns, for blocks of columns copied to line buffers
+ */
+static void boxCascadeColumns(void *context, int startBlock, int endBlock) {
+    BoxCascadeTask *task = (BoxCascadeTask *)context;
+    const int rowValues = task->width * task->channels;
+    const int height = task->height;
+
+    float *buffers = (float *)malloc(((size_t)height * BOX_COLUMN_BLOCK * 2 + BOX_COLUMN_BLOCK) * sizeof(float));
+    if (!buffers) {
+        task->failed = 1;
+        return;
+    }
+    float *first = buffers;
+    float *second = buffers + (size_t)height * BOX_COLUMN_BLOCK;
+    float *sums = second + (size_t)height * BOX_COLUMN_BLOCK;
+
+    for (int block = startBlock; block < endBlock; block++) {
+        int start = block * BOX_COLUMN_BLOCK;
+        int lanes = rowValues - start < BOX_COLUMN_BLOCK ? rowValues - start : BOX_COLUMN_BLOCK;
+
+        for (int y = 0; y < height; y++)
+            memcpy(first + y * lanes, task->values + (size_t)y * rowValues + start, lanes * sizeof(float));
+
+        float *in = first;
+        float *out = second;
+        for (int pass = 0; pass < task->passes; pass++) {
+            extendedBoxPass(in, out, height, lanes, task->box, sums);
+            float *swap = in;
+            in = out;
+            out = swap;
+        }
+
+        for (int y = 0; y < height; y++)
+            memcpy(task->values + (size_t)y * rowValues + start, in + y * lanes, lanes * sizeof(float));
+    }
+
+    free(buffers);
+}
+
+/** @brief Filter float values in place with extended box passes along the rows and then the columns
+ *
+ * @param values The width * height * lanes values, with lanes independent values per pixel
+ * @param width The width of the image
+ * @param height The height of the image
+ * @param lanes The number of values per pixel
+ * @param box The extended box of each pass
+ * @param passes The number of passes in each direction
+ *
+ * @return Returns true if the values were filtered
+ */
+static bool boxFilterLanes(float *values, int width, int height, int lanes, ExtendedBox box, int passes) {
+    BoxCascadeTask task = {values, width, height, lanes, box, passes, 0};
+    int blocks = (width * lanes + BOX_COLUMN_BLOCK - 1) / BOX_COLUMN_BLOCK;
+    parallelFor(height, 16, boxCascadeRows, &task);
+    parallelFor(blocks, 4, boxCascadeColumns, &task);
+
+    if (task.failed) {
+        printf("Error allocating memory for box blur\n");
+        return false;
+    }
+    return true;
+}
+
+/** @brief Apply a fast approximation of a Gaussian blur, made of successive extended box filters
+ *
+ * Each pass is a running sum, so the cost does not depend on sigma. The box of each pass has variance
+ * sigma^2 / passes, so the cascade has exactly the variance of the Gaussian; more passes get closer to its shape.
+ *
+ * @param img The image that will be blurred
+ * @param sigma The standard deviation of the Gaussian in pixels (at least 0.5)
+ * @param passes The number of box passes in each direction (3 to 5)
+ *
+ * @return The blurred image
+ */
+Image *applyBoxGaussianBlur(const Image *img, float sigma, int passes) {
+    if (!requirePixelU8(img, "applyBoxGaussianBlur"))
+        return NULL;
+    if (sigma < 0.5f) {
+        printf("Gaussian sigma must be at least 0.5\n");
+        return NULL;
+    }
+    if (passes < 3 || passes > 5) {
+        printf("Box blur passes must be between 3 and 5\n");
+        return NULL;
+    }
+
+    float *values = pixelsToFloat(img);
+    if (!values)
+        return NULL;
+
+    Image *blurredImage = NULL;
+    if (boxFilterLanes(values, img->width, img->height, img->channels, extendedBoxForSigma(sigma / sqrtf((float)passes)), passes))
+        blurredImage = floatToImage(values, img->width, img->height, img->channels);
+    free(values);
+
+    return blurredImage;
+}
+
+#define MEDIAN_MAX_RADIUS 127 // Keeps the window count in 16 bit histogram bins
+
+/** @brief Update a 16 bin histogram segment: histogram += add - sub
+ */
+static void updateHistogram16Scalar(unsigned short *histogram, const unsigned short *add, const unsigned short *sub) {
+    for (int i = 0; i < 16; i++)
+        histogram[i] += add[i] - sub[i];
+}
+
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("sse2"))) static void updateHistogram16SSE2(unsigned short *histogram, const unsigned short *add, const unsigned short *sub) {
+    for (int i = 0; i < 16; i += 8) {
+        __m128i value = _mm_loadu_si128((const __m128i *)(histogram + i));
+        value = _mm_add_epi16(value, _mm_loadu_si128((const __m128i *)(add + i)));
+        value = _mm_sub_epi16(value, _mm_loadu_si128((const __m128i *)(sub + i)));
+        _mm_storeu_si128((__m128i *)(histogram + i), value);
+    }
+}
+
+__attribute__((target("avx2"))) static void updateHistogram16AVX2(unsigned short *histogram, const unsigned short *add, const unsigned short *sub) {
+    __m256i value = _mm256_loadu_si256((const __m256i *)histogram);
+    value = _mm256_add_epi16(value, _mm256_loadu_si256((const __m256i *)add));
+    value = _mm256_sub_epi16(value, _mm256_loadu_si256((const __m256i *)sub));
+    _mm256_storeu_si256((__m256i *)histogram, value);
+}
+#endif
+
+static void updateHistogram16(unsigned short *histogram, const unsigned short *add, const unsigned short *sub, DispatchLevel level) {
+#ifdef IMAGE_X86_SIMD
+    if (level == DISPATCH_AVX2) {
+        updateHistogram16AVX2(histogram, add, sub);
+        return;
+    }
+    if (level == DISPATCH_SSE2) {
+        updateHistogram16SSE2(histogram, add, sub);
+        return;
+    }
+#endif
+    (void)level;
+    updateHistogram16Scalar(histogram, add, sub);
+}
+
+// Data shared by the threads of the median filter
+typedef struct {
+    const Image *img;
+    Image *output;
+    int radius;
+    DispatchLevel level;
+    volatile int failed;
+} MedianTask;
+
+/** @brief Median filter of a band of rows (S. Perreault, P. Hebert, 2007)
+ *
+ * Every column keeps a histogram of the 2 * radius + 1 pixels around the current row, updated with one
+ * pixel in and one out per row. The window histogram is the sum of the column histograms around the
+ * current pixel, moved along the row by adding one column and subtracting another. Histograms have 16
+ * coarse bins (value / 16) and 256 fine bins; the coarse bins find the 16 values that hold the median
+ * and only that fine segment is brought up to date (lazily, it remembers where it was last updated).
+ */
+static void medianRows(void *context, int startRow, int endRow) {
+    MedianTask *task = (MedianTask *)context;
+    const Image *img = task->img;
+    const int width = img->width;
+    const int channels = img->channels;
+    const int radius = task->radius;
+    const int lastX = width - 1;
+    const int lastY = img->height - 1;
+    const int target = (2 * radius + 1) * (2 * radius + 1) / 2;
+    const size_t columns = (size_t)width * channels;
+
+    // Column histograms of every value of a row, then the window histograms of each channel
+    unsigned short *fine = (unsigned short *)calloc(columns * 256 + (size_t)channels * 256, sizeof(unsigned short));
+    unsigned short *coarse = (unsigned short *)calloc(columns * 16 + (size_t)channels * 16, sizeof(unsigned short));
+    int *segmentColumn = (int *)malloc(16 * sizeof(int));
+    if (!fine || !coarse || !segmentColumn) {
+        free(fine);
+        free(coarse);
+        free(segmentColumn);
+        task->failed = 1;
+        return;
+    }
+    unsigned short *windowFine = fine + columns * 256;
+    unsigned short *windowCoarse = coarse + columns * 16;
+
+    for (int i = -radius; i <= radius; i++) {
+        const unsigned char *row = img->pixels + (size_t)clamp(startRow + i, 0, lastY) * columns;
+        for (size_t v = 0; v < columns; v++) {
+            fine[v * 256 + row[v]]++;
+            coarse[v * 16 + (row[v] >> 4)]++;
+        }
+    }
+
+    for (int y = startRow; y < endRow; y++) {
+        if (y > startRow) {
+            // Move the column histograms down one row
+            const unsigned char *leaving = img->pixels + (size_t)clamp(y - radius - 1, 0, lastY) * columns;
+            const unsigned char *entering = img->pixels + (size_t)clamp(y + radius, 0, lastY) * columns;
+            for (size_t v = 0; v < columns; v++) {
+                fine[v * 256 + leaving[v]]--;
+                coarse[v * 16 + (leaving[v] >> 4)]--;
+                fine[v * 256 + entering[v]]++;
+                coarse[v * 16 + (entering[v] >> 4)]++;
+            }
+        }
+
+        unsigned char *outRow = task->output->pixels + (size_t)y * columns;
+        for (int c = 0; c < channels; c++) {
+            unsigned short *kernelFine = windowFine + c * 256;
+            unsigned short *kernelCoarse = windowCoarse + c * 16;
+
+            memset(kernelCoarse, 0, 16 * sizeof(unsigned short));
+            for (int i = -radius; i <= radius; i++) {
+                const unsigned short *column = coarse + ((size_t)clamp(i, 0, lastX) * channels + c) * 16;
+                for (int b = 0; b < 16; b++)
+                    kernelCoarse[b] += column[b];
+            }
+            for (int b = 0; b < 16; b++)
+                segmentColumn[b] = -2 * radius - 2; // Not valid for any x
+
+            for (int x = 0; x < width; x++) {
+                // Coarse bin that holds the median
+                int count = 0;
+                int segment = 0;
+                while (count + kernelCoarse[segment] <= target) {
+                    count += kernelCoarse[segment];
+                    segment++;
+                }
+
+                // Bring the fine segment up to date for this x
+                unsigned short *segmentBins = kernelFine + segment * 16;
+                if (x - segmentColumn[segment] > 2 * radius + 1) {
+                    memset(segmentBins, 0, 16 * sizeof(unsigned short));
+                    for (int i = x - radius; i <= x + radius; i++) {
+                        const unsigned short *column = fine + ((size_t)clamp(i, 0, lastX) * channels + c) * 256 + segment * 16;
+                        for (int b = 0; b < 16; b++)
+                            segmentBins[b] += column[b];
+                    }
+                } else {
+                    for (int j = segmentColumn[segment] + 1; j <= x; j++) {
+                        const unsigned short *add = fine + ((size_t)clamp(j + radius, 0, lastX) * channels + c) * 256 + segment * 16;
+                        const unsigned short *sub = fine + ((size_t)clamp(j - radius - 1, 0, lastX) * channels + c) * 256 + segment * 16;
+                        updateHistogram16(segmentBins, add, sub, task->level);
+                    }
+                }
+                segmentColumn[segment] = x;
+
+                int value = segment * 16;
+                while (count + segmentBins[value & 15] <= target) {
+                    count += segmentBins[value & 15];
+                    value++;
+                }
+                outRow[x * channels + c] = (unsigned char)value;
+
+                // Move the coarse window histogram one column to the right
+                const unsigned short *add = coarse + ((size_t)clamp(x + radius + 1, 0, lastX) * channels + c) * 16;
+                const unsigned short *sub = coarse + ((size_t)clamp(x - radius, 0, lastX) * channels + c) * 16;
+                updateHistogram16(kernelCoarse, add, sub, task->level);
+            }
+        }
+    }
+
+    free(fine);
+    free(coarse);
+    free(segmentColumn);
+}
+
+/** @brief Apply a median filter to an image, with a cost per pixel that does not depend on the radius
+ *
+ * @param img The image that will be filtered
+ * @param radius The radius of the square window (1 to 127), the window is (radius * 2 + 1) pixels wide
+ *
+ * @return The filtered image
+ */
+Image *applyMedianFilter(const Image *img, int radius) {
+    if (!requirePixelU8(img, "applyMedianFilter"))
+        return NULL;
+    if (radius < 1 || radius > MEDIAN_MAX_RADIUS) {
+        printf("Median radius must be between 1 and %d\n", MEDIAN_MAX_RADIUS);
+        return NULL;
+    }
+
+    Image *output = createImage(img->width, img->height, img->channels);
+    if (!output)
+        return NULL;
+
+    MedianTask task = {img, output, radius, getDispatchLevel(), 0};
+    parallelFor(img->height, 32, medianRows, &task);
+
+    if (task.failed) {
+        printf("Error allocating memory for median histograms\n");
+        freeImage(output);
+        return NULL;
+    }
+    return output;
+}
+
+/** @brief Get the number of channels that hold color (the alpha channel of 2 and 4 channel images is left out)
+ *
+ * @param img The image
+ *
+ * @return The number of color channels
+ */
+int colorChannelCount(const Image *img) {
+    return (img->channels == 2 || img->channels == 4) ? img->channels - 1 : img->channels;
+}
+
+/** @brief Compute the luma of a pixel, with the weights of convertBnW
+ *
+ * @param pixel The channels of the pixel
+ * @param channels The number of channels of the image
+ *
+ * @return The luma (0 to 255)
+ */
+static float pixelLuma(const unsigned char *pixel, int channels) {
+    if (channels >= 3)
+        return 0.299f * pixel[0] + 0.587f * pixel[1] + 0.114f * pixel[2];
+    return pixel[0];
+}
+
+// Data shared by the threads of the bilateral grid
+typedef struct {
+    const Image *img;
+    Image *output;
+    float *grid;
+    float *scratch;
+    int gridWidth;
+    int gridHeight;
+    int gridDepth;
+    float sigmaSpatial;
+    float sigmaRange;
+} BilateralTask;
+
+/** @brief Blur the grid with [1 2 1] / 4 along x and y, for the slices [start, end) of the range axis
+ */
+static void blurGridSpatial(void *context, int start, int end) {
+    BilateralTask *task = (BilateralTask *)context;
+    const int cell = task->img->channels + 1;
+    const int gw = task->gridWidth, gh = task->gridHeight, gd = task->gridDepth;
+
+    for (int z = start; z < end; z++) {
+        // Along x into scratch, then along y back into the grid
+        for (int y = 0; y < gh; y++) {
+            for (int x = 0; x < gw; x++) {
+                const float *left = task->grid + (((size_t)y * gw + (x > 0 ? x - 1 : x)) * gd + z) * cell;
+                const float *center = task->grid + (((size_t)y * gw + x) * gd + z) * cell;
+                const float *right = task->grid + (((size_t)y * gw + (x < gw - 1 ? x + 1 : x)) * gd + z) * cell;
+                float *out = task->scratch + (((size_t)y * gw + x) * gd + z) * cell;
+                for (int v = 0; v < cell; v++)
+                    out[v] = 0.25f * (left[v] + right[v]) + 0.5f * center[v];
+            }
+        }
+        for (int y = 0; y < gh; y++) {
+            for (int x = 0; x < gw; x++) {
+                const float *up = task->scratch + (((size_t)(y > 0 ? y - 1 : y) * gw + x) * gd + z) * cell;
+                const float *center = task->scratch + (((size_t)y * gw + x) * gd + z) * cell;
+                const float *down = task->scratch + (((size_t)(y < gh - 1 ? y + 1 : y) * gw + x) * gd + z) * cell;
+                float *out = task->grid + (((size_t)y * gw + x) * gd + z) * cell;
+                for (int v = 0; v < cell; v++)
+                    out[v] = 0.25f * (up[v] + down[v]) + 0.5f * center[v];
+            }
+        }
+    }
+}
+
+/** @brief Blur the grid with [1 2 1] / 4 along the range axis, for the grid rows [start, end)
+ */
+static void blurGridRange(void *context, int start, int end) {
+    BilateralTask *task = (BilateralTask *)context;
+    const int cell = task->img->channels + 1;
+    const int gd = task->gridDepth;
+    float *previous = task->scratch + (size_t)start * task->gridWidth * gd * cell;
+
+    for (int y = start; y < end; y++) {
+        for (int x = 0; x < task->gridWidth; x++) {
+            float *column = task->grid + ((size_t)y * task->gridWidth + x) * gd * cell;
+            float *copy = previous + (size_t)x * gd * cell;
+            memcpy(copy, column, (size_t)gd * cell * sizeof(float));
+            for (int z = 0; z < gd; z++) {
+                const float *below = copy + (z > 0 ? z - 1 : z) * cell;
+                const float *above = copy + (z < gd - 1 ? z + 1 : z) * cell;
+                for (int v = 0; v < cell; v++)
+                    column[z * cell + v] = 0.25f * (below[v] + above[v]) + 0.5f * copy[z * cell + v];
+            }
+        }
+    }
+}
+
+/** @brief Read the grid at a pixel with trilinear interpolation and normalize by the weight
+ */
+static void sliceGridRows(void *context, int startRow, int endRow) {
+    BilateralTask *task = (BilateralTask *)context;
+    const int channels = task->img->channels;
+    const int cell = channels + 1;
+    const int gw = task->gridWidth, gd = task->gridDepth;
+
+    for (int y = startRow; y < endRow; y++) {
+        float gy = y / task->sigmaSpatial + 1.0f;
+        int y0 = (int)gy;
+        float fy = gy - y0;
+
+        for (int x = 0; x < task->img->width; x++) {
+            const unsigned char *pixel = task->img->pixels + ((size_t)y * task->img->width + x) * channels;
+            float gx = x / task->sigmaSpatial + 1.0f;
+            float gz = pixelLuma(pixel, channels) / task->sigmaRange + 1.0f;
+            int x0 = (int)gx, z0 = (int)gz;
+            float fx = gx - x0, fz = gz - z0;
+
+            float sums[5] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+            for (int corner = 0; corner < 8; corner++) {
+                int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+                float weight = (dx ? fx : 1.0f - fx) * (dy ? fy : 1.0f - fy) * (dz ? fz : 1.0f - fz);
+                const float *values = task->grid + (((size_t)(y0 + dy) * gw + x0 + dx) * gd + z0 + dz) * cell;
+                for (int v = 0; v < cell; v++)
+                    sums[v] += weight * values[v];
+            }
+
+            unsigned char *out = task->output->pixels + ((size_t)y * task->img->width + x) * channels;
+            for (int c = 0; c < channels; c++) {
+                float value = sums[channels] > 0.0f ? sums[c] / sums[channels] : pixel[c];
+                out[c] = (unsigned char)clamp((int)(value + 0.5f), 0, 255);
+            }
+        }
+    }
+}
+
+/** @brief Apply an edge-preserving bilateral filter to an image, using a bilateral grid (J. Chen, S. Paris, F. Durand, 2007)
+ *
+ * The pixels are accumulated in a coarse 3D grid (x / sigmaSpatial, y / sigmaSpatial, luma / sigmaRange),
+ * the grid is blurred, and each output pixel reads the grid back with trilinear interpolation.
+ * The luma guides all channels, so colors are smoothed together. The grid has one cell per
+ * sigmaSpatial^2 pixels, so the cost is linear in the pixel count and does not grow with sigmaSpatial
+ * (below a sigmaSpatial of about 4 the grid gets larger than the image, so it is best suited to wider filters).
+ *
+ * @param img The image that will be filtered
+ * @param sigmaSpatial The spatial standard deviation in pixels (at least 1)
+ * @param sigmaRange The range standard deviation in luma levels (at least 1)
+ *
+ * @return The filtered image
+ */
+Image *applyBilateralFilter(const Image *img, float sigmaSpatial, float sigmaRange) {
+    if (!requirePixelU8(img, "applyBilateralFilter"))
+        return NULL;
+    if (sigmaSpatial < 1.0f || sigmaRange < 1.0f) {
+        printf("Bilateral sigmas must be at least 1\n");
+        return NULL;
+    }
+    if (img->channels > 4) {
+        printf("Unsupported image type\n");
+        return NULL;
+    }
+
+    // One extra cell on each side, so interpolation and blurring never leave the grid
+    BilateralTask task;
+    task.img = img;
+    task.sigmaSpatial = sigmaSpatial;
+    task.sigmaRange = sigmaRange;
+    task.gridWidth = (int)((img->width - 1) / sigmaSpatial) + 3;
+    task.gridHeight = (int)((img->height - 1) / sigmaSpatial) + 3;
+    task.gridDepth = (int)(255.0f / sigmaRange) + 3;
+
+    const int cell = img->channels + 1;
+    size_t gridValues = (size_t)task.gridWidth * task.gridHeight * task.gridDepth * cell;
+    task.grid = (float *)calloc(gridValues * 2, sizeof(float));
+    task.output = createImage(img->width, img->height, img->channels);
+    if (!task.grid || !task.output) {
+        printf("Error allocating memory for bilateral grid\n");
+        free(task.grid);
+        if (task.output)
+            freeImage(task.output);
+        return NULL;
+    }
+    task.scratch = task.grid + gridValues;
+
+    // Splat every pixel in its nearest cell
+    for (int y = 0; y < img->height; y++) {
+        int gy = (int)(y / sigmaSpatial + 1.5f);
+        for (int x = 0; x < img->width; x++) {
+            const unsigned char *pixel = img->pixels + ((size_t)y * img->width + x) * img->channels;
+            int gx = (int)(x / sigmaSpatial + 1.5f);
+            int gz = (int)(pixelLuma(pixel, img->channels) / sigmaRange + 1.5f);
+            float *values = task.grid + (((size_t)gy * task.gridWidth + gx) * task.gridDepth + gz) * cell;
+            for (int c = 0; c < img->channels; c++)
+                values[c] += pixel[c];
+            values[img->channels] += 1.0f;
+        }
+    }
+
+    parallelFor(task.gridDepth, 1, blurGridSpatial, &task);
+    parallelFor(task.gridHeight, 1, blurGridRange, &task);
+    parallelFor(img->height, 16, sliceGridRows, &task);
+
+    free(task.grid);
+    return task.output;
+}
+
+/** @brief Apply an edge-preserving guided filter to an image, guided by its own luma (K. He, J. Sun, X. Tang, 2010)
+ *
+ * Every channel is fitted, in each window, as a linear function of the luma: flat regions are averaged
+ * and edges of the luma are kept. All window means are running-sum box filters, so the cost does not
+ * depend on the radius.
+ *
+ * @param img The image that will be filtered
+ * @param radius The radius of the windows (at least 1)
+ * @param epsilon The regularization, in squared luma levels (larger values smooth more edges)
+ *
+ * @return The filtered image
+ */
+Image *applyGuidedFilter(const Image *img, int radius, float epsilon) {
+    if (!requirePixelU8(img, "applyGuidedFilter"))
+        return NULL;
+    if (radius < 1 || epsilon <= 0.0f) {
+        printf("Guided filter radius must be at least 1 and epsilon positive\n");
+        return NULL;
+    }
+
+    const int channels = img->channels;
+    const size_t pixelCount = (size_t)img->width * img->height;
+
+    // Per pixel: I, I * I, then p and I * p of every channel (I is the luma, p the channel)
+    const int lanes = 2 + 2 * channels;
+    float *statistics = (float *)malloc(pixelCount * lanes * sizeof(float));
+    float *coefficients = (float *)malloc(pixelCount * 2 * channels * sizeof(float));
+    if (!statistics || !coefficients) {
+        printf("Error allocating memory for guided filter\n");
+        free(statistics);
+        free(coefficients);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        const unsigned char *pixel = img->pixels + i * channels;
+        float *values = statistics + i * lanes;
+        float luma = pixelLuma(pixel, channels);
+        values[0] = luma;
+        values[1] = luma * luma;
+        for (int c = 0; c < channels; c++) {
+            values[2 + c] = pixel[c];
+            values[2 + channels + c] = luma * pixel[c];
+        }
+    }
+
+    ExtendedBox box = {radius, 1.0f / (2 * radius + 1), 0.0f};
+    Image *output = NULL;
+    if (boxFilterLanes(statistics, img->width, img->height, lanes, box, 1)) {
+        // Linear coefficients a and b of every window, then their means
+        for (size_t i = 0; i < pixelCount; i++) {
+            const float *means = statistics + i * lanes;
+            float *ab = coefficients + i * 2 * channels;
+            float variance = means[1] - means[0] * means[0];
+            for (int c = 0; c < channels; c++) {
+                float covariance = means[2 + channels + c] - means[0] * means[2 + c];
+                ab[c] = covariance / (variance + epsilon);
+                ab[channels + c] = means[2 + c] - ab[c] * means[0];
+            }
+        }
+
+        if (boxFilterLanes(coefficients, img->width, img->height, 2 * channels, box, 1))
+            output = createImage(img->width, img->height, channels);
+        if (output) {
+            for (size_t i = 0; i < pixelCount; i++) {
+                const unsigned char *pixel = img->pixels + i * channels;
+                const float *ab = coefficients + i * 2 * channels;
+                float luma = pixelLuma(pixel, channels);
+                for (int c = 0; c < channels; c++)
+                    output->pixels[i * channels + c] = (unsigned char)clamp((int)(ab[c] * luma + ab[channels + c] + 0.5f), 0, 255);
+            }
+        }
+    }
+
+    free(statistics);
+    free(coefficients);
+    return output;
+}
+
+// Morphological operations of applyMorphology
+typedef enum {
+    MORPH_ERODE,
+    MORPH_DILATE,
+    MORPH_OPEN,
+    MORPH_CLOSE,
+    MORPH_GRADIENT,
+} MorphologyOperation;
+
+/** @brief Element-wise minimum or maximum of two runs of bytes: out[i] = min/max(a[i], b[i])
+ */
+static void minMaxBytesScalar(unsigned char *out, const unsigned char *a, const unsigned char *b, int count, bool isMax) {
+    if (isMax) {
+        for (int i = 0; i < count; i++)
+            out[i] = a[i] > b[i] ? a[i] : b[i];
+    } else {
+        for (int i = 0; i < count; i++)
+            out[i] = a[i] < b[i] ? a[i] : b[i];
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("sse2"))) static void minMaxBytesSSE2(unsigned char *out, const unsigned char *a, const unsigned char *b, int count, bool isMax) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(out + i), isMax ? _mm_max_epu8(x, y) : _mm_min_epu8(x, y));
+    }
+    minMaxBytesScalar(out + i, a + i, b + i, count - i, isMax);
+}
+
+__attribute__((target("avx2"))) static void minMaxBytesAVX2(unsigned char *out, const unsigned char *a, const unsigned char *b, int count, bool isMax) {
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        _mm256_storeu_si256((__m256i *)(out + i), isMax ? _mm256_max_epu8(x, y) : _mm256_min_epu8(x, y));
+    }
+    minMaxBytesScalar(out + i, a + i, b + i, count - i, isMax);
+}
+#endif
+
+static void minMaxBytes(unsigned char *out, const unsigned char *a, const unsigned char *b, int count, bool isMax, DispatchLevel level) {
+#ifdef IMAGE_X86_SIMD
+    if (level == DISPATCH_AVX2) {
+        minMaxBytesAVX2(out, a, b, count, isMax);
+        return;
+    }
+    if (level == DISPATCH_SSE2) {
+        minMaxBytesSSE2(out, a, b, count, isMax);
+        return;
+    }
+#endif
+    (void)level;
+    minMaxBytesScalar(out, a, b, count, isMax);
+}
+
+#define MORPH_COLUMN_BAND 512 // Values of a row handled together by the vertical pass
+
+// Data shared by the threads of an erosion or dilation
+typedef struct {
+    const Image *img;
+    Image *output;
+    int size;   // Length of the structuring element along the pass
+    bool isMax; // Dilation (maximum) or erosion (minimum)
+    DispatchLevel level;
+    volatile int failed;
+} MorphologyTask;
+
+/** @brief Minimum/maximum over the window [x - size / 2, x - size / 2 + size - 1] of each pixel of some rows (van Herk/Gil-Werman)
+ *
+ * The row, padded with the neutral value, is cut in blocks of size values. g holds the running min/max from the
+ * start of each block and h from the end of each block, so every window is min/max(h[start], g[end]):
+ * 3 comparisons per pixel for any size.
+ */
+static void morphologyRows(void *context, int startRow, int endRow) {
+    MorphologyTask *task = (MorphologyTask *)context;
+    const int width = task->img->width;
+    const int channels = task->img->channels;
+    const int size = task->size;
+    const int anchor = size / 2;
+    const int padded = width + size - 1;
+    const unsigned char neutral = task->isMax ? 0 : 255;
+    const bool isMax = task->isMax;
+
+    unsigned char *g = (unsigned char *)malloc((size_t)padded * channels * 2);
+    if (!g) {
+        task->failed = 1;
+        return;
+    }
+    unsigned char *h = g + (size_t)padded * channels;
+
+    for (int y = startRow; y < endRow; y++) {
+        const unsigned char *row = task->img->pixels + (size_t)y * width * channels;
+
+        for (int j = 0; j < padded; j++) {
+            int x = j - anchor;
+            for (int c = 0; c < channels; c++) {
+                unsigned char value = (x >= 0 && x < width) ? row[x * channels + c] : neutral;
+                unsigned char previous = (j % size != 0) ? g[(j - 1) * channels + c] : neutral;
+                g[j * channels + c] = (j % size == 0) ? value : (isMax ? (value > previous ? value : previous) : (value < previous ? value : previous));
+            }
+        }
+        for (int j = padded - 1; j >= 0; j--) {
+            int x = j - anchor;
+            for (int c = 0; c < channels; c++) {
+                unsigned char value = (x >= 0 && x < width) ? row[x * channels + c] : neutral;
+                unsigned char next = (j + 1 < padded) ? h[(j + 1) * channels + c] : neutral;
+                h[j * channels + c] = (j % size == size - 1 || j == padded - 1) ? value : (isMax ? (value > next ? value : next) : (value < next ? value : next));
+            }
+        }
+
+        unsigned char *out = task->output->pixels + (size_t)y * width * channels;
+        minMaxBytesScalar(out, h, g + (size_t)(size - 1) * channels, width * channels, isMax);
+    }
+
+    free(g);
+}
+
+/** @brief Same as morphologyRows along the columns, for bands of values of a row
+ *
+ * g and h hold whole runs of rows, so every step is a SIMD min/max across the values of the band.
+ */
+static void morphologyColumns(void *context, int startBand, int endBand) {
+    MorphologyTask *task = (MorphologyTask *)context;
+    const int height = task->img->height;
+    const size_t rowValues = (size_t)task->img->width * task->img->channels;
+    const int size = task->size;
+    const int anchor = size / 2;
+    const int padded = height + size - 1;
+
+    unsigned char *buffers = (unsigned char *)malloc((size_t)MORPH_COLUMN_BAND * (2 * padded + 1));
+    if (!buffers) {
+        task->failed = 1;
+        return;
+    }
+    unsigned char *g = buffers;
+    unsigned char *h = buffers + (size_t)MORPH_COLUMN_BAND * padded;
+    unsigned char *neutralRow = h + (size_t)MORPH_COLUMN_BAND * padded;
+    memset(neutralRow, task->isMax ? 0 : 255, MORPH_COLUMN_BAND);
+
+    for (int band = startBand; band < endBand; band++) {
+        size_t start = (size_t)band * MORPH_COLUMN_BAND;
+        int count = rowValues - start < MORPH_COLUMN_BAND ? (int)(rowValues - start) : MORPH_COLUMN_BAND;
+
+        for (int j = 0; j < padded; j++) {
+            int y = j - anchor;
+            const unsigned char *value = (y >= 0 && y < height) ? task->img->pixels + y * rowValues + start : neutralRow;
+            unsigned char *gRow = g + (size_t)j * count;
+            if (j % size == 0)
+                memcpy(gRow, value, count);
+            else
+                minMaxBytes(gRow, gRow - count, value, count, task->isMax, task->level);
+        }
+        for (int j = padded - 1; j >= 0; j--) {
+            int y = j - anchor;
+            const unsigned char *value = (y >= 0 && y < height) ? task->img->pixels + y * rowValues + start : neutralRow;
+            unsigned char *hRow = h + (size_t)j * count;
+            if (j % size == size - 1 || j == padded - 1)
+                memcpy(hRow, value, count);
+            else
+                minMaxBytes(hRow, hRow + count, value, count, task->isMax, task->level);
+        }
+
+        for (int y = 0; y < height; y++) {
+            unsigned char *out = task->output->pixels + y * rowValues + start;
+            minMaxBytes(out, h + (size_t)y * count, g + (size_t)(y + size - 1) * count, count, task->isMax, task->level);
+        }
+    }
+
+    free(buffers);
+}
+
+/** @brief Erode (minimum) or dilate (maximum) an image with a rectangular structuring element
+ *
+ * @param img The image
+ * @param width The width of the structuring element
+ * @param height The height of the structuring element
+ * @param isMax Dilate if true, erode otherwise
+ *
+ * @return The eroded or dilated image
+ */
+static Image *erodeOrDilate(const Image *img, int width, int height, bool isMax) {
+    Image *rows = createImage(img->width, img->height, img->channels);
+    Image *output = createImage(img->width, img->height, img->channels);
+    if (!rows || !output) {
+        if (rows)
+            freeImage(rows);
+        if (output)
+            freeImage(output);
+        return NULL;
+    }
+
+    MorphologyTask task = {img, rows, width, isMax, getDispatchLevel(), 0};
+    parallelFor(img->height, 16, morphologyRows, &task);
+
+    int bands = (img->width * img->channels + MORPH_COLUMN_BAND - 1) / MORPH_COLUMN_BAND;
+    MorphologyTask columnTask = {rows, output, height, isMax, task.level, 0};
+    parallelFor(bands, 1, morphologyColumns, &columnTask);
+
+    freeImage(rows);
+    if (task.failed || columnTask.failed) {
+        printf("Error allocating memory for morphology\n");
+        freeImage(output);
+        return NULL;
+    }
+    return output;
+}
+
+/** @brief Apply a morphological operation with a rectangular structuring element
+ *
+ * Erosion and dilation use the van Herk/Gil-Werman algorithm, whose cost does not depend on the size of
+ * the element. Outside the image the pixels do not change the result (same as repeating the edges).
+ *
+ * @param img The image (e.g. a mask from convertBnW)
+ * @param operation The operation: erosion, dilation, opening, closing or gradient (dilation - erosion)
+ * @param width The width of the structuring element (at least 1)
+ * @param height The height of the structuring element (at least 1)
+ *
+ * @return The resulting image
+ */
+Image *applyMorphology(const Image *img, MorphologyOperation operation, int width, int height) {
+    if (!requirePixelU8(img, "applyMorphology"))
+        return NULL;
+    if (width < 1 || height < 1) {
+        printf("Structuring element must be at least 1 x 1\n");
+        return NULL;
+    }
+
+    Image *first = NULL;
+    Image *output = NULL;
+    switch (operation) {
+    case MORPH_ERODE:
+        return erodeOrDilate(img, width, height, false);
+    case MORPH_DILATE:
+        return erodeOrDilate(img, width, height, true);
+    case MORPH_OPEN:
+        first = erodeOrDilate(img, width, height, false);
+        output = first ? erodeOrDilate(first, width, height, true) : NULL;
+        break;
+    case MORPH_CLOSE:
+        first = erodeOrDilate(img, width, height, true);
+        output = first ? erodeOrDilate(first, width, height, false) : NULL;
+        break;
+    case MORPH_GRADIENT:
+        first = erodeOrDilate(img, width, height, false);
+        output = first ? erodeOrDilate(img, width, height, true) : NULL;
+        if (output) {
+            size_t count = (size_t)img->width * img->height * img->channels;
+            for (size_t i = 0; i < count; i++)
+                output->pixels[i] -= first->pixels[i];
+        }
+        break;
+    default:
+        printf("Unknown morphological operation\n");
+        return NULL;
+    }
+
+    if (first)
+        freeImage(first);
+    return output;
+}
+
+/** @brief Erode an image with a rectangular structuring element
+ *
+ * @param img The image that will be eroded
+ * @param width The width of the structuring element
+ * @param height The height of the structuring element
+ *
+ * @return The eroded image
+ */
+Image *applyErosion(const Image *img, int width, int height) {
+    return applyMorphology(img, MORPH_ERODE, width, height);
+}
+
+/** @brief Dilate an image with a rectangular structuring element
+ *
+ * @param img The image that will be dilated
+ * @param width The width of the structuring element
+ * @param height The height of the structuring element
+ *
+ * @return The dilated image
+ */
+Image *applyDilation(const Image *img, int width, int height) {
+    return applyMorphology(img, MORPH_DILATE, width, height);
+}
+
+/** @brief Apply a sharpen effect to an image
+ *
+ * @param img The image that will be applied the sharpen effect
+ * @param sharpenLevel The amount of sharpen applied
+ *
+ * @return The sharpened image
+ */
+Image *applySharpen(const Image *img, int sharpenLevel) {
+    if (sharpenLevel < 1) {
+        printf("Sharpen level must be at least 1\n");
+        return NULL;
+    }
+
+    if (img->pixelType != PIXEL_U8) {
+        const Kernel *kernel = acquireKernel(KERNEL_BOX, sharpenLevel);
+        if (!kernel)
+            return NULL;
+        Image *sharpenedImage = runTypedFilter(img, FILTER_SHARPEN, kernel->weights, NULL, kernel->size);
+        releaseKernel(kernel);
+        return sharpenedImage;
+    }
+
+    Image *sharpenedImage = (Image *)malloc(sizeof(Image));
+    if (!sharpenedImage) {
+        printf("Error allocating memory for sharpened image\n");
+        return NULL;
+    }
+
+    sharpenedImage->width = img->width;
     sharpenedImage->height = img->height;
     sharpenedImage->channels = img->channels;
+    sharpenedImage->pixelType = PIXEL_U8;
     sharpenedImage->pixels = (unsigned char *)malloc(img->width * img->height * img->channels * sizeof(unsigned char));
     if (!sharpenedImage->pixels) {
         free(sharpenedImage);
@@ -288,126 +2698,4773 @@ Image *applySharpen(const Image *img, int sharpenLevel) {
         return NULL;
     }
 
-    Image *blurredImage = applyBlur(img, sharpenLevel);
+    Image *blurredImage = applyBlur(img, sharpenLevel);
+
+    // Traverse each pixel in the image
+    for (int imgY = 0; imgY < img->height; imgY++) {
+        for (int imgX = 0; imgX < img->width; imgX++) {
+            // Process each channel (e.g., R, G, B for RGB)
+            for (int channelIndex = 0; channelIndex < img->channels; channelIndex++) {
+                int imageIndex = (imgY * img->width + imgX) * img->channels + channelIndex;
+
+                // Calculate the sharpened pixel value and clamp it to the 0-255 range
+                int sharpenedValue = clamp((img->pixels[imageIndex] * 2) - blurredImage->pixels[imageIndex], 0, 255);
+
+                // Set the output pixel value
+                sharpenedImage->pixels[imageIndex] = (unsigned char)sharpenedValue;
+            }
+        }
+    }
+
+    freeImage(blurredImage);
+    return sharpenedImage;
+}
+
+/** @brief Apply an edge detection effect to an image
+ *
+ * @param img The image that will be applied the edge detection effect
+ *
+ * @return The image after the edge detection has been applied
+ */
+Image *applyEdgeDetection(const Image *img) {
+    if (img->pixelType != PIXEL_U8) {
+        const float KX[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+        const float KY[] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+        return runTypedFilter(img, FILTER_EDGES, KX, KY, 3);
+    }
+
+    Image *outputImage = (Image *)malloc(sizeof(Image));
+    if (!outputImage) {
+        printf("Error allocating memory for output image\n");
+        return NULL;
+    }
+
+    outputImage->width = img->width;
+    outputImage->height = img->height;
+    outputImage->channels = img->channels;
+    outputImage->pixelType = PIXEL_U8;
+    outputImage->pixels = (unsigned char *)malloc(img->width * img->height * img->channels * sizeof(unsigned char));
+    if (!outputImage->pixels) {
+        free(outputImage);
+        printf("Error allocating memory for output image\n");
+        return NULL;
+    }
+
+    float KX[] = {
+        -1, 0, 1,
+        -2, 0, 2,
+        -1, 0, 1};
+
+    float KY[] = {
+        -1, -2, -1,
+        0, 0, 0,
+        1, 2, 1};
+
+    // Traverse each pixel in the image
+    for (int imgY = 0; imgY < img->height; imgY++) {
+        for (int imgX = 0; imgX < img->width; imgX++) {
+            // Process each channel (e.g., R, G, B for RGB)
+            for (int channelIndex = 0; channelIndex < img->channels; channelIndex++) {
+                float pixelValueX = 0.0f;
+                float pixelValueY = 0.0f;
+
+                // Traverse each position in the kernel
+                for (int kernelY = -1; kernelY <= 1; kernelY++) {
+                    for (int kernelX = -1; kernelX <= 1; kernelX++) {
+
+                        // Calculate the position of the neighboring pixel, clamped to image boundaries
+                        int pixelX = clamp(imgX + kernelX, 0, img->width - 1);
+                        int pixelY = clamp(imgY + kernelY, 0, img->height - 1);
+
+                        // Calculate the position (index) in the image and kernel
+                        int pixelIndex = (pixelY * img->width + pixelX) * img->channels + channelIndex;
+                        int kernelIndex = (kernelY + 1) * 3 + (kernelX + 1);
+
+                        pixelValueX += img->pixels[pixelIndex] * KX[kernelIndex];
+                        pixelValueY += img->pixels[pixelIndex] * KY[kernelIndex];
+                    }
+                }
+
+                // Do the calculation of the pixel value and clamp it to the 0-255 range
+                int pixelCalculatedValue = clamp(sqrt(pixelValueX * pixelValueX + pixelValueY * pixelValueY), 0, 255);
+
+                // Set the output pixel value
+                int outputIndex = (imgY * img->width + imgX) * img->channels + channelIndex;
+                outputImage->pixels[outputIndex] = (unsigned char)pixelCalculatedValue;
+            }
+        }
+    }
+
+    return outputImage;
+}
+
+// Ways applyEdgeDetectionMode combines the channels
+typedef enum {
+    EDGE_PER_CHANNEL,  // Every channel separately, like applyEdgeDetection
+    EDGE_LUMA,         // Once on the luma, one channel output
+    EDGE_MAX_GRADIENT, // Strongest gradient among the color channels, one channel output
+} EdgeMode;
+
+// Data shared by the threads of the single channel edge detection
+typedef struct {
+    const Image *img;
+    unsigned char *luma;
+    Image *output;
+    EdgeMode mode;
+} EdgeTask;
+
+/** @brief Compute the luma of some rows, with the expression of convertBnW (in double, so the rounding matches)
+ */
+static void lumaRows(void *context, int startRow, int endRow) {
+    EdgeTask *task = (EdgeTask *)context;
+    const int channels = task->img->channels;
+    size_t start = (size_t)startRow * task->img->width;
+    size_t end = (size_t)endRow * task->img->width;
+
+    for (size_t i = start; i < end; i++) {
+        const unsigned char *pixel = task->img->pixels + i * channels;
+        task->luma[i] = channels >= 3 ? (unsigned char)round(0.299 * pixel[0] + 0.587 * pixel[1] + 0.114 * pixel[2]) : pixel[0];
+    }
+}
+
+/** @brief Sobel magnitude of some rows, on the luma or the strongest color channel
+ */
+static void singleChannelEdgeRows(void *context, int startRow, int endRow) {
+    EdgeTask *task = (EdgeTask *)context;
+    const int width = task->img->width;
+    const int height = task->img->height;
+    const bool onLuma = task->mode == EDGE_LUMA;
+    const int channels = onLuma ? 1 : task->img->channels;
+    const int colorChannels = onLuma ? 1 : colorChannelCount(task->img);
+    const unsigned char *pixels = onLuma ? task->luma : task->img->pixels;
+    const size_t stride = (size_t)width * channels;
+
+    for (int y = startRow; y < endRow; y++) {
+        const unsigned char *up = pixels + (size_t)clamp(y - 1, 0, height - 1) * stride;
+        const unsigned char *center = pixels + (size_t)y * stride;
+        const unsigned char *down = pixels + (size_t)clamp(y + 1, 0, height - 1) * stride;
+        unsigned char *out = task->output->pixels + (size_t)y * width;
+
+        for (int x = 0; x < width; x++) {
+            int left = (x > 0 ? x - 1 : 0) * channels;
+            int right = (x < width - 1 ? x + 1 : width - 1) * channels;
+            int middle = x * channels;
+            int strongest = 0;
+
+            for (int c = 0; c < colorChannels; c++) {
+                int gx = (up[right + c] + 2 * center[right + c] + down[right + c]) - (up[left + c] + 2 * center[left + c] + down[left + c]);
+                int gy = (down[left + c] + 2 * down[middle + c] + down[right + c]) - (up[left + c] + 2 * up[middle + c] + up[right + c]);
+                int magnitude = gx * gx + gy * gy;
+                if (magnitude > strongest)
+                    strongest = magnitude;
+            }
+
+            out[x] = (unsigned char)clamp((int)sqrt((double)strongest), 0, 255);
+        }
+    }
+}
+
+/** @brief Apply an edge detection effect, choosing how the channels are combined
+ *
+ * EDGE_LUMA and EDGE_MAX_GRADIENT compute a single edge map (the alpha channel is ignored), which costs a
+ * fraction of the per channel detection on color images and outputs a one channel image.
+ *
+ * @param img The image that will be applied the edge detection effect
+ * @param mode How the channels are combined
+ *
+ * @return The image after the edge detection has been applied
+ */
+Image *applyEdgeDetectionMode(const Image *img, EdgeMode mode) {
+    if (mode == EDGE_PER_CHANNEL)
+        return applyEdgeDetection(img);
+    if (!requirePixelU8(img, "applyEdgeDetectionMode"))
+        return NULL;
+
+    Image *output = createImage(img->width, img->height, 1);
+    if (!output)
+        return NULL;
+
+    EdgeTask task = {img, NULL, output, mode};
+    if (mode == EDGE_LUMA) {
+        task.luma = (unsigned char *)malloc((size_t)img->width * img->height);
+        if (!task.luma) {
+            printf("Error allocating memory for luma\n");
+            freeImage(output);
+            return NULL;
+        }
+        parallelFor(img->height, 64, lumaRows, &task);
+    }
+
+    parallelFor(img->height, 32, singleChannelEdgeRows, &task);
+
+    free(task.luma);
+    return output;
+}
+
+// How the filters with an alpha variant treat the alpha channel of 2 and 4 channel images
+typedef enum {
+    ALPHA_AS_COLOR,      // Filter alpha like any other channel (the behavior of the plain filters)
+    ALPHA_PREMULTIPLIED, // Filter premultiplied color and alpha together, then unpremultiply
+    ALPHA_PASSTHROUGH,   // Filter the color channels only and copy alpha untouched
+} AlphaMode;
+
+// Data shared by the threads of the alpha aware filters
+typedef struct {
+    const Image *img;
+    const float *source; // lanes values per pixel: premultiplied channels, or the color channels
+    int lanes;
+    const float *kernel;
+    const float *kernelY; // Second kernel of the edge detection
+    int kernelSize;
+    FilterKind filter;
+    AlphaMode mode;
+    const float *reciprocal; // 255 / alpha, for unpremultiplying
+    Image *output;
+    DispatchLevel level;
+} AlphaFilterTask;
+
+/** @brief Accumulate a kernel around a pixel, with clamped borders, in the same order as applyKernel
+ */
+static void accumulateKernelScalar(const AlphaFilterTask *task, const float *kernel, int x, int y, float *sums) {
+    const int width = task->img->width;
+    const int height = task->img->height;
+    const int lanes = task->lanes;
+    const int half = task->kernelSize / 2;
+
+    for (int lane = 0; lane < lanes; lane++)
+        sums[lane] = 0.0f;
+
+    for (int kernelY = -half; kernelY <= half; kernelY++) {
+        const float *row = task->source + (size_t)clamp(y + kernelY, 0, height - 1) * width * lanes;
+        const float *weights = kernel + (kernelY + half) * task->kernelSize + half;
+        for (int kernelX = -half; kernelX <= half; kernelX++) {
+            const float *pixel = row + clamp(x + kernelX, 0, width - 1) * lanes;
+            for (int lane = 0; lane < lanes; lane++)
+                sums[lane] += pixel[lane] * weights[kernelX];
+        }
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+// The four lanes of a pixel fill one SSE register, with the same rounding as the scalar code
+__attribute__((target("sse2"))) static void accumulateKernel4SSE2(const AlphaFilterTask *task, const float *kernel, int x, int y, float *sums) {
+    const int width = task->img->width;
+    const int height = task->img->height;
+    const int half = task->kernelSize / 2;
+    __m128 sum = _mm_setzero_ps();
+
+    for (int kernelY = -half; kernelY <= half; kernelY++) {
+        const float *row = task->source + (size_t)clamp(y + kernelY, 0, height - 1) * width * 4;
+        const float *weights = kernel + (kernelY + half) * task->kernelSize + half;
+        for (int kernelX = -half; kernelX <= half; kernelX++) {
+            __m128 pixel = _mm_loadu_ps(row + clamp(x + kernelX, 0, width - 1) * 4);
+            sum = _mm_add_ps(sum, _mm_mul_ps(pixel, _mm_set1_ps(weights[kernelX])));
+        }
+    }
+    _mm_storeu_ps(sums, sum);
+}
+#endif
+
+static void accumulateKernel(const AlphaFilterTask *task, const float *kernel, int x, int y, float *sums) {
+#ifdef IMAGE_X86_SIMD
+    if (task->lanes == 4 && task->level != DISPATCH_SCALAR) {
+        accumulateKernel4SSE2(task, kernel, x, y, sums);
+        return;
+    }
+#endif
+    accumulateKernelScalar(task, kernel, x, y, sums);
+}
+
+/** @brief Filter some rows of an image with an alpha channel
+ */
+static void alphaFilterRows(void *context, int startRow, int endRow) {
+    AlphaFilterTask *task = (AlphaFilterTask *)context;
+    const int width = task->img->width;
+    const int channels = task->img->channels;
+    const int lanes = task->lanes;
+    const int alpha = channels - 1;
+    const bool premultiplied = task->mode == ALPHA_PREMULTIPLIED;
+
+    for (int y = startRow; y < endRow; y++) {
+        for (int x = 0; x < width; x++) {
+            const size_t pixelIndex = (size_t)y * width + x;
+            const float *center = task->source + pixelIndex * lanes;
+            const unsigned char *in = task->img->pixels + pixelIndex * channels;
+            unsigned char *out = task->output->pixels + pixelIndex * channels;
+            float values[4], sumsY[4];
+
+            accumulateKernel(task, task->kernel, x, y, values);
+            if (task->filter == FILTER_SHARPEN) {
+                // The plain sharpen subtracts the blurred image after it was stored in bytes
+                for (int lane = 0; lane < lanes; lane++)
+                    values[lane] = 2.0f * center[lane] - (premultiplied ? values[lane] : (float)clamp((int)values[lane], 0, 255));
+            } else if (task->filter == FILTER_EDGES) {
+                accumulateKernel(task, task->kernelY, x, y, sumsY);
+                for (int lane = 0; lane < lanes; lane++)
+                    values[lane] = sqrtf(values[lane] * values[lane] + sumsY[lane] * sumsY[lane]);
+            }
+
+            if (!premultiplied) {
+                for (int c = 0; c < lanes; c++)
+                    out[c] = (unsigned char)clamp((int)values[c], 0, 255);
+                out[alpha] = in[alpha];
+            } else if (task->filter == FILTER_EDGES) {
+                // An edge map is not a color over the alpha: keep the gradients of the premultiplied color and the alpha
+                for (int c = 0; c < alpha; c++)
+                    out[c] = (unsigned char)clamp((int)values[c], 0, 255);
+                out[alpha] = in[alpha];
+            } else {
+                int outAlpha = clamp((int)(values[alpha] + 0.5f), 0, 255);
+                for (int c = 0; c < alpha; c++)
+                    out[c] = (unsigned char)clamp((int)(values[c] * task->reciprocal[outAlpha] + 0.5f), 0, 255);
+                out[alpha] = (unsigned char)outAlpha;
+            }
+        }
+    }
+}
+
+/** @brief Run one of the alpha aware filters
+ *
+ * @param img The image, with 2 or 4 channels
+ * @param filter The filter
+ * @param kernel The kernel (the horizontal one for the edge detection)
+ * @param kernelY The vertical kernel of the edge detection, NULL otherwise
+ * @param kernelSize The size of one side of the kernels
+ * @param mode ALPHA_PREMULTIPLIED or ALPHA_PASSTHROUGH
+ *
+ * @return The filtered image, or NULL if the memory could not be allocated
+ */
+static Image *runAlphaFilter(const Image *img, FilterKind filter, const float *kernel, const float *kernelY, int kernelSize, AlphaMode mode) {
+    if (!requirePixelU8(img, "Alpha aware filtering"))
+        return NULL;
+    const int channels = img->channels;
+    const int lanes = mode == ALPHA_PREMULTIPLIED ? channels : channels - 1;
+    const size_t pixelCount = (size_t)img->width * img->height;
+
+    Image *output = createImage(img->width, img->height, channels);
+    if (!output)
+        return NULL;
+
+    float *source = (float *)malloc(pixelCount * lanes * sizeof(float));
+    if (!source) {
+        printf("Error allocating memory for alpha filter\n");
+        freeImage(output);
+        return NULL;
+    }
+
+    // Premultiply once (or drop alpha) so every tap of the kernel reads ready values
+    for (size_t i = 0; i < pixelCount; i++) {
+        const unsigned char *pixel = img->pixels + i * channels;
+        float *lane = source + i * lanes;
+        float scale = mode == ALPHA_PREMULTIPLIED ? pixel[channels - 1] / 255.0f : 1.0f;
+        for (int c = 0; c < channels - 1; c++)
+            lane[c] = pixel[c] * scale;
+        if (mode == ALPHA_PREMULTIPLIED)
+            lane[channels - 1] = pixel[channels - 1];
+    }
+
+    float reciprocal[256];
+    reciprocal[0] = 0.0f;
+    for (int a = 1; a < 256; a++)
+        reciprocal[a] = 255.0f / a;
+
+    AlphaFilterTask task = {img, source, lanes, kernel, kernelY, kernelSize, filter, mode, reciprocal, output, getDispatchLevel()};
+    parallelFor(img->height, 16, alphaFilterRows, &task);
+
+    free(source);
+    return output;
+}
+
+/** @brief Apply a kernel to an image, choosing how the alpha channel is treated
+ *
+ * ALPHA_PREMULTIPLIED keeps the color of transparent pixels from bleeding into their neighbors;
+ * ALPHA_PASSTHROUGH filters the color channels like applyKernel and skips the alpha channel.
+ * Images without an alpha channel, and ALPHA_AS_COLOR, give the same result as applyKernel.
+ *
+ * @param img The image that will be applied the kernel
+ * @param kernel The kernel that will be applied to the image
+ * @param kernelSize The size of one side of the kernel
+ * @param mode How the alpha channel is treated
+ *
+ * @return The image after the kernel has been applied
+ */
+Image *applyKernelAlpha(const Image *img, const float *kernel, const int kernelSize, AlphaMode mode) {
+    if (mode == ALPHA_AS_COLOR || (img->channels != 2 && img->channels != 4))
+        return applyKernel(img, kernel, kernelSize);
+    return runAlphaFilter(img, FILTER_KERNEL, kernel, NULL, kernelSize, mode);
+}
+
+/** @brief Apply a sharpen effect to an image, choosing how the alpha channel is treated
+ *
+ * @param img The image that will be applied the sharpen effect
+ * @param sharpenLevel The amount of sharpen applied
+ * @param mode How the alpha channel is treated (see applyKernelAlpha)
+ *
+ * @return The sharpened image
+ */
+Image *applySharpenAlpha(const Image *img, int sharpenLevel, AlphaMode mode) {
+    if (mode == ALPHA_AS_COLOR || (img->channels != 2 && img->channels != 4))
+        return applySharpen(img, sharpenLevel);
+    if (sharpenLevel < 1) {
+        printf("Sharpen level must be at least 1\n");
+        return NULL;
+    }
+
+    const Kernel *kernel = acquireKernel(KERNEL_BOX, sharpenLevel);
+    if (!kernel)
+        return NULL;
+
+    Image *sharpenedImage = runAlphaFilter(img, FILTER_SHARPEN, kernel->weights, NULL, kernel->size, mode);
+
+    releaseKernel(kernel);
+    return sharpenedImage;
+}
+
+/** @brief Apply an edge detection effect to an image, choosing how the alpha channel is treated
+ *
+ * Both ALPHA_PREMULTIPLIED (gradients of the premultiplied color) and ALPHA_PASSTHROUGH keep the alpha channel of the image.
+ *
+ * @param img The image that will be applied the edge detection effect
+ * @param mode How the alpha channel is treated
+ *
+ * @return The image after the edge detection has been applied
+ */
+Image *applyEdgeDetectionAlpha(const Image *img, AlphaMode mode) {
+    if (mode == ALPHA_AS_COLOR || (img->channels != 2 && img->channels != 4))
+        return applyEdgeDetection(img);
+
+    const float KX[] = {
+        -1, 0, 1,
+        -2, 0, 2,
+        -1, 0, 1};
+
+    const float KY[] = {
+        -1, -2, -1,
+        0, 0, 0,
+        1, 2, 1};
+
+    return runAlphaFilter(img, FILTER_EDGES, KX, KY, 3, mode);
+}
+
+// Structure to hold a planar image: each channel is a contiguous width * height plane
+typedef struct {
+    int width;
+    int height;
+    int channels;
+    unsigned char *planes[4]; // One allocation, starting at planes[0]
+} PlanarImage;
+
+/** @brief Create a planar image with uninitialized pixels
+ *
+ * @param width The width of the image
+ * @param height The height of the image
+ * @param channels The number of channels (1 to 4)
+ *
+ * @return The new image, or NULL if the memory could not be allocated
+ */
+PlanarImage *createPlanarImage(int width, int height, int channels) {
+    if (channels < 1 || channels > 4) {
+        printf("Unsupported number of channels: %d\n", channels);
+        return NULL;
+    }
+
+    PlanarImage *img = (PlanarImage *)malloc(sizeof(PlanarImage));
+    if (!img) {
+        printf("Error allocating memory for planar image\n");
+        return NULL;
+    }
+
+    size_t planeSize = (size_t)width * height;
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->planes[0] = (unsigned char *)malloc(planeSize * channels);
+    if (!img->planes[0]) {
+        free(img);
+        printf("Error allocating memory for planar image pixels\n");
+        return NULL;
+    }
+    for (int c = 1; c < 4; c++)
+        img->planes[c] = c < channels ? img->planes[0] + c * planeSize : NULL;
+
+    return img;
+}
+
+/** @brief Free the memory allocated for a planar image
+ *
+ * @param img The image that will be freed
+ */
+void freePlanarImage(PlanarImage *img) {
+    free(img->planes[0]);
+    free(img);
+}
+
+/** @brief Split interleaved pixels into planes
+ */
+static void deinterleaveScalar(const unsigned char *pixels, unsigned char *const *planes, int channels, size_t start, size_t end) {
+    for (size_t i = start; i < end; i++)
+        for (int c = 0; c < channels; c++)
+            planes[c][i] = pixels[i * channels + c];
+}
+
+/** @brief Merge planes into interleaved pixels
+ */
+static void interleaveScalar(unsigned char *const *planes, unsigned char *pixels, int channels, size_t start, size_t end) {
+    for (size_t i = start; i < end; i++)
+        for (int c = 0; c < channels; c++)
+            pixels[i * channels + c] = planes[c][i];
+}
+
+#ifdef IMAGE_X86_SIMD
+/** @brief Build the byte shuffles between 16 interleaved pixels (channels registers) and 16 bytes of each plane
+ *
+ * masks[register * 4 + channel] moves the bytes of that channel between the register and the plane, the other bytes are zeroed.
+ */
+static void planarShuffleMasks(int channels, bool toPlanes, unsigned char masks[16][16]) {
+    for (int r = 0; r < channels; r++) {
+        for (int c = 0; c < channels; c++) {
+            for (int i = 0; i < 16; i++) {
+                // toPlanes: byte i of plane c comes from interleaved byte channels * i + c
+                // otherwise: interleaved byte 16 * r + i comes from byte (16 * r + i) / channels of its plane
+                int source = toPlanes ? channels * i + c - 16 * r : (16 * r + i) / channels;
+                bool inside = toPlanes ? source >= 0 && source < 16 : (16 * r + i) % channels == c;
+                masks[r * 4 + c][i] = inside ? (unsigned char)source : 0x80;
+            }
+        }
+    }
+}
+
+// The byte shuffle is SSSE3, which every AVX2 processor has
+__attribute__((target("avx2"))) static void deinterleaveAVX2(const unsigned char *pixels, unsigned char *const *planes, int channels, size_t start, size_t end) {
+    unsigned char maskBytes[16][16];
+    planarShuffleMasks(channels, true, maskBytes);
+    __m128i masks[16];
+    for (int i = 0; i < 16; i++)
+        masks[i] = _mm_loadu_si128((const __m128i *)maskBytes[i]);
+
+    size_t i = start;
+    for (; i + 16 <= end; i += 16) {
+        __m128i in[4];
+        for (int r = 0; r < channels; r++)
+            in[r] = _mm_loadu_si128((const __m128i *)(pixels + i * channels + 16 * r));
+        for (int c = 0; c < channels; c++) {
+            __m128i plane = _mm_shuffle_epi8(in[0], masks[c]);
+            for (int r = 1; r < channels; r++)
+                plane = _mm_or_si128(plane, _mm_shuffle_epi8(in[r], masks[r * 4 + c]));
+            _mm_storeu_si128((__m128i *)(planes[c] + i), plane);
+        }
+    }
+    deinterleaveScalar(pixels, planes, channels, i, end);
+}
+
+__attribute__((target("avx2"))) static void interleaveAVX2(unsigned char *const *planes, unsigned char *pixels, int channels, size_t start, size_t end) {
+    unsigned char maskBytes[16][16];
+    planarShuffleMasks(channels, false, maskBytes);
+    __m128i masks[16];
+    for (int i = 0; i < 16; i++)
+        masks[i] = _mm_loadu_si128((const __m128i *)maskBytes[i]);
+
+    size_t i = start;
+    for (; i + 16 <= end; i += 16) {
+        __m128i in[4];
+        for (int c = 0; c < channels; c++)
+            in[c] = _mm_loadu_si128((const __m128i *)(planes[c] + i));
+        for (int r = 0; r < channels; r++) {
+            __m128i out = _mm_shuffle_epi8(in[0], masks[r * 4]);
+            for (int c = 1; c < channels; c++)
+                out = _mm_or_si128(out, _mm_shuffle_epi8(in[c], masks[r * 4 + c]));
+            _mm_storeu_si128((__m128i *)(pixels + i * channels + 16 * r), out);
+        }
+    }
+    interleaveScalar(planes, pixels, channels, i, end);
+}
+
+// SSE2 has no byte shuffle, but 4 channel pixels split with shifts and packs
+__attribute__((target("sse2"))) static void deinterleave4SSE2(const unsigned char *pixels, unsigned char *const *planes, size_t start, size_t end) {
+    const __m128i low = _mm_set1_epi32(0xFF);
+    size_t i = start;
+    for (; i + 16 <= end; i += 16) {
+        __m128i in[4];
+        for (int r = 0; r < 4; r++)
+            in[r] = _mm_loadu_si128((const __m128i *)(pixels + i * 4 + 16 * r));
+        for (int c = 0; c < 4; c++) {
+            __m128i v0 = _mm_and_si128(_mm_srli_epi32(in[0], 8 * c), low);
+            __m128i v1 = _mm_and_si128(_mm_srli_epi32(in[1], 8 * c), low);
+            __m128i v2 = _mm_and_si128(_mm_srli_epi32(in[2], 8 * c), low);
+            __m128i v3 = _mm_and_si128(_mm_srli_epi32(in[3], 8 * c), low);
+            __m128i packed = _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3));
+            _mm_storeu_si128((__m128i *)(planes[c] + i), packed);
+        }
+    }
+    deinterleaveScalar(pixels, planes, 4, i, end);
+}
+
+__attribute__((target("sse2"))) static void interleave4SSE2(unsigned char *const *planes, unsigned char *pixels, size_t start, size_t end) {
+    size_t i = start;
+    for (; i + 16 <= end; i += 16) {
+        __m128i r = _mm_loadu_si128((const __m128i *)(planes[0] + i));
+        __m128i g = _mm_loadu_si128((const __m128i *)(planes[1] + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(planes[2] + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(planes[3] + i));
+        __m128i rgLow = _mm_unpacklo_epi8(r, g), rgHigh = _mm_unpackhi_epi8(r, g);
+        __m128i baLow = _mm_unpacklo_epi8(b, a), baHigh = _mm_unpackhi_epi8(b, a);
+        _mm_storeu_si128((__m128i *)(pixels + i * 4), _mm_unpacklo_epi16(rgLow, baLow));
+        _mm_storeu_si128((__m128i *)(pixels + i * 4 + 16), _mm_unpackhi_epi16(rgLow, baLow));
+        _mm_storeu_si128((__m128i *)(pixels + i * 4 + 32), _mm_unpacklo_epi16(rgHigh, baHigh));
+        _mm_storeu_si128((__m128i *)(pixels + i * 4 + 48), _mm_unpackhi_epi16(rgHigh, baHigh));
+    }
+    interleaveScalar(planes, pixels, 4, i, end);
+}
+#endif
+
+// Data shared by the threads of the layout conversions
+typedef struct {
+    unsigned char *pixels;
+    unsigned char *const *planes;
+    int width;
+    int channels;
+    bool toPlanes;
+    DispatchLevel level;
+} LayoutTask;
+
+static void convertLayoutRows(void *context, int startRow, int endRow) {
+    LayoutTask *task = (LayoutTask *)context;
+    size_t start = (size_t)startRow * task->width;
+    size_t end = (size_t)endRow * task->width;
+
+#ifdef IMAGE_X86_SIMD
+    if (task->channels > 1 && task->level == DISPATCH_AVX2) {
+        if (task->toPlanes)
+            deinterleaveAVX2(task->pixels, task->planes, task->channels, start, end);
+        else
+            interleaveAVX2(task->planes, task->pixels, task->channels, start, end);
+        return;
+    }
+    if (task->channels == 4 && task->level == DISPATCH_SSE2) {
+        if (task->toPlanes)
+            deinterleave4SSE2(task->pixels, task->planes, start, end);
+        else
+            interleave4SSE2(task->planes, task->pixels, start, end);
+        return;
+    }
+#endif
+    if (task->toPlanes)
+        deinterleaveScalar(task->pixels, task->planes, task->channels, start, end);
+    else
+        interleaveScalar(task->planes, task->pixels, task->channels, start, end);
+}
+
+/** @brief Convert an interleaved image to a planar image
+ *
+ * @param img The image
+ *
+ * @return The planar image, or NULL if the memory could not be allocated
+ */
+PlanarImage *convertToPlanar(const Image *img) {
+    if (!requirePixelU8(img, "convertToPlanar"))
+        return NULL;
+    PlanarImage *planar = createPlanarImage(img->width, img->height, img->channels);
+    if (!planar)
+        return NULL;
+
+    LayoutTask task = {img->pixels, planar->planes, img->width, img->channels, true, getDispatchLevel()};
+    parallelFor(img->height, 64, convertLayoutRows, &task);
+    return planar;
+}
+
+/** @brief Convert a planar image to an interleaved image
+ *
+ * @param planar The planar image
+ *
+ * @return The interleaved image, or NULL if the memory could not be allocated
+ */
+Image *convertFromPlanar(const PlanarImage *planar) {
+    Image *img = createImage(planar->width, planar->height, planar->channels);
+    if (!img)
+        return NULL;
+
+    LayoutTask task = {img->pixels, planar->planes, planar->width, planar->channels, false, getDispatchLevel()};
+    parallelFor(planar->height, 64, convertLayoutRows, &task);
+    return img;
+}
+
+/** @brief Load an image from a file into a planar image
+ *
+ * @param filename The name of the file to load
+ *
+ * @return Returns a pointer to the loaded image, or NULL if the image could not be loaded
+ */
+PlanarImage *loadPlanarImage(const char *filename) {
+    Image *img = loadImage(filename);
+    if (!img)
+        return NULL;
+
+    PlanarImage *planar = convertToPlanar(img);
+    freeImage(img);
+    return planar;
+}
+
+/** @brief Save a planar image to a file
+ *
+ * @param filename The name the file will be saved as
+ * @param planar The image that will be saved
+ */
+void savePlanarImage(const char *filename, const PlanarImage *planar) {
+    Image *img = convertFromPlanar(planar);
+    if (!img) {
+        printf("Error saving image: %s\n", filename);
+        return;
+    }
+
+    saveImage(filename, img);
+    freeImage(img);
+}
+
+// Data shared by the threads of the planar filters
+typedef struct {
+    const unsigned char *plane;
+    unsigned char *output;
+    int width;
+    int height;
+    const float *kernel;
+    const float *kernelY; // Second kernel of the edge detection
+    int kernelSize;
+    FilterKind filter;
+    DispatchLevel level;
+} PlanarFilterTask;
+
+/** @brief Filter one pixel of a plane, with the arithmetic of applyKernel, applySharpen and applyEdgeDetection
+ */
+static unsigned char planarFilterPixel(const PlanarFilterTask *task, int x, int y) {
+    const int half = task->kernelSize / 2;
+    float sum = 0.0f, sumY = 0.0f;
+
+    for (int kernelY = -half; kernelY <= half; kernelY++) {
+        const unsigned char *row = task->plane + (size_t)clamp(y + kernelY, 0, task->height - 1) * task->width;
+        int kernelRow = (kernelY + half) * task->kernelSize + half;
+        for (int kernelX = -half; kernelX <= half; kernelX++) {
+            unsigned char value = row[clamp(x + kernelX, 0, task->width - 1)];
+            sum += value * task->kernel[kernelRow + kernelX];
+            if (task->filter == FILTER_EDGES)
+                sumY += value * task->kernelY[kernelRow + kernelX];
+        }
+    }
+
+    if (task->filter == FILTER_SHARPEN)
+        return (unsigned char)clamp(task->plane[(size_t)y * task->width + x] * 2 - clamp((int)sum, 0, 255), 0, 255);
+    if (task->filter == FILTER_EDGES)
+        return (unsigned char)clamp(sqrt(sum * sum + sumY * sumY), 0, 255);
+    return (unsigned char)clamp((int)sum, 0, 255);
+}
+
+#ifdef IMAGE_X86_SIMD
+/** @brief Filter the inside of a plane row 8 pixels at a time: same order of operations as the scalar code, so the same result
+ *
+ * @return The first x that is left to the scalar code
+ */
+__attribute__((target("avx2"))) static int planarFilterRowAVX2(const PlanarFilterTask *task, int y, int startX, int endX, unsigned char *out) {
+    const int half = task->kernelSize / 2;
+    const int width = task->width;
+    int x = startX;
+
+    for (; x + 8 <= endX; x += 8) {
+        __m256 sum = _mm256_setzero_ps(), sumY = _mm256_setzero_ps();
+        for (int kernelY = -half; kernelY <= half; kernelY++) {
+            const unsigned char *row = task->plane + (size_t)clamp(y + kernelY, 0, task->height - 1) * width + x;
+            int kernelRow = (kernelY + half) * task->kernelSize + half;
+            for (int kernelX = -half; kernelX <= half; kernelX++) {
+                __m256 value = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + kernelX))));
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(value, _mm256_set1_ps(task->kernel[kernelRow + kernelX])));
+                if (task->filter == FILTER_EDGES)
+                    sumY = _mm256_add_ps(sumY, _mm256_mul_ps(value, _mm256_set1_ps(task->kernelY[kernelRow + kernelX])));
+            }
+        }
+
+        __m256i result;
+        if (task->filter == FILTER_SHARPEN) {
+            __m256i blurred = _mm256_min_epi32(_mm256_max_epi32(_mm256_cvttps_epi32(sum), _mm256_setzero_si256()), _mm256_set1_epi32(255));
+            __m256i center = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(task->plane + (size_t)y * width + x)));
+            result = _mm256_sub_epi32(_mm256_add_epi32(center, center), blurred);
+        } else if (task->filter == FILTER_EDGES) {
+            result = _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(sum, sum), _mm256_mul_ps(sumY, sumY))));
+        } else {
+            result = _mm256_cvttps_epi32(sum);
+        }
+
+        // Saturating packs clamp to 0-255
+        __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(result), _mm256_extracti128_si256(result, 1));
+        _mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(words, words));
+    }
+    return x;
+}
+
+__attribute__((target("sse2"))) static int planarFilterRowSSE2(const PlanarFilterTask *task, int y, int startX, int endX, unsigned char *out) {
+    const int half = task->kernelSize / 2;
+    const int width = task->width;
+    const __m128i zero = _mm_setzero_si128();
+    int x = startX;
+
+    for (; x + 4 <= endX; x += 4) {
+        __m128 sum = _mm_setzero_ps(), sumY = _mm_setzero_ps();
+        for (int kernelY = -half; kernelY <= half; kernelY++) {
+            const unsigned char *row = task->plane + (size_t)clamp(y + kernelY, 0, task->height - 1) * width + x;
+            int kernelRow = (kernelY + half) * task->kernelSize + half;
+            for (int kernelX = -half; kernelX <= half; kernelX++) {
+                int bytes;
+                memcpy(&bytes, row + kernelX, 4);
+                __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+                __m128 value = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+                sum = _mm_add_ps(sum, _mm_mul_ps(value, _mm_set1_ps(task->kernel[kernelRow + kernelX])));
+                if (task->filter == FILTER_EDGES)
+                    sumY = _mm_add_ps(sumY, _mm_mul_ps(value, _mm_set1_ps(task->kernelY[kernelRow + kernelX])));
+            }
+        }
+
+        __m128i result;
+        if (task->filter == FILTER_SHARPEN) {
+            // Clamp the blur to 0-255 with a pack round trip (SSE2 has no 32 bit min/max)
+            __m128i blurred = _mm_packs_epi32(_mm_cvttps_epi32(sum), zero);
+            blurred = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_packus_epi16(blurred, zero), zero), zero);
+            int bytes;
+            memcpy(&bytes, task->plane + (size_t)y * width + x, 4);
+            __m128i center = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+            result = _mm_sub_epi32(_mm_add_epi32(center, center), blurred);
+        } else if (task->filter == FILTER_EDGES) {
+            result = _mm_cvttps_epi32(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(sum, sum), _mm_mul_ps(sumY, sumY))));
+        } else {
+            result = _mm_cvttps_epi32(sum);
+        }
+
+        __m128i words = _mm_packs_epi32(result, result);
+        int packed = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+        memcpy(out + x, &packed, 4);
+    }
+    return x;
+}
+#endif
+
+static void planarFilterRows(void *context, int startRow, int endRow) {
+    PlanarFilterTask *task = (PlanarFilterTask *)context;
+    const int half = task->kernelSize / 2;
+    // Pixels whose whole window is inside the row can use the vector code
+    const int innerStart = half < task->width ? half : task->width;
+    const int innerEnd = task->width - half > innerStart ? task->width - half : innerStart;
+
+    for (int y = startRow; y < endRow; y++) {
+        unsigned char *out = task->output + (size_t)y * task->width;
+        int x = 0;
+        for (; x < innerStart; x++)
+            out[x] = planarFilterPixel(task, x, y);
+#ifdef IMAGE_X86_SIMD
+        if (task->level == DISPATCH_AVX2)
+            x = planarFilterRowAVX2(task, y, x, innerEnd, out);
+        else if (task->level == DISPATCH_SSE2)
+            x = planarFilterRowSSE2(task, y, x, innerEnd, out);
+#endif
+        for (; x < task->width; x++)
+            out[x] = planarFilterPixel(task, x, y);
+    }
+}
+
+/** @brief Run one of the planar filters on every plane
+ *
+ * @return The filtered image, or NULL if the memory could not be allocated
+ */
+static PlanarImage *runPlanarFilter(const PlanarImage *img, FilterKind filter, const float *kernel, const float *kernelY, int kernelSize) {
+    PlanarImage *output = createPlanarImage(img->width, img->height, img->channels);
+    if (!output)
+        return NULL;
+
+    for (int c = 0; c < img->channels; c++) {
+        PlanarFilterTask task = {img->planes[c], output->planes[c], img->width, img->height, kernel, kernelY, kernelSize, filter, getDispatchLevel()};
+        parallelFor(img->height, 16, planarFilterRows, &task);
+    }
+    return output;
+}
+
+/** @brief Apply a kernel to a planar image, with the same result as applyKernel
+ *
+ * @param img The image that will be applied the kernel
+ * @param kernel The kernel that will be applied to the image
+ * @param kernelSize The size of one side of the kernel
+ *
+ * @return The image after the kernel has been applied
+ */
+PlanarImage *applyKernelPlanar(const PlanarImage *img, const float *kernel, const int kernelSize) {
+    return runPlanarFilter(img, FILTER_KERNEL, kernel, NULL, kernelSize);
+}
+
+/** @brief Apply a blur effect to a planar image, with the same result as applyBlur
+ *
+ * @param img The image that will be applied the blur
+ * @param blurLevel: The amount of blur applied (starting at 1)
+ *
+ * @return The blurred image
+ */
+PlanarImage *applyBlurPlanar(const PlanarImage *img, int blurLevel) {
+    if (blurLevel < 1) {
+        printf("Blur level must be at least 1\n");
+        return NULL;
+    }
+
+    const Kernel *kernel = acquireKernel(KERNEL_BOX, blurLevel);
+    if (!kernel)
+        return NULL;
+
+    PlanarImage *blurredImage = runPlanarFilter(img, FILTER_KERNEL, kernel->weights, NULL, kernel->size);
+
+    releaseKernel(kernel);
+    return blurredImage;
+}
+
+/** @brief Apply a sharpen effect to a planar image, with the same result as applySharpen
+ *
+ * @param img The image that will be applied the sharpen effect
+ * @param sharpenLevel The amount of sharpen applied
+ *
+ * @return The sharpened image
+ */
+PlanarImage *applySharpenPlanar(const PlanarImage *img, int sharpenLevel) {
+    if (sharpenLevel < 1) {
+        printf("Sharpen level must be at least 1\n");
+        return NULL;
+    }
+
+    const Kernel *kernel = acquireKernel(KERNEL_BOX, sharpenLevel);
+    if (!kernel)
+        return NULL;
+
+    PlanarImage *sharpenedImage = runPlanarFilter(img, FILTER_SHARPEN, kernel->weights, NULL, kernel->size);
+
+    releaseKernel(kernel);
+    return sharpenedImage;
+}
+
+/** @brief Apply an edge detection effect to a planar image, with the same result as applyEdgeDetection
+ *
+ * @param img The image that will be applied the edge detection effect
+ *
+ * @return The image after the edge detection has been applied
+ */
+PlanarImage *applyEdgeDetectionPlanar(const PlanarImage *img) {
+    const float KX[] = {
+        -1, 0, 1,
+        -2, 0, 2,
+        -1, 0, 1};
+
+    const float KY[] = {
+        -1, -2, -1,
+        0, 0, 0,
+        1, 2, 1};
+
+    return runPlanarFilter(img, FILTER_EDGES, KX, KY, 3);
+}
+
+/** @brief Weighted sum of rows: sum[i] = sum over the taps of weights[t] * rows[t][i]
+ */
+static void sumRowsScalar(float *sum, const float *const *rows, const float *weights, int taps, int count) {
+    for (int i = 0; i < count; i++) {
+        float value = 0.0f;
+        for (int t = 0; t < taps; t++)
+            value += rows[t][i] * weights[t];
+        sum[i] = value;
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("sse2"))) static void sumRowsSSE2(float *sum, const float *const *rows, const float *weights, int taps, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 value = _mm_setzero_ps();
+        for (int t = 0; t < taps; t++)
+            value = _mm_add_ps(value, _mm_mul_ps(_mm_loadu_ps(rows[t] + i), _mm_set1_ps(weights[t])));
+        _mm_storeu_ps(sum + i, value);
+    }
+    for (; i < count; i++) {
+        float value = 0.0f;
+        for (int t = 0; t < taps; t++)
+            value += rows[t][i] * weights[t];
+        sum[i] = value;
+    }
+}
+
+// Without FMA, so that the sums are the same as the scalar and SSE2 ones
+__attribute__((target("avx2"))) static void sumRowsAVX2(float *sum, const float *const *rows, const float *weights, int taps, int count) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 value = _mm256_setzero_ps();
+        for (int t = 0; t < taps; t++)
+            value = _mm256_add_ps(value, _mm256_mul_ps(_mm256_loadu_ps(rows[t] + i), _mm256_set1_ps(weights[t])));
+        _mm256_storeu_ps(sum + i, value);
+    }
+    for (; i < count; i++) {
+        float value = 0.0f;
+        for (int t = 0; t < taps; t++)
+            value += rows[t][i] * weights[t];
+        sum[i] = value;
+    }
+}
+#endif
+
+static void sumRows(float *sum, const float *const *rows, const float *weights, int taps, int count, DispatchLevel level) {
+#ifdef IMAGE_X86_SIMD
+    if (level == DISPATCH_AVX2) {
+        sumRowsAVX2(sum, rows, weights, taps, count);
+        return;
+    }
+    if (level == DISPATCH_SSE2) {
+        sumRowsSSE2(sum, rows, weights, taps, count);
+        return;
+    }
+#endif
+    (void)level;
+    sumRowsScalar(sum, rows, weights, taps, count);
+}
+
+#define CANNY_WEAK 1
+#define CANNY_STRONG 2
+#define CANNY_EDGE 255
+
+#define CANNY_GAUSSIAN_RADII 3.0f // The Gaussian kernel covers this many standard deviations on each side
+
+/** @brief Integer Sobel gradient of a row of a grayscale image, with the direction quantized to 4 sectors
+ *
+ * @param up The grayscale row above (the row itself on the first row, like applyEdgeDetection)
+ * @param center The grayscale row
+ * @param down The grayscale row below (the row itself on the last row)
+ * @param width The width of the image
+ * @param magnitude Where the squared magnitude of each pixel will be written
+ * @param direction Where the sector of each pixel will be written: 0 horizontal, 1 and 3 diagonal, 2 vertical
+ */
+static void sobelRow(const unsigned char *up, const unsigned char *center, const unsigned char *down, int width, int *magnitude, unsigned char *direction) {
+    for (int x = 0; x < width; x++) {
+        int left = x > 0 ? x - 1 : 0;
+        int right = x < width - 1 ? x + 1 : width - 1;
+        int gx = (up[right] + 2 * center[right] + down[right]) - (up[left] + 2 * center[left] + down[left]);
+        int gy = (down[left] + 2 * down[x] + down[right]) - (up[left] + 2 * up[x] + up[right]);
+        magnitude[x] = gx * gx + gy * gy;
+
+        // tan(22.5) ~ 13573 / 32768 and tan(67.5) ~ 79109 / 32768
+        int ax = abs(gx), ay = abs(gy);
+        if (ay * 32768 <= ax * 13573)
+            direction[x] = 0;
+        else if (ay * 32768 >= ax * 79109)
+            direction[x] = 2;
+        else
+            direction[x] = ((gx > 0) == (gy > 0)) ? 1 : 3;
+    }
+}
+
+// Data shared by the threads of the Canny detector
+typedef struct {
+    const Image *img;
+    unsigned char *edges;
+    const float *weights; // The Gaussian kernel, 2 * radius + 1 normalized weights
+    int radius;
+    int lowSquared;
+    int highSquared;
+    DispatchLevel level;
+    volatile int failed;
+} CannyTask;
+
+// Row buffers of one thread of the Canny detector. Each ring keeps its rows in slot row % size, with the row
+// each slot holds, which works because the rows are requested in increasing order and any request spans at most
+// size consecutive rows.
+typedef struct {
+    float *luma;            // Luma of the current row, padded by radius pixels on each side
+    float *blurred;         // The 2 * radius + 1 rows of the vertical window, blurred horizontally
+    int *blurredRows;       // The row each slot of blurred holds
+    float *sums;            // The vertical sums of the current smoothed row
+    const float **taps;     // The rows under the 2 * radius + 1 taps of the vertical kernel
+    const float **lumaTaps; // The shifted luma rows under the taps of the horizontal kernel
+    unsigned char *gray;    // 3 rows of the smoothed image, rounded like the other grayscale images
+    int grayRows[3];        // The row each slot of gray holds
+} CannyBuffers;
+
+/** @brief Get a row of the luma blurred horizontally, computing it if its slot holds another row
+ */
+static const float *cannyBlurredRow(const CannyTask *task, CannyBuffers *buffers, int y) {
+    const int width = task->img->width;
+    const int channels = task->img->channels;
+    const int radius = task->radius;
+    const int size = 2 * radius + 1;
+    float *row = buffers->blurred + (size_t)(y % size) * width;
+    if (buffers->blurredRows[y % size] == y)
+        return row;
+
+    // Pixels beyond the sides repeat the edge pixels
+    const unsigned char *pixels = task->img->pixels + (size_t)y * width * channels;
+    for (int x = -radius; x < width + radius; x++)
+        buffers->luma[x + radius] = pixelLuma(pixels + (size_t)clamp(x, 0, width - 1) * channels, channels);
+
+    for (int k = 0; k < size; k++)
+        buffers->lumaTaps[k] = buffers->luma + k;
+    sumRows(row, buffers->lumaTaps, task->weights, size, width, task->level);
+    buffers->blurredRows[y % size] = y;
+    return row;
+}
+
+/** @brief Get a row of the smoothed image, clamped to the image, computing it if its slot holds another row
+ */
+static const unsigned char *cannyGrayRow(const CannyTask *task, CannyBuffers *buffers, int y) {
+    const int width = task->img->width;
+    const int height = task->img->height;
+    y = clamp(y, 0, height - 1);
+    unsigned char *gray = buffers->gray + (size_t)(y % 3) * width;
+    if (buffers->grayRows[y % 3] == y)
+        return gray;
+
+    for (int k = -task->radius; k <= task->radius; k++)
+        buffers->taps[k + task->radius] = cannyBlurredRow(task, buffers, clamp(y + k, 0, height - 1));
+    sumRows(buffers->sums, buffers->taps, task->weights, 2 * task->radius + 1, width, task->level);
+    for (int x = 0; x < width; x++)
+        gray[x] = (unsigned char)clamp((int)(buffers->sums[x] + 0.5f), 0, 255);
+    buffers->grayRows[y % 3] = y;
+    return gray;
+}
+
+/** @brief Gradient of a row of the smoothed image into a slot of the gradient rings (none outside the image)
+ */
+static void cannyGradientRow(const CannyTask *task, CannyBuffers *buffers, int y, int *magnitude, unsigned char *direction) {
+    const int width = task->img->width;
+    if (y < 0 || y >= task->img->height) {
+        memset(magnitude, 0, width * sizeof(int));
+        return;
+    }
+    const unsigned char *up = cannyGrayRow(task, buffers, y - 1);
+    const unsigned char *center = cannyGrayRow(task, buffers, y);
+    const unsigned char *down = cannyGrayRow(task, buffers, y + 1);
+    sobelRow(up, center, down, width, magnitude, direction);
+}
+
+/** @brief Gaussian, Sobel, non-maximum suppression and double threshold of a band of rows, in one pass
+ *
+ * The luma is blurred horizontally into a ring of rows, vertically into a ring of three smoothed rows, and the
+ * gradient of three rows is kept in a third ring, so the band and its halo are read once and nothing larger than
+ * a few rows is written before the marks. Pixels are marked as strong, weak or not an edge.
+ */
+static void cannyRows(void *context, int startRow, int endRow) {
+    CannyTask *task = (CannyTask *)context;
+    const int width = task->img->width;
+    const int size = 2 * task->radius + 1;
+
+    CannyBuffers buffers;
+    buffers.luma = (float *)malloc(((size_t)width * (size + 2) + size) * sizeof(float));
+    buffers.blurredRows = (int *)malloc(size * sizeof(int));
+    buffers.taps = (const float **)malloc(2 * size * sizeof(float *));
+    buffers.lumaTaps = buffers.taps + size;
+    buffers.gray = (unsigned char *)malloc((size_t)width * 3);
+    int *magnitudes = (int *)malloc((size_t)width * 3 * sizeof(int));
+    unsigned char *directions = (unsigned char *)malloc((size_t)width * 3);
+    if (!buffers.luma || !buffers.blurredRows || !buffers.taps || !buffers.gray || !magnitudes || !directions) {
+        free(buffers.luma);
+        free(buffers.blurredRows);
+        free((void *)buffers.taps);
+        free(buffers.gray);
+        free(magnitudes);
+        free(directions);
+        task->failed = 1;
+        return;
+    }
+    buffers.blurred = buffers.luma + width + size;
+    buffers.sums = buffers.blurred + (size_t)width * size;
+    for (int i = 0; i < size; i++)
+        buffers.blurredRows[i] = -1;
+    for (int i = 0; i < 3; i++)
+        buffers.grayRows[i] = -1;
+
+    // Ring slot of row y is (y + 3) % 3; rows outside the image have no gradient
+    for (int y = startRow - 1; y <= startRow; y++) {
+        int slot = (y + 3) % 3;
+        cannyGradientRow(task, &buffers, y, magnitudes + slot * width, directions + slot * width);
+    }
+
+    for (int y = startRow; y < endRow; y++) {
+        int nextSlot = (y + 4) % 3;
+        cannyGradientRow(task, &buffers, y + 1, magnitudes + nextSlot * width, directions + nextSlot * width);
+
+        const int *above = magnitudes + ((y + 2) % 3) * width;
+        const int *current = magnitudes + (y % 3) * width;
+        const int *below = magnitudes + nextSlot * width;
+        const unsigned char *direction = directions + (y % 3) * width;
+        unsigned char *out = task->edges + (size_t)y * width;
+
+        for (int x = 0; x < width; x++) {
+            int magnitude = current[x];
+            if (magnitude < task->lowSquared) {
+                out[x] = 0;
+                continue;
+            }
+
+            // Neighbours along the gradient (outside the image count as 0)
+            int left = x > 0 ? x - 1 : -1;
+            int right = x < width - 1 ? x + 1 : -1;
+            int before, after;
+            switch (direction[x]) {
+            case 0:
+                before = left >= 0 ? current[left] : 0;
+                after = right >= 0 ? current[right] : 0;
+                break;
+            case 1:
+                before = left >= 0 ? above[left] : 0;
+                after = right >= 0 ? below[right] : 0;
+                break;
+            case 2:
+                before = above[x];
+                after = below[x];
+                break;
+            default:
+                before = right >= 0 ? above[right] : 0;
+                after = left >= 0 ? below[left] : 0;
+                break;
+            }
+
+            // Ties keep only one of the two pixels, so plateaus give edges one pixel thick
+            if (magnitude < before || magnitude <= after)
+                out[x] = 0;
+            else
+                out[x] = magnitude >= task->highSquared ? CANNY_STRONG : CANNY_WEAK;
+        }
+    }
+
+    free(buffers.luma);
+    free(buffers.blurredRows);
+    free((void *)buffers.taps);
+    free(buffers.gray);
+    free(magnitudes);
+    free(directions);
+}
+
+/** @brief Keep the weak edges connected to a strong edge, using a stack of pixels to visit
+ *
+ * @param edges The marked pixels, which become 255 for edges and 0 otherwise
+ * @param width The width of the image
+ * @param height The height of the image
+ *
+ * @return Returns true if the memory for the stack could be allocated
+ */
+static bool cannyHysteresis(unsigned char *edges, int width, int height) {
+    size_t capacity = 4096;
+    size_t top = 0;
+    int *stack = (int *)malloc(capacity * sizeof(int));
+    if (!stack)
+        return false;
+
+    int count = width * height;
+    for (int i = 0; i < count; i++) {
+        if (edges[i] != CANNY_STRONG)
+            continue;
+
+        edges[i] = CANNY_EDGE;
+        stack[top++] = i;
+        while (top > 0) {
+            int pixel = stack[--top];
+            int x = pixel % width, y = pixel / width;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    int nx = x + dx, ny = y + dy;
+                    if (nx < 0 || nx >= width || ny < 0 || ny >= height)
+                        continue;
+                    int neighbour = ny * width + nx;
+                    if (edges[neighbour] != CANNY_WEAK && edges[neighbour] != CANNY_STRONG)
+                        continue;
+
+                    edges[neighbour] = CANNY_EDGE;
+                    if (top == capacity) {
+                        int *grown = (int *)realloc(stack, capacity * 2 * sizeof(int));
+                        if (!grown) {
+                            free(stack);
+                            return false;
+                        }
+                        stack = grown;
+                        capacity *= 2;
+                    }
+                    stack[top++] = neighbour;
+                }
+            }
+        }
+    }
+    free(stack);
+
+    // Weak edges that were not reached are dropped
+    for (int i = 0; i < count; i++) {
+        if (edges[i] != CANNY_EDGE)
+            edges[i] = 0;
+    }
+    return true;
+}
+
+/** @brief Detect thin edges with the Canny detector
+ *
+ * The Gaussian smoothing of the luma, the Sobel gradient, non-maximum suppression and double threshold run
+ * fused in one pass over row bands, then hysteresis keeps the weak edges connected to strong ones.
+ *
+ * @param img The image
+ * @param sigma The standard deviation of the Gaussian smoothing (at least 0.5)
+ * @param lowThreshold Gradient magnitude of weak edges (same scale as applyEdgeDetection)
+ * @param highThreshold Gradient magnitude of strong edges
+ *
+ * @return A one channel image with 255 on the edges and 0 elsewhere
+ */
+Image *applyCannyEdgeDetection(const Image *img, float sigma, int lowThreshold, int highThreshold) {
+    if (!requirePixelU8(img, "applyCannyEdgeDetection"))
+        return NULL;
+    if (sigma < 0.5f || lowThreshold < 1 || highThreshold < lowThreshold) {
+        printf("Canny needs sigma of at least 0.5 and 1 <= low threshold <= high threshold\n");
+        return NULL;
+    }
+
+    const int radius = (int)ceilf(CANNY_GAUSSIAN_RADII * sigma);
+    float *weights = (float *)malloc((2 * radius + 1) * sizeof(float));
+    Image *output = createImage(img->width, img->height, 1);
+    if (!weights || !output) {
+        printf("Error allocating memory for Canny\n");
+        free(weights);
+        if (output)
+            freeImage(output);
+        return NULL;
+    }
+
+    float total = 0.0f;
+    for (int k = -radius; k <= radius; k++) {
+        weights[k + radius] = expf(-(float)(k * k) / (2.0f * sigma * sigma));
+        total += weights[k + radius];
+    }
+    for (int k = 0; k < 2 * radius + 1; k++)
+        weights[k] /= total;
+
+    CannyTask task = {img, output->pixels, weights, radius, lowThreshold * lowThreshold, highThreshold * highThreshold,
+                      getDispatchLevel(), 0};
+    parallelFor(img->height, 32, cannyRows, &task);
+    free(weights);
+
+    if (task.failed || !cannyHysteresis(output->pixels, img->width, img->height)) {
+        printf("Error allocating memory for Canny\n");
+        freeImage(output);
+        return NULL;
+    }
+    return output;
+}
+
+// Statistics of the difference between two images, over every channel
+typedef struct {
+    int maxAbsDiff;
+    double meanAbsError;
+    double mse;
+    double psnr; // INFINITY when the images are identical
+    long long pixelsBeyondTolerance;
+} ImageDiff;
+
+// Sums of the difference of some rows of two images
+typedef struct {
+    unsigned long long sumAbs;
+    unsigned long long sumSquares;
+    long long beyondTolerance;
+    int maxAbsDiff;
+} DiffSums;
+
+/** @brief Accumulate the difference of a run of pixels, one value at a time
+ *
+ * @param a The pixels of the first image
+ * @param b The pixels of the second image
+ * @param pixelCount The number of pixels
+ * @param channels The number of channels per pixel
+ * @param tolerance A pixel is counted when any channel differs by more than this
+ * @param sums Where the sums are accumulated
+ */
+static void diffPixelsScalar(const unsigned char *a, const unsigned char *b, int pixelCount, int channels, int tolerance, DiffSums *sums) {
+    for (int i = 0; i < pixelCount; i++) {
+        bool beyond = false;
+        for (int c = 0; c < channels; c++) {
+            int diff = abs(a[i * channels + c] - b[i * channels + c]);
+            sums->sumAbs += diff;
+            sums->sumSquares += diff * diff;
+            if (diff > sums->maxAbsDiff)
+                sums->maxAbsDiff = diff;
+            if (diff > tolerance)
+                beyond = true;
+        }
+        if (beyond)
+            sums->beyondTolerance++;
+    }
+}
+
+/** @brief Check if any value of a run differs by more than the tolerance
+ *
+ * @return Returns true if a value is beyond the tolerance
+ */
+static bool anyBeyondScalar(const unsigned char *a, const unsigned char *b, size_t count, int tolerance) {
+    for (size_t i = 0; i < count; i++) {
+        if (abs(a[i] - b[i]) > tolerance)
+            return true;
+    }
+    return false;
+}
+
+#ifdef IMAGE_X86_SIMD
+/** @brief SSE2 version of diffPixelsScalar, 16 pixels (channels vectors) per step
+ *
+ * The absolute difference is max(a - b, b - a) with unsigned saturation, the sum of it comes from
+ * _mm_sad_epu8 and the sum of squares from _mm_madd_epi16 on the differences widened to 16 bits.
+ */
+__attribute__((target("sse2"))) static void diffPixelsSSE2(const unsigned char *a, const unsigned char *b, int pixelCount, int channels, int tolerance, DiffSums *sums) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i toleranceVector = _mm_set1_epi8((char)tolerance);
+    __m128i sumAbs = zero;
+    __m128i sumSquares = zero;
+    __m128i maxDiff = zero;
+    int i = 0;
+
+    for (; i + 16 <= pixelCount; i += 16) {
+        const unsigned char *blockA = a + i * channels;
+        const unsigned char *blockB = b + i * channels;
+        int beyondMask = 0;
+
+        // The 32 bit square sums are widened to 64 bits on every step so they can not overflow
+        __m128i blockSquares = zero;
+        for (int v = 0; v < channels; v++) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(blockA + v * 16));
+            __m128i y = _mm_loadu_si128((const __m128i *)(blockB + v * 16));
+            __m128i diff = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+            __m128i low = _mm_unpacklo_epi8(diff, zero);
+            __m128i high = _mm_unpackhi_epi8(diff, zero);
+
+            sumAbs = _mm_add_epi64(sumAbs, _mm_sad_epu8(diff, zero));
+            blockSquares = _mm_add_epi32(blockSquares, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
+            maxDiff = _mm_max_epu8(maxDiff, diff);
+            beyondMask |= 0xFFFF ^ _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(diff, toleranceVector), zero));
+        }
+        sumSquares = _mm_add_epi64(sumSquares, _mm_unpacklo_epi32(blockSquares, zero));
+        sumSquares = _mm_add_epi64(sumSquares, _mm_unpackhi_epi32(blockSquares, zero));
+
+        // Only blocks with a value beyond the tolerance need to count pixels one by one
+        if (beyondMask) {
+            for (int p = 0; p < 16; p++) {
+                for (int c = 0; c < channels; c++) {
+                    if (abs(blockA[p * channels + c] - blockB[p * channels + c]) > tolerance) {
+                        sums->beyondTolerance++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    unsigned long long lanes[2];
+    unsigned char maxLanes[16];
+    _mm_storeu_si128((__m128i *)lanes, sumAbs);
+    sums->sumAbs += lanes[0] + lanes[1];
+    _mm_storeu_si128((__m128i *)lanes, sumSquares);
+    sums->sumSquares += lanes[0] + lanes[1];
+    _mm_storeu_si128((__m128i *)maxLanes, maxDiff);
+    for (int l = 0; l < 16; l++) {
+        if (maxLanes[l] > sums->maxAbsDiff)
+            sums->maxAbsDiff = maxLanes[l];
+    }
+
+    diffPixelsScalar(a + i * channels, b + i * channels, pixelCount - i, channels, tolerance, sums);
+}
+
+/** @brief AVX2 version of diffPixelsScalar, 32 pixels (channels vectors) per step
+ */
+__attribute__((target("avx2"))) static void diffPixelsAVX2(const unsigned char *a, const unsigned char *b, int pixelCount, int channels, int tolerance, DiffSums *sums) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i toleranceVector = _mm256_set1_epi8((char)tolerance);
+    __m256i sumAbs = zero;
+    __m256i sumSquares = zero;
+    __m256i maxDiff = zero;
+    int i = 0;
+
+    for (; i + 32 <= pixelCount; i += 32) {
+        const unsigned char *blockA = a + i * channels;
+        const unsigned char *blockB = b + i * channels;
+        unsigned int beyondMask = 0;
+
+        __m256i blockSquares = zero;
+        for (int v = 0; v < channels; v++) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(blockA + v * 32));
+            __m256i y = _mm256_loadu_si256((const __m256i *)(blockB + v * 32));
+            __m256i diff = _mm256_or_si256(_mm256_subs_epu8(x, y), _mm256_subs_epu8(y, x));
+            __m256i low = _mm256_unpacklo_epi8(diff, zero);
+            __m256i high = _mm256_unpackhi_epi8(diff, zero);
+
+            sumAbs = _mm256_add_epi64(sumAbs, _mm256_sad_epu8(diff, zero));
+            blockSquares = _mm256_add_epi32(blockSquares, _mm256_add_epi32(_mm256_madd_epi16(low, low), _mm256_madd_epi16(high, high)));
+            maxDiff = _mm256_max_epu8(maxDiff, diff);
+            beyondMask |= ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_subs_epu8(diff, toleranceVector), zero));
+        }
+        sumSquares = _mm256_add_epi64(sumSquares, _mm256_unpacklo_epi32(blockSquares, zero));
+        sumSquares = _mm256_add_epi64(sumSquares, _mm256_unpackhi_epi32(blockSquares, zero));
+
+        if (beyondMask) {
+            for (int p = 0; p < 32; p++) {
+                for (int c = 0; c < channels; c++) {
+                    if (abs(blockA[p * channels + c] - blockB[p * channels + c]) > tolerance) {
+                        sums->beyondTolerance++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    unsigned long long lanes[4];
+    unsigned char maxLanes[32];
+    _mm256_storeu_si256((__m256i *)lanes, sumAbs);
+    sums->sumAbs += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_si256((__m256i *)lanes, sumSquares);
+    sums->sumSquares += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_si256((__m256i *)maxLanes, maxDiff);
+    for (int l = 0; l < 32; l++) {
+        if (maxLanes[l] > sums->maxAbsDiff)
+            sums->maxAbsDiff = maxLanes[l];
+    }
+
+    diffPixelsScalar(a + i * channels, b + i * channels, pixelCount - i, channels, tolerance, sums);
+}
+
+__attribute__((target("sse2"))) static bool anyBeyondSSE2(const unsigned char *a, const unsigned char *b, size_t count, int tolerance) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i toleranceVector = _mm_set1_epi8((char)tolerance);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(diff, toleranceVector), zero)) != 0xFFFF)
+            return true;
+    }
+    return anyBeyondScalar(a + i, b + i, count - i, tolerance);
+}
+
+__attribute__((target("avx2"))) static bool anyBeyondAVX2(const unsigned char *a, const unsigned char *b, size_t count, int tolerance) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i toleranceVector = _mm256_set1_epi8((char)tolerance);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i diff = _mm256_or_si256(_mm256_subs_epu8(x, y), _mm256_subs_epu8(y, x));
+        if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_subs_epu8(diff, toleranceVector), zero)) != 0xFFFFFFFFu)
+            return true;
+    }
+    return anyBeyondScalar(a + i, b + i, count - i, tolerance);
+}
+#endif
+
+// Data shared by the threads of a comparison
+typedef struct {
+    const Image *img1;
+    const Image *img2;
+    int tolerance;
+    DispatchLevel level;
+    DiffSums *rowSums;     // One entry per row, NULL for the early exit mode
+    volatile int mismatch; // Set by the early exit mode as soon as a value is beyond the tolerance
+} CompareTask;
+
+static void compareRows(void *context, int startRow, int endRow) {
+    CompareTask *task = (CompareTask *)context;
+    int width = task->img1->width;
+    int channels = task->img1->channels;
+    size_t rowBytes = (size_t)width * channels;
+
+    for (int y = startRow; y < endRow; y++) {
+        const unsigned char *a = task->img1->pixels + y * rowBytes;
+        const unsigned char *b = task->img2->pixels + y * rowBytes;
+
+        if (!task->rowSums) {
+            // Early exit mode, stop at the first row with a difference (in any thread)
+            if (task->mismatch)
+                return;
+            bool beyond;
+#ifdef IMAGE_X86_SIMD
+            if (task->level == DISPATCH_AVX2)
+                beyond = anyBeyondAVX2(a, b, rowBytes, task->tolerance);
+            else if (task->level == DISPATCH_SSE2)
+                beyond = anyBeyondSSE2(a, b, rowBytes, task->tolerance);
+            else
+#endif
+                beyond = anyBeyondScalar(a, b, rowBytes, task->tolerance);
+            if (beyond) {
+                task->mismatch = 1;
+                return;
+            }
+            continue;
+        }
+
+        DiffSums *sums = &task->rowSums[y];
+        memset(sums, 0, sizeof(DiffSums));
+#ifdef IMAGE_X86_SIMD
+        if (task->level == DISPATCH_AVX2) {
+            diffPixelsAVX2(a, b, width, channels, task->tolerance, sums);
+            continue;
+        }
+        if (task->level == DISPATCH_SSE2) {
+            diffPixelsSSE2(a, b, width, channels, task->tolerance, sums);
+            continue;
+        }
+#endif
+        diffPixelsScalar(a, b, width, channels, task->tolerance, sums);
+    }
+}
+
+/** @brief Check that two images can be compared
+ *
+ * @return Returns true if the images have the same dimensions and number of channels
+ */
+static bool checkComparable(const Image *img1, const Image *img2) {
+    if (img1->width != img2->width || img1->height != img2->height || img1->channels != img2->channels) {
+        printf("Images have different dimensions. Cannot compare.\n");
+        return false;
+    }
+    return requirePixelU8(img1, "Image comparison") && requirePixelU8(img2, "Image comparison");
+}
+
+/** @brief Compare two images and measure how different they are, in a single pass over all channels
+ *
+ * @param img1 The first image to compare
+ * @param img2 The second image to compare
+ * @param tolerance The largest difference of a channel that still counts as the same
+ * @param diff Where the statistics of the difference will be written (can be NULL)
+ *
+ * @return Returns true if no pixel is beyond the tolerance, and false otherwise (or if the images can not be compared)
+ */
+bool compareImagesDetailed(const Image *img1, const Image *img2, int tolerance, ImageDiff *diff) {
+    if (!checkComparable(img1, img2))
+        return false;
+
+    CompareTask task = {img1, img2, clamp(tolerance, 0, 255), getDispatchLevel(), NULL, 0};
+    task.rowSums = (DiffSums *)malloc(img1->height * sizeof(DiffSums));
+    if (!task.rowSums) {
+        printf("Error allocating memory for comparison\n");
+        return false;
+    }
+
+    parallelFor(img1->height, 16, compareRows, &task);
+
+    // Add up the rows
+    DiffSums total = {0, 0, 0, 0};
+    for (int y = 0; y < img1->height; y++) {
+        total.sumAbs += task.rowSums[y].sumAbs;
+        total.sumSquares += task.rowSums[y].sumSquares;
+        total.beyondTolerance += task.rowSums[y].beyondTolerance;
+        if (task.rowSums[y].maxAbsDiff > total.maxAbsDiff)
+            total.maxAbsDiff = task.rowSums[y].maxAbsDiff;
+    }
+    free(task.rowSums);
+
+    if (diff) {
+        double valueCount = (double)img1->width * img1->height * img1->channels;
+        diff->maxAbsDiff = total.maxAbsDiff;
+        diff->meanAbsError = valueCount > 0 ? total.sumAbs / valueCount : 0.0;
+        diff->mse = valueCount > 0 ? total.sumSquares / valueCount : 0.0;
+        diff->psnr = diff->mse > 0 ? 10.0 * log10(255.0 * 255.0 / diff->mse) : INFINITY;
+        diff->pixelsBeyondTolerance = total.beyondTolerance;
+    }
+
+    return total.beyondTolerance == 0;
+}
+
+/** @brief Check if every channel of two images is within a tolerance, stopping at the first difference
+ *
+ * @param img1 The first image to compare
+ * @param img2 The second image to compare
+ * @param tolerance The largest difference of a channel that still counts as the same (0 for equality)
+ *
+ * @return Returns true if the images are the same within the tolerance, and false otherwise
+ */
+bool compareImagesTolerance(const Image *img1, const Image *img2, int tolerance) {
+    if (!checkComparable(img1, img2))
+        return false;
+
+    CompareTask task = {img1, img2, clamp(tolerance, 0, 255), getDispatchLevel(), NULL, 0};
+    parallelFor(img1->height, 16, compareRows, &task);
+
+    return !task.mismatch;
+}
+
+/** @brief Compare two images to determine if they are the same (within a 1 degree of tolerance)
+ *
+ * @param img1 The first image to compare
+ * @param img2 The second image to compare
+ *
+ * @return Returns true if the images are the same, and false otherwise
+ */
+bool compareImages(const Image *img1, const Image *img2) {
+    return compareImagesTolerance(img1, img2, 1);
+}
+
+bool compareImagesFree(Image *img1, Image *img2) {
+    bool result = compareImages(img1, img2);
+    freeImage(img1);
+    freeImage(img2);
+    return result;
+}
+
+#define SSIM_RADIUS 3 // SSIM windows are (2 * SSIM_RADIUS + 1) pixels wide
+#define SSIM_C1 (0.01f * 255 * 0.01f * 255)
+#define SSIM_C2 (0.03f * 255 * 0.03f * 255)
+#define MS_SSIM_SCALES 5
+
+// Data shared by the threads of an SSIM computation
+typedef struct {
+    const Image *img1;
+    const Image *img2;
+    double *rowSsim; // Sum of the SSIM of the windows of each output row
+    double *rowCs;   // Sum of the contrast-structure term of the windows of each output row
+    DispatchLevel level;
+    volatile int failed;
+} SsimTask;
+
+/** @brief SSIM and contrast-structure term of the windows from start to end, from the sums over each window
+ *
+ * @param windows The sums of x, y, x * x, y * y and x * y of the windows, as 5 arrays of stride values
+ */
+static void ssimWindowsScalar(const float *windows, int stride, int start, int end, float area, float *ssim, float *cs) {
+    for (int i = start; i < end; i++) {
+        float meanX = windows[i] / area;
+        float meanY = windows[stride + i] / area;
+        float varianceX = windows[2 * stride + i] / area - meanX * meanX;
+        float varianceY = windows[3 * stride + i] / area - meanY * meanY;
+        float covariance = windows[4 * stride + i] / area - meanX * meanY;
+        cs[i] = (2.0f * covariance + SSIM_C2) / (varianceX + varianceY + SSIM_C2);
+        ssim[i] = (2.0f * meanX * meanY + SSIM_C1) / (meanX * meanX + meanY * meanY + SSIM_C1) * cs[i];
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+// The same operations in the same order as the scalar version, so every dispatch level gives the same result
+__attribute__((target("sse2"))) static void ssimWindowsSSE2(const float *windows, int stride, int count, float area, float *ssim, float *cs) {
+    const __m128 areas = _mm_set1_ps(area), two = _mm_set1_ps(2.0f);
+    const __m128 c1 = _mm_set1_ps(SSIM_C1), c2 = _mm_set1_ps(SSIM_C2);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 meanX = _mm_div_ps(_mm_loadu_ps(windows + i), areas);
+        __m128 meanY = _mm_div_ps(_mm_loadu_ps(windows + stride + i), areas);
+        __m128 varianceX = _mm_sub_ps(_mm_div_ps(_mm_loadu_ps(windows + 2 * stride + i), areas), _mm_mul_ps(meanX, meanX));
+        __m128 varianceY = _mm_sub_ps(_mm_div_ps(_mm_loadu_ps(windows + 3 * stride + i), areas), _mm_mul_ps(meanY, meanY));
+        __m128 covariance = _mm_sub_ps(_mm_div_ps(_mm_loadu_ps(windows + 4 * stride + i), areas), _mm_mul_ps(meanX, meanY));
+        __m128 contrast = _mm_div_ps(_mm_add_ps(_mm_mul_ps(two, covariance), c2), _mm_add_ps(_mm_add_ps(varianceX, varianceY), c2));
+        __m128 luminance = _mm_div_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(two, meanX), meanY), c1),
+                                      _mm_add_ps(_mm_add_ps(_mm_mul_ps(meanX, meanX), _mm_mul_ps(meanY, meanY)), c1));
+        _mm_storeu_ps(cs + i, contrast);
+        _mm_storeu_ps(ssim + i, _mm_mul_ps(luminance, contrast));
+    }
+    ssimWindowsScalar(windows, stride, i, count, area, ssim, cs);
+}
+
+__attribute__((target("avx2"))) static void ssimWindowsAVX2(const float *windows, int stride, int count, float area, float *ssim, float *cs) {
+    const __m256 areas = _mm256_set1_ps(area), two = _mm256_set1_ps(2.0f);
+    const __m256 c1 = _mm256_set1_ps(SSIM_C1), c2 = _mm256_set1_ps(SSIM_C2);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 meanX = _mm256_div_ps(_mm256_loadu_ps(windows + i), areas);
+        __m256 meanY = _mm256_div_ps(_mm256_loadu_ps(windows + stride + i), areas);
+        __m256 varianceX = _mm256_sub_ps(_mm256_div_ps(_mm256_loadu_ps(windows + 2 * stride + i), areas), _mm256_mul_ps(meanX, meanX));
+        __m256 varianceY = _mm256_sub_ps(_mm256_div_ps(_mm256_loadu_ps(windows + 3 * stride + i), areas), _mm256_mul_ps(meanY, meanY));
+        __m256 covariance = _mm256_sub_ps(_mm256_div_ps(_mm256_loadu_ps(windows + 4 * stride + i), areas), _mm256_mul_ps(meanX, meanY));
+        __m256 contrast = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(two, covariance), c2),
+                                        _mm256_add_ps(_mm256_add_ps(varianceX, varianceY), c2));
+        __m256 luminance = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(two, meanX), meanY), c1),
+                                         _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(meanX, meanX), _mm256_mul_ps(meanY, meanY)), c1));
+        _mm256_storeu_ps(cs + i, contrast);
+        _mm256_storeu_ps(ssim + i, _mm256_mul_ps(luminance, contrast));
+    }
+    ssimWindowsScalar(windows, stride, i, count, area, ssim, cs);
+}
+#endif
+
+static void ssimWindows(const float *windows, int stride, int count, float area, float *ssim, float *cs, DispatchLevel level) {
+#ifdef IMAGE_X86_SIMD
+    if (level == DISPATCH_AVX2) {
+        ssimWindowsAVX2(windows, stride, count, area, ssim, cs);
+        return;
+    }
+    if (level == DISPATCH_SSE2) {
+        ssimWindowsSSE2(windows, stride, count, area, ssim, cs);
+        return;
+    }
+#endif
+    (void)level;
+    ssimWindowsScalar(windows, stride, 0, count, area, ssim, cs);
+}
+
+/** @brief Compute the SSIM of the windows of a band of output rows
+ *
+ * The sums of every window come from running sums: per column sums of the window rows are updated
+ * when the window moves down one row, and a running sum over those columns gives each window.
+ */
+static void ssimRows(void *context, int startRow, int endRow) {
+    SsimTask *task = (SsimTask *)context;
+    const int width = task->img1->width;
+    const int channels = task->img1->channels;
+    const int colorChannels = colorChannelCount(task->img1);
+    const int window = 2 * SSIM_RADIUS + 1;
+    const int outWidth = width - 2 * SSIM_RADIUS;
+    const int rowValues = width * channels;
+    const float area = (float)(window * window);
+
+    // Column sums (for each value of a row) and window sums (for each output pixel of a channel)
+    int *columns = (int *)calloc((size_t)rowValues * 5, sizeof(int));
+    float *windows = (float *)malloc((size_t)outWidth * 7 * sizeof(float));
+    if (!columns || !windows) {
+        free(columns);
+        free(windows);
+        task->failed = 1;
+        return;
+    }
+    int *restrict sumX = columns;
+    int *restrict sumY = columns + rowValues;
+    int *restrict sumXX = columns + 2 * rowValues;
+    int *restrict sumYY = columns + 3 * rowValues;
+    int *restrict sumXY = columns + 4 * rowValues;
+    float *windowX = windows;
+    float *windowY = windows + outWidth;
+    float *windowXX = windows + 2 * outWidth;
+    float *windowYY = windows + 3 * outWidth;
+    float *windowXY = windows + 4 * outWidth;
+    float *windowSsim = windows + 5 * outWidth;
+    float *windowCs = windows + 6 * outWidth;
+
+    // Rows of the window of the first output row (output row y covers image rows y to y + window - 1)
+    for (int y = startRow; y < startRow + window - 1; y++) {
+        const unsigned char *a = task->img1->pixels + (size_t)y * rowValues;
+        const unsigned char *b = task->img2->pixels + (size_t)y * rowValues;
+        for (int i = 0; i < rowValues; i++) {
+            sumX[i] += a[i];
+            sumY[i] += b[i];
+            sumXX[i] += a[i] * a[i];
+            sumYY[i] += b[i] * b[i];
+            sumXY[i] += a[i] * b[i];
+        }
+    }
+
+    for (int y = startRow; y < endRow; y++) {
+        // Add the row that enters the window
+        const unsigned char *a = task->img1->pixels + (size_t)(y + window - 1) * rowValues;
+        const unsigned char *b = task->img2->pixels + (size_t)(y + window - 1) * rowValues;
+        for (int i = 0; i < rowValues; i++) {
+            sumX[i] += a[i];
+            sumY[i] += b[i];
+            sumXX[i] += a[i] * a[i];
+            sumYY[i] += b[i] * b[i];
+            sumXY[i] += a[i] * b[i];
+        }
+
+        double ssimTotal = 0.0;
+        double csTotal = 0.0;
+        for (int c = 0; c < colorChannels; c++) {
+            // Running sums over the columns of the window
+            int x = 0, y2 = 0, xx = 0, yy = 0, xy = 0;
+            for (int col = 0; col < window - 1; col++) {
+                int i = col * channels + c;
+                x += sumX[i], y2 += sumY[i], xx += sumXX[i], yy += sumYY[i], xy += sumXY[i];
+            }
+            for (int outX = 0; outX < outWidth; outX++) {
+                int in = (outX + window - 1) * channels + c;
+                int out = outX * channels + c;
+                x += sumX[in], y2 += sumY[in], xx += sumXX[in], yy += sumYY[in], xy += sumXY[in];
+                windowX[outX] = (float)x;
+                windowY[outX] = (float)y2;
+                windowXX[outX] = (float)xx;
+                windowYY[outX] = (float)yy;
+                windowXY[outX] = (float)xy;
+                x -= sumX[out], y2 -= sumY[out], xx -= sumXX[out], yy -= sumYY[out], xy -= sumXY[out];
+            }
+
+            // SSIM of each window, then the sums in order (the same on every dispatch level)
+            ssimWindows(windows, outWidth, outWidth, area, windowSsim, windowCs, task->level);
+            float ssimSum = 0.0f;
+            float csSum = 0.0f;
+            for (int outX = 0; outX < outWidth; outX++) {
+                ssimSum += windowSsim[outX];
+                csSum += windowCs[outX];
+            }
+            ssimTotal += ssimSum;
+            csTotal += csSum;
+        }
+        task->rowSsim[y] = ssimTotal;
+        task->rowCs[y] = csTotal;
+
+        // Remove the row that leaves the window
+        a = task->img1->pixels + (size_t)y * rowValues;
+        b = task->img2->pixels + (size_t)y * rowValues;
+        for (int i = 0; i < rowValues; i++) {
+            sumX[i] -= a[i];
+            sumY[i] -= b[i];
+            sumXX[i] -= a[i] * a[i];
+            sumYY[i] -= b[i] * b[i];
+            sumXY[i] -= a[i] * b[i];
+        }
+    }
+
+    free(columns);
+    free(windows);
+}
+
+/** @brief Compute the mean SSIM and the mean contrast-structure term of two images
+ *
+ * @param img1 The first image
+ * @param img2 The second image
+ * @param ssim Where the mean SSIM will be written
+ * @param cs Where the mean contrast-structure term will be written (can be NULL)
+ *
+ * @return Returns true if the SSIM could be computed
+ */
+static bool ssimWithCs(const Image *img1, const Image *img2, double *ssim, double *cs) {
+    int outWidth = img1->width - 2 * SSIM_RADIUS;
+    int outHeight = img1->height - 2 * SSIM_RADIUS;
+
+    SsimTask task = {img1, img2, NULL, NULL, getDispatchLevel(), 0};
+    task.rowSsim = (double *)malloc(outHeight * sizeof(double));
+    task.rowCs = (double *)malloc(outHeight * sizeof(double));
+    if (!task.rowSsim || !task.rowCs) {
+        free(task.rowSsim);
+        free(task.rowCs);
+        printf("Error allocating memory for SSIM\n");
+        return false;
+    }
+
+    parallelFor(outHeight, 32, ssimRows, &task);
+
+    double ssimTotal = 0.0;
+    double csTotal = 0.0;
+    for (int y = 0; y < outHeight; y++) {
+        ssimTotal += task.rowSsim[y];
+        csTotal += task.rowCs[y];
+    }
+    free(task.rowSsim);
+    free(task.rowCs);
+
+    if (task.failed) {
+        printf("Error allocating memory for SSIM\n");
+        return false;
+    }
+
+    double windowCount = (double)outWidth * outHeight * colorChannelCount(img1);
+    *ssim = ssimTotal / windowCount;
+    if (cs)
+        *cs = csTotal / windowCount;
+    return true;
+}
+
+/** @brief Check that the SSIM of two images can be computed
+ *
+ * @return Returns true if the images have the same dimensions and are larger than a window
+ */
+static bool checkSsimInput(const Image *img1, const Image *img2) {
+    if (img1->width != img2->width || img1->height != img2->height || img1->channels != img2->channels) {
+        printf("Images have different dimensions. Cannot compare.\n");
+        return false;
+    }
+    if (!requirePixelU8(img1, "SSIM") || !requirePixelU8(img2, "SSIM"))
+        return false;
+    if (img1->width <= 2 * SSIM_RADIUS || img1->height <= 2 * SSIM_RADIUS) {
+        printf("Images must be larger than %d x %d for SSIM\n", 2 * SSIM_RADIUS + 1, 2 * SSIM_RADIUS + 1);
+        return false;
+    }
+    return true;
+}
+
+/** @brief Compute the structural similarity (SSIM) of two images, averaged over the color channels
+ *
+ * @param img1 The first image to compare
+ * @param img2 The second image to compare
+ *
+ * @return The SSIM (1 for identical images), or -1 if it could not be computed
+ */
+double computeSSIM(const Image *img1, const Image *img2) {
+    double ssim;
+    if (!checkSsimInput(img1, img2) || !ssimWithCs(img1, img2, &ssim, NULL))
+        return -1.0;
+
+    return ssim;
+}
+
+/** @brief Reduce an image to half of its size, averaging blocks of 2x2 pixels
+ *
+ * @param img The image that will be reduced
+ *
+ * @return The reduced image
+ */
+static Image *halveImage(const Image *img) {
+    Image *output = createImage(img->width / 2, img->height / 2, img->channels);
+    if (!output)
+        return NULL;
+
+    int channels = img->channels;
+    for (int y = 0; y < output->height; y++) {
+        const unsigned char *top = img->pixels + (size_t)(2 * y) * img->width * channels;
+        const unsigned char *bottom = top + (size_t)img->width * channels;
+        unsigned char *out = output->pixels + (size_t)y * output->width * channels;
+        for (int x = 0; x < output->width; x++) {
+            for (int c = 0; c < channels; c++) {
+                int i = 2 * x * channels + c;
+                out[x * channels + c] = (unsigned char)((top[i] + top[i + channels] + bottom[i] + bottom[i + channels] + 2) / 4);
+            }
+        }
+    }
+
+    return output;
+}
+
+/** @brief Compute the multi-scale structural similarity (MS-SSIM) of two images
+ *
+ * The images are halved up to 4 times. When they become too small for a window the remaining
+ * scales are left out and the weights of the used scales are normalized.
+ *
+ * @param img1 The first image to compare
+ * @param img2 The second image to compare
+ *
+ * @return The MS-SSIM (1 for identical images), or -1 if it could not be computed
+ */
+double computeMSSSIM(const Image *img1, const Image *img2) {
+    static const double weights[MS_SSIM_SCALES] = {0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+
+    if (!checkSsimInput(img1, img2))
+        return -1.0;
+
+    double csValues[MS_SSIM_SCALES];
+    double ssim = -1.0;
+    int scales = 0;
+    const Image *a = img1;
+    const Image *b = img2;
+    Image *reducedA = NULL;
+    Image *reducedB = NULL;
+
+    while (scales < MS_SSIM_SCALES) {
+        if (!ssimWithCs(a, b, &ssim, &csValues[scales])) {
+            scales = 0;
+            break;
+        }
+        scales++;
+
+        // Next scale, if it still fits a window
+        if (scales == MS_SSIM_SCALES || a->width / 2 <= 2 * SSIM_RADIUS || a->height / 2 <= 2 * SSIM_RADIUS)
+            break;
+        Image *nextA = halveImage(a);
+        Image *nextB = halveImage(b);
+        if (reducedA)
+            freeImage(reducedA);
+        if (reducedB)
+            freeImage(reducedB);
+        reducedA = nextA;
+        reducedB = nextB;
+        if (!nextA || !nextB) {
+            scales = 0;
+            break;
+        }
+        a = nextA;
+        b = nextB;
+    }
+
+    if (reducedA)
+        freeImage(reducedA);
+    if (reducedB)
+        freeImage(reducedB);
+    if (scales == 0)
+        return -1.0;
+
+    // Contrast-structure of the finer scales and full SSIM of the coarsest one (negative terms count as 0)
+    double weightSum = 0.0;
+    for (int i = 0; i < scales; i++)
+        weightSum += weights[i];
+
+    double result = 1.0;
+    for (int i = 0; i < scales - 1; i++)
+        result *= pow(fmax(csValues[i], 0.0), weights[i] / weightSum);
+    result *= pow(fmax(ssim, 0.0), weights[scales - 1] / weightSum);
+
+    return result;
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static unsigned long long rotateLeft64(unsigned long long value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static unsigned long long readLittleEndian64(const unsigned char *bytes) {
+    unsigned long long value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = (value << 8) | bytes[i];
+    return value;
+}
+
+static unsigned long long xxh64Round(unsigned long long accumulator, unsigned long long input) {
+    accumulator += input * XXH_PRIME64_2;
+    accumulator = rotateLeft64(accumulator, 31);
+    return accumulator * XXH_PRIME64_1;
+}
+
+static unsigned long long xxh64MergeRound(unsigned long long accumulator, unsigned long long value) {
+    accumulator ^= xxh64Round(0, value);
+    return accumulator * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/** @brief Hash a buffer with XXH64
+ *
+ * @param data The bytes that will be hashed
+ * @param length The number of bytes
+ * @param seed The seed of the hash
+ *
+ * @return The 64 bit hash
+ */
+unsigned long long xxHash64(const unsigned char *data, size_t length, unsigned long long seed) {
+    const unsigned char *end = data + length;
+    unsigned long long hash;
+
+    if (length >= 32) {
+        // Four independent lanes over 32 byte stripes
+        unsigned long long v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        unsigned long long v2 = seed + XXH_PRIME64_2;
+        unsigned long long v3 = seed;
+        unsigned long long v4 = seed - XXH_PRIME64_1;
+        const unsigned char *limit = end - 32;
+        do {
+            v1 = xxh64Round(v1, readLittleEndian64(data));
+            v2 = xxh64Round(v2, readLittleEndian64(data + 8));
+            v3 = xxh64Round(v3, readLittleEndian64(data + 16));
+            v4 = xxh64Round(v4, readLittleEndian64(data + 24));
+            data += 32;
+        } while (data <= limit);
+
+        hash = rotateLeft64(v1, 1) + rotateLeft64(v2, 7) + rotateLeft64(v3, 12) + rotateLeft64(v4, 18);
+        hash = xxh64MergeRound(hash, v1);
+        hash = xxh64MergeRound(hash, v2);
+        hash = xxh64MergeRound(hash, v3);
+        hash = xxh64MergeRound(hash, v4);
+    } else {
+        hash = seed + XXH_PRIME64_5;
+    }
+
+    hash += (unsigned long long)length;
+
+    // Remaining bytes
+    for (; data + 8 <= end; data += 8) {
+        hash ^= xxh64Round(0, readLittleEndian64(data));
+        hash = rotateLeft64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (data + 4 <= end) {
+        unsigned long long value = (unsigned long long)data[0] | ((unsigned long long)data[1] << 8) | ((unsigned long long)data[2] << 16) | ((unsigned long long)data[3] << 24);
+        hash ^= value * XXH_PRIME64_1;
+        hash = rotateLeft64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        data += 4;
+    }
+    for (; data < end; data++) {
+        hash ^= (*data) * XXH_PRIME64_5;
+        hash = rotateLeft64(hash, 11) * XXH_PRIME64_1;
+    }
+
+    // Final mix
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/** @brief Compute a hash of the content of an image (dimensions, channels, pixel type and pixels)
+ *
+ * Identical images always have the same hash, any change gives (almost surely) a different one.
+ *
+ * @param img The image that will be hashed
+ *
+ * @return The 64 bit content hash
+ */
+unsigned long long hashImageContent(const Image *img) {
+    unsigned long long seed = ((unsigned long long)img->width << 32) ^ ((unsigned long long)img->height << 8) ^ (unsigned long long)img->channels ^ ((unsigned long long)img->pixelType << 4);
+    return xxHash64(img->pixels, (size_t)img->width * img->height * img->channels * pixelTypeSize(img->pixelType), seed);
+}
+
+/** @brief Reduce a grayscale image to a small size, averaging the pixels that fall in each output pixel
+ *
+ * @param gray The grayscale image
+ * @param outWidth The width of the output
+ * @param outHeight The height of the output
+ * @param output Where the outWidth * outHeight averages will be written
+ */
+static void reduceGrayArea(const Image *gray, int outWidth, int outHeight, float *output) {
+    for (int outY = 0; outY < outHeight; outY++) {
+        int startY = outY * gray->height / outHeight;
+        int endY = (outY + 1) * gray->height / outHeight;
+        if (endY <= startY)
+            endY = startY + 1;
+
+        for (int outX = 0; outX < outWidth; outX++) {
+            int startX = outX * gray->width / outWidth;
+            int endX = (outX + 1) * gray->width / outWidth;
+            if (endX <= startX)
+                endX = startX + 1;
+
+            unsigned int sum = 0;
+            for (int y = startY; y < endY; y++) {
+                for (int x = startX; x < endX; x++)
+                    sum += gray->pixels[y * gray->width + x];
+            }
+            output[outY * outWidth + outX] = (float)sum / ((endY - startY) * (endX - startX));
+        }
+    }
+}
+
+/** @brief Compute the difference hash (dHash) of an image
+ *
+ * The luma is reduced to 9x8 and each bit tells if a pixel is brighter than its right neighbour.
+ *
+ * @param img The image that will be hashed
+ *
+ * @return The 64 bit perceptual hash (0 if the luma could not be computed)
+ */
+unsigned long long computeDHash(const Image *img) {
+    if (!requirePixelU8(img, "computeDHash"))
+        return 0;
+    Image *gray = convertBnW(img);
+    if (!gray)
+        return 0;
+
+    float reduced[9 * 8];
+    reduceGrayArea(gray, 9, 8, reduced);
+    freeImage(gray);
+
+    unsigned long long hash = 0;
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            hash = (hash << 1) | (reduced[y * 9 + x] > reduced[y * 9 + x + 1]);
+        }
+    }
+    return hash;
+}
+
+static int compareFloats(const void *a, const void *b) {
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+/** @brief Compute the DCT based perceptual hash (pHash) of an image
+ *
+ * The luma is reduced to 32x32, and each bit tells if one of the 8x8 lowest frequency DCT
+ * coefficients is above their median.
+ *
+ * @param img The image that will be hashed
+ *
+ * @return The 64 bit perceptual hash (0 if the luma could not be computed)
+ */
+unsigned long long computePHash(const Image *img) {
+    if (!requirePixelU8(img, "computePHash"))
+        return 0;
+    static float cosines[8][32];
+    static bool cosinesReady = false;
+
+    Image *gray = convertBnW(img);
+    if (!gray)
+        return 0;
+
+    float reduced[32 * 32];
+    reduceGrayArea(gray, 32, 32, reduced);
+    freeImage(gray);
+
+    if (!cosinesReady) {
+        for (int u = 0; u < 8; u++) {
+            for (int x = 0; x < 32; x++)
+                cosines[u][x] = (float)cos((2 * x + 1) * u * M_PI / 64.0);
+        }
+        cosinesReady = true;
+    }
+
+    // Separable DCT, only the 8 lowest frequencies of each direction are needed
+    float rows[32][8];
+    for (int y = 0; y < 32; y++) {
+        for (int u = 0; u < 8; u++) {
+            float sum = 0.0f;
+            for (int x = 0; x < 32; x++)
+                sum += reduced[y * 32 + x] * cosines[u][x];
+            rows[y][u] = sum;
+        }
+    }
+
+    float coefficients[64];
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            float sum = 0.0f;
+            for (int y = 0; y < 32; y++)
+                sum += rows[y][u] * cosines[v][y];
+            coefficients[v * 8 + u] = sum;
+        }
+    }
+
+    float sorted[64];
+    memcpy(sorted, coefficients, sizeof(sorted));
+    qsort(sorted, 64, sizeof(float), compareFloats);
+    float median = 0.5f * (sorted[31] + sorted[32]);
+
+    unsigned long long hash = 0;
+    for (int i = 0; i < 64; i++)
+        hash = (hash << 1) | (coefficients[i] > median);
+    return hash;
+}
+
+/** @brief Count the bits that differ between two hashes
+ *
+ * @param a The first hash
+ * @param b The second hash
+ *
+ * @return The Hamming distance (0 to 64)
+ */
+int hammingDistance(unsigned long long a, unsigned long long b) {
+#ifdef __GNUC__
+    return __builtin_popcountll(a ^ b);
+#else
+    unsigned long long bits = a ^ b;
+    int count = 0;
+    while (bits) {
+        bits &= bits - 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+#define HASH_INDEX_BANDS 4  // The 64 bit hashes are split in 4 bands of 16 bits
+#define HASH_INDEX_TAIL 512 // Entries added since the band tables were last merged, at most
+
+// Index of perceptual hashes for near-duplicate lookups
+typedef struct {
+    unsigned long long *hashes;
+    int *ids;
+    int count;
+    int capacity;
+    // For each band, (band value << 32 | entry) of the first sortedCount entries, sorted
+    unsigned long long *bands[HASH_INDEX_BANDS];
+    int sortedCount; // The later entries are not in the band tables yet, so lookups scan them
+} HashIndex;
+
+/** @brief Create an empty hash index
+ *
+ * @return The new index, or NULL if the memory could not be allocated
+ */
+HashIndex *createHashIndex(void) {
+    HashIndex *index = (HashIndex *)calloc(1, sizeof(HashIndex));
+    if (!index)
+        printf("Error allocating memory for hash index\n");
+    return index;
+}
+
+/** @brief Free the memory of a hash index
+ *
+ * @param index The index that will be freed
+ */
+void freeHashIndex(HashIndex *index) {
+    free(index->hashes);
+    free(index->ids);
+    for (int b = 0; b < HASH_INDEX_BANDS; b++)
+        free(index->bands[b]);
+    free(index);
+}
+
+static int compareUnsignedLongLongs(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+static unsigned int hashBand(unsigned long long hash, int band) {
+    return (unsigned int)(hash >> (16 * band)) & 0xFFFF;
+}
+
+/** @brief Merge the entries added since the last merge into the sorted band tables
+ *
+ * Only the new entries are sorted; the merge runs from the end of each table, so the sorted entries move at
+ * most once and no other table is needed.
+ */
+static void mergeHashBands(HashIndex *index) {
+    unsigned long long tail[HASH_INDEX_TAIL];
+    const int tailCount = index->count - index->sortedCount;
+
+    for (int b = 0; b < HASH_INDEX_BANDS; b++) {
+        for (int i = 0; i < tailCount; i++) {
+            int entry = index->sortedCount + i;
+            tail[i] = ((unsigned long long)hashBand(index->hashes[entry], b) << 32) | (unsigned int)entry;
+        }
+        qsort(tail, tailCount, sizeof(unsigned long long), compareUnsignedLongLongs);
+
+        unsigned long long *band = index->bands[b];
+        int sorted = index->sortedCount - 1;
+        int added = tailCount - 1;
+        for (int i = index->count - 1; added >= 0; i--)
+            band[i] = (sorted >= 0 && band[sorted] > tail[added]) ? band[sorted--] : tail[added--];
+    }
+    index->sortedCount = index->count;
+}
+
+/** @brief Add a hash to an index
+ *
+ * @param index The index
+ * @param hash The hash (e.g. from computeDHash or computePHash)
+ * @param id The value returned by the lookups that match this hash
+ *
+ * @return Returns true if the hash was added
+ */
+bool hashIndexAdd(HashIndex *index, unsigned long long hash, int id) {
+    if (index->count == index->capacity) {
+        int capacity = index->capacity ? index->capacity * 2 : 256;
+        unsigned long long *hashes = (unsigned long long *)realloc(index->hashes, capacity * sizeof(unsigned long long));
+        if (hashes)
+            index->hashes = hashes;
+        int *ids = (int *)realloc(index->ids, capacity * sizeof(int));
+        if (ids)
+            index->ids = ids;
+        bool allocated = hashes && ids;
+        for (int b = 0; b < HASH_INDEX_BANDS; b++) {
+            unsigned long long *band = (unsigned long long *)realloc(index->bands[b], capacity * sizeof(unsigned long long));
+            if (band)
+                index->bands[b] = band;
+            allocated = allocated && band;
+        }
+        if (!allocated) {
+            printf("Error allocating memory for hash index\n");
+            return false;
+        }
+        index->capacity = capacity;
+    }
+
+    index->hashes[index->count] = hash;
+    index->ids[index->count] = id;
+    index->count++;
+    if (index->count - index->sortedCount == HASH_INDEX_TAIL)
+        mergeHashBands(index);
+    return true;
+}
+
+/** @brief Find the entries of an index within a Hamming distance of a hash
+ *
+ * Distances below the number of bands use the band tables: two hashes that differ in at most 3 bits
+ * have at least one identical 16 bit band, so only the entries sharing a band are checked, plus the
+ * few entries added since the tables were last merged. Larger distances scan all hashes, which are
+ * stored contiguously.
+ *
+ * @param index The index
+ * @param hash The hash to look for
+ * @param maxDistance The largest Hamming distance of a match
+ * @param ids Where the ids of the matches will be written
+ * @param maxResults The size of ids
+ *
+ * @return The number of matches written to ids
+ */
+int hashIndexQuery(const HashIndex *index, unsigned long long hash, int maxDistance, int *ids, int maxResults) {
+    int found = 0;
+
+    if (maxDistance >= HASH_INDEX_BANDS) {
+        for (int i = 0; i < index->count && found < maxResults; i++) {
+            if (hammingDistance(index->hashes[i], hash) <= maxDistance)
+                ids[found++] = index->ids[i];
+        }
+        return found;
+    }
+
+    for (int b = 0; b < HASH_INDEX_BANDS; b++) {
+        unsigned long long key = (unsigned long long)hashBand(hash, b) << 32;
+
+        // First entry with this band value
+        int low = 0, high = index->sortedCount;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (index->bands[b][middle] < key)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        for (int i = low; i < index->sortedCount && (index->bands[b][i] >> 32) == (key >> 32); i++) {
+            int entry = (int)(index->bands[b][i] & 0xFFFFFFFFu);
+            unsigned long long candidate = index->hashes[entry];
+
+            // Entries sharing an earlier band were already checked
+            bool seen = false;
+            for (int earlier = 0; earlier < b; earlier++) {
+                if (hashBand(candidate, earlier) == hashBand(hash, earlier))
+                    seen = true;
+            }
+            if (seen || hammingDistance(candidate, hash) > maxDistance)
+                continue;
+
+            if (found == maxResults)
+                return found;
+            ids[found++] = index->ids[entry];
+        }
+    }
+
+    for (int i = index->sortedCount; i < index->count && found < maxResults; i++) {
+        if (hammingDistance(index->hashes[i], hash) <= maxDistance)
+            ids[found++] = index->ids[i];
+    }
+    return found;
+}
+
+// Operations a pipeline can record
+typedef enum {
+    PIPELINE_SOURCE,
+    PIPELINE_INVERT,
+    PIPELINE_BNW,
+    PIPELINE_KERNEL, // Blur, sharpen and custom kernels
+    PIPELINE_EDGES,
+} PipelineOperation;
+
+#define PIPELINE_SOURCE_NODE 0       // The node of the source image in every pipeline
+#define PIPELINE_MAX_MERGED_KERNEL 15 // Consecutive kernels are merged while the result is at most this size
+
+typedef struct {
+    PipelineOperation operation;
+    int input;     // The node the operation reads
+    float *kernel; // PIPELINE_KERNEL only
+    int kernelSize;
+    int blurLevel;    // The level of a kernel recorded by pipelineBlur, 0 otherwise
+    int sharpenLevel; // The level of a kernel recorded by pipelineSharpen, 0 otherwise
+} PipelineNode;
+
+// A lazy graph of operations on an image: nothing is computed until an output node is rendered
+typedef struct {
+    const Image *source;
+    PipelineNode *nodes;
+    int count;
+    int capacity;
+} Pipeline;
+
+// One pass over the image after fusion: point operations around a single stencil
+typedef struct {
+    unsigned char inputLut[256]; // Applied to every channel of the input
+    bool gray;                   // Then the channels are converted like convertBnW
+    unsigned char grayLut[256];  // Applied after the gray conversion
+    bool edges;                  // The stencil is the Sobel edge detection instead of the kernel
+    float *kernel;
+    int kernelSize;
+    bool sharpen;                 // The kernel is a blur subtracted from twice the input, rounded like applySharpen
+    bool mapped;                  // The output LUT is not the identity (stops kernel merging)
+    unsigned char outputLut[256]; // Applied to the output of the stencil
+} PipelineStage;
+
+/** @brief Create a pipeline that reads an image (the image must stay valid while the pipeline is used)
+ *
+ * @param source The source image, which is node PIPELINE_SOURCE_NODE
+ *
+ * @return The new pipeline, or NULL if the memory could not be allocated
+ */
+Pipeline *createPipeline(const Image *source) {
+    if (!requirePixelU8(source, "createPipeline"))
+        return NULL;
+
+    Pipeline *pipeline = (Pipeline *)calloc(1, sizeof(Pipeline));
+    PipelineNode *nodes = (PipelineNode *)malloc(16 * sizeof(PipelineNode));
+    if (!pipeline || !nodes) {
+        printf("Error allocating memory for pipeline\n");
+        free(pipeline);
+        free(nodes);
+        return NULL;
+    }
+
+    pipeline->source = source;
+    pipeline->nodes = nodes;
+    pipeline->capacity = 16;
+    pipeline->nodes[0] = (PipelineNode){PIPELINE_SOURCE, -1, NULL, 0, 0, 0};
+    pipeline->count = 1;
+    return pipeline;
+}
+
+/** @brief Free the memory of a pipeline (the source image is not freed)
+ *
+ * @param pipeline The pipeline that will be freed
+ */
+void freePipeline(Pipeline *pipeline) {
+    for (int i = 0; i < pipeline->count; i++)
+        free(pipeline->nodes[i].kernel);
+    free(pipeline->nodes);
+    free(pipeline);
+}
+
+/** @brief Record an operation
+ *
+ * @param kernel The kernel of a PIPELINE_KERNEL operation, owned by the pipeline from now on
+ *
+ * @return The new node, or -1 if the input is not a node or the memory could not be allocated
+ */
+static int pipelineAdd(Pipeline *pipeline, PipelineOperation operation, int input, float *kernel, int kernelSize) {
+    if (input < 0 || input >= pipeline->count) {
+        printf("Pipeline node %d does not exist\n", input);
+        free(kernel);
+        return -1;
+    }
+
+    if (pipeline->count == pipeline->capacity) {
+        PipelineNode *nodes = (PipelineNode *)realloc(pipeline->nodes, pipeline->capacity * 2 * sizeof(PipelineNode));
+        if (!nodes) {
+            printf("Error allocating memory for pipeline\n");
+            free(kernel);
+            return -1;
+        }
+        pipeline->nodes = nodes;
+        pipeline->capacity *= 2;
+    }
+
+    pipeline->nodes[pipeline->count] = (PipelineNode){operation, input, kernel, kernelSize, 0, 0};
+    return pipeline->count++;
+}
+
+/** @brief Record invertPixels
+ *
+ * @param pipeline The pipeline
+ * @param input The node that will be inverted
+ *
+ * @return The new node, or -1 on error
+ */
+int pipelineInvert(Pipeline *pipeline, int input) {
+    return pipelineAdd(pipeline, PIPELINE_INVERT, input, NULL, 0);
+}
+
+/** @brief Record convertBnW
+ *
+ * @param pipeline The pipeline
+ * @param input The node that will be converted
+ *
+ * @return The new node, or -1 on error
+ */
+int pipelineBnW(Pipeline *pipeline, int input) {
+    return pipelineAdd(pipeline, PIPELINE_BNW, input, NULL, 0);
+}
+
+/** @brief Record applyKernel
+ *
+ * @param pipeline The pipeline
+ * @param input The node that will be applied the kernel
+ * @param kernel The kernel (copied)
+ * @param kernelSize The size of one side of the kernel (odd)
+ *
+ * @return The new node, or -1 on error
+ */
+int pipelineKernel(Pipeline *pipeline, int input, const float *kernel, int kernelSize) {
+    if (kernelSize < 1 || kernelSize % 2 == 0) {
+        printf("Kernel size must be odd\n");
+        return -1;
+    }
+
+    float *copy = (float *)malloc(kernelSize * kernelSize * sizeof(float));
+    if (!copy) {
+        printf("Error allocating memory for kernel\n");
+        return -1;
+    }
+    memcpy(copy, kernel, kernelSize * kernelSize * sizeof(float));
+    return pipelineAdd(pipeline, PIPELINE_KERNEL, input, copy, kernelSize);
+}
+
+/** @brief Record applyBlur
+ *
+ * @param pipeline The pipeline
+ * @param input The node that will be blurred
+ * @param blurLevel The amount of blur applied (starting at 1)
+ *
+ * @return The new node, or -1 on error
+ */
+int pipelineBlur(Pipeline *pipeline, int input, int blurLevel) {
+    if (blurLevel < 1) {
+        printf("Blur level must be at least 1\n");
+        return -1;
+    }
+
+    float *kernel = createBoxKernel(blurLevel);
+    if (!kernel)
+        return -1;
+    int node = pipelineAdd(pipeline, PIPELINE_KERNEL, input, kernel, blurLevel * 2 + 1);
+    if (node >= 0)
+        pipeline->nodes[node].blurLevel = blurLevel;
+    return node;
+}
+
+/** @brief Record applySharpen, as the kernel 2 * identity - blur
+ *
+ * @param pipeline The pipeline
+ * @param input The node that will be sharpened
+ * @param sharpenLevel The amount of sharpen applied
+ *
+ * @return The new node, or -1 on error
+ */
+int pipelineSharpen(Pipeline *pipeline, int input, int sharpenLevel) {
+    if (sharpenLevel < 1) {
+        printf("Sharpen level must be at least 1\n");
+        return -1;
+    }
+
+    float *kernel = createBoxKernel(sharpenLevel);
+    if (!kernel)
+        return -1;
+    int kernelSize = sharpenLevel * 2 + 1;
+    for (int i = 0; i < kernelSize * kernelSize; i++)
+        kernel[i] = -kernel[i];
+    kernel[kernelSize * kernelSize / 2] += 2.0f;
+    int node = pipelineAdd(pipeline, PIPELINE_KERNEL, input, kernel, kernelSize);
+    if (node >= 0)
+        pipeline->nodes[node].sharpenLevel = sharpenLevel;
+    return node;
+}
+
+/** @brief Record applyEdgeDetection
+ *
+ * @param pipeline The pipeline
+ * @param input The node that will be applied the edge detection
+ *
+ * @return The new node, or -1 on error
+ */
+int pipelineEdgeDetection(Pipeline *pipeline, int input) {
+    return pipelineAdd(pipeline, PIPELINE_EDGES, input, NULL, 0);
+}
+
+/** @brief Compose two kernels into the kernel that applies both (first a, then b)
+ *
+ * @return The (sizeA + sizeB - 1) squared kernel, or NULL if the memory could not be allocated
+ */
+static float *mergeKernels(const float *a, int sizeA, const float *b, int sizeB) {
+    int size = sizeA + sizeB - 1;
+    float *merged = (float *)calloc((size_t)size * size, sizeof(float));
+    if (!merged)
+        return NULL;
+
+    for (int yb = 0; yb < sizeB; yb++)
+        for (int xb = 0; xb < sizeB; xb++)
+            for (int ya = 0; ya < sizeA; ya++)
+                for (int xa = 0; xa < sizeA; xa++)
+                    merged[(ya + yb) * size + xa + xb] += a[ya * sizeA + xa] * b[yb * sizeB + xb];
+    return merged;
+}
+
+/** @brief Check if a kernel keeps 0 to 255 inputs in 0 to 255, so that the clamp after it can be skipped
+ *
+ * @return Returns true if no weight is negative and the weights sum to at most 1
+ */
+static bool kernelKeepsRange(const float *kernel, int kernelSize) {
+    float sum = 0.0f;
+    for (int i = 0; i < kernelSize * kernelSize; i++) {
+        if (kernel[i] < 0.0f)
+            return false;
+        sum += kernel[i];
+    }
+    return sum <= 1.0f + 1e-5f;
+}
+
+static void resetStage(PipelineStage *stage) {
+    for (int i = 0; i < 256; i++)
+        stage->inputLut[i] = stage->grayLut[i] = stage->outputLut[i] = (unsigned char)i;
+    stage->gray = false;
+    stage->edges = false;
+    stage->kernel = NULL;
+    stage->kernelSize = 0;
+    stage->sharpen = false;
+    stage->mapped = false;
+}
+
+static void freeStages(PipelineStage *stages, int count) {
+    for (int i = 0; i < count; i++)
+        free(stages[i].kernel);
+    free(stages);
+}
+
+/** @brief Fuse the operations from the source to a node into stages
+ *
+ * Point operations join the stencil that follows them (or the one before them, for those at the end of a stage),
+ * consecutive kernels are merged into one (unless the first can leave 0 to 255), and nodes that the output does not
+ * depend on are never visited.
+ *
+ * @param stageCount Set to the number of stages
+ *
+ * @return The stages, or NULL if the memory could not be allocated
+ */
+static PipelineStage *planPipeline(const Pipeline *pipeline, int node, int *stageCount) {
+    int length = 0;
+    for (int n = node; n != PIPELINE_SOURCE_NODE; n = pipeline->nodes[n].input)
+        length++;
+
+    int *path = (int *)malloc((length + 1) * sizeof(int));
+    PipelineStage *stages = (PipelineStage *)malloc((length + 1) * sizeof(PipelineStage));
+    if (!path || !stages) {
+        free(path);
+        free(stages);
+        return NULL;
+    }
+    int i = length;
+    for (int n = node; n != PIPELINE_SOURCE_NODE; n = pipeline->nodes[n].input)
+        path[--i] = n;
+
+    int count = 0;
+    int channels = pipeline->source->channels;
+    PipelineStage *stage = NULL;
+    bool failed = false;
+
+    for (i = 0; i < length && !failed; i++) {
+        const PipelineNode *op = &pipeline->nodes[path[i]];
+        bool hasStencil = stage && (stage->kernel || stage->edges);
+
+        if (op->operation == PIPELINE_BNW && channels == 1)
+            continue; // Converting a gray image keeps it as it is
+
+        // Start a new stage when the operation cannot join the current one. A kernel that can leave 0 to 255
+        // (like sharpen) is clamped before the next one, so nothing merges after it.
+        bool mergeable = op->operation == PIPELINE_KERNEL && hasStencil && stage->kernel && !stage->sharpen &&
+                         !stage->mapped &&
+                         stage->kernelSize + op->kernelSize - 1 <= PIPELINE_MAX_MERGED_KERNEL &&
+                         kernelKeepsRange(stage->kernel, stage->kernelSize);
+        bool stencil = op->operation == PIPELINE_KERNEL || op->operation == PIPELINE_EDGES;
+        if (!stage || (hasStencil && ((stencil && !mergeable) || op->operation == PIPELINE_BNW))) {
+            stage = &stages[count++];
+            resetStage(stage);
+            hasStencil = false;
+        }
+
+        if (op->operation == PIPELINE_INVERT) {
+            unsigned char *lut = hasStencil ? stage->outputLut : (stage->gray ? stage->grayLut : stage->inputLut);
+            for (int v = 0; v < 256; v++)
+                lut[v] = 255 - lut[v];
+            stage->mapped = stage->mapped || hasStencil;
+        } else if (op->operation == PIPELINE_BNW) {
+            stage->gray = true;
+            channels = 1;
+        } else if (op->operation == PIPELINE_EDGES) {
+            stage->edges = true;
+        } else if (mergeable) {
+            float *merged = mergeKernels(stage->kernel, stage->kernelSize, op->kernel, op->kernelSize);
+            failed = !merged;
+            free(stage->kernel);
+            stage->kernel = merged;
+            stage->kernelSize += op->kernelSize - 1;
+        } else if (op->sharpenLevel) {
+            // A sharpen on its own subtracts the truncated blur, so it gives the same result as applySharpen
+            stage->kernel = createBoxKernel(op->sharpenLevel);
+            failed = !stage->kernel;
+            stage->kernelSize = op->kernelSize;
+            stage->sharpen = true;
+        } else {
+            stage->kernel = (float *)malloc(op->kernelSize * op->kernelSize * sizeof(float));
+            failed = !stage->kernel;
+            if (stage->kernel)
+                memcpy(stage->kernel, op->kernel, op->kernelSize * op->kernelSize * sizeof(float));
+            stage->kernelSize = op->kernelSize;
+        }
+    }
+
+    // A stage of point operations only runs as a 1 x 1 kernel
+    if (!failed && stage && !stage->kernel && !stage->edges) {
+        stage->kernel = (float *)malloc(sizeof(float));
+        failed = !stage->kernel;
+        if (stage->kernel)
+            stage->kernel[0] = 1.0f;
+        stage->kernelSize = 1;
+    }
+
+    free(path);
+    if (failed) {
+        freeStages(stages, count);
+        return NULL;
+    }
+    *stageCount = count;
+    return stages;
+}
+
+// Size of the output tiles: wide enough for long vector loops, small enough that a tile and its halos stay in L2
+#define PIPELINE_TILE_WIDTH 512
+#define PIPELINE_TILE_HEIGHT 64
+
+// A rectangle of an image (a whole image, an output tile or a tile with its halo)
+typedef struct {
+    unsigned char *pixels; // The top left pixel of the rectangle
+    size_t stride;         // Bytes between two rows
+    int x;                 // Position of the rectangle in the image
+    int y;
+    int width;
+    int height;
+    int channels;
+} PipelineRegion;
+
+// Data shared by the threads of the tiled pipeline execution
+typedef struct {
+    const PipelineStage *stages;
+    int stageCount;
+    const int *halos; // Rows and columns each stage computes around the tile, for the stages after it
+    const Image *source;
+    Image *output;
+    int tilesX;
+    int maxChannels;
+    int maxSize; // Largest stencil size
+    volatile int failed;
+} PipelineTask;
+
+/** @brief Apply the input point operations of a stage to count pixels of a row starting at startX, as floats
+ *
+ * Coordinates outside the image are clamped to it, which the input region always covers.
+ */
+static void pipelineInputRow(const PipelineStage *stage, const PipelineRegion *input, int row, int startX, int count, int imageWidth, float *values) {
+    const int inChannels = input->channels;
+    const int channels = stage->gray ? 1 : inChannels;
+    const unsigned char *pixels = input->pixels + (size_t)(row - input->y) * input->stride;
+
+    // Pixels inside the image are contiguous, those beyond its sides repeat the edge pixels
+    const int first = clamp(-startX, 0, count);
+    const int last = clamp(imageWidth - startX, first, count);
+    const unsigned char *row0 = pixels + (size_t)(startX + first - input->x) * inChannels;
+
+    if (!stage->gray) {
+        for (int i = 0; i < (last - first) * inChannels; i++)
+            values[first * inChannels + i] = stage->inputLut[row0[i]];
+    } else {
+        for (int i = 0; i < last - first; i++) {
+            const unsigned char *pixel = row0 + (size_t)i * inChannels;
+            unsigned char gray = stage->inputLut[pixel[0]];
+            if (inChannels >= 3)
+                gray = (unsigned char)round(0.299 * stage->inputLut[pixel[0]] + 0.587 * stage->inputLut[pixel[1]] + 0.114 * stage->inputLut[pixel[2]]);
+            values[first + i] = stage->grayLut[gray];
+        }
+    }
+
+    for (int i = 0; i < first; i++)
+        for (int c = 0; c < channels; c++)
+            values[i * channels + c] = values[first * channels + c];
+    for (int i = last; i < count; i++)
+        for (int c = 0; c < channels; c++)
+            values[i * channels + c] = values[(last - 1) * channels + c];
+}
+
+/** @brief Run a stage on an output region, keeping the prepared input rows of the window in a ring
+ *
+ * @param ring size rows of (output width + size - 1) * channels floats, plus 2 output rows of sums
+ */
+static void pipelineStageRegion(const PipelineStage *stage, const PipelineRegion *input, const PipelineRegion *output, int imageWidth, int imageHeight, float *ring, int *ringRows) {
+    static const float KX[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+    static const float KY[] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+    const int size = stage->edges ? 3 : stage->kernelSize;
+    const int half = size / 2;
+    const int channels = output->channels;
+    const int rowLength = output->width * channels;
+    const size_t paddedLength = (size_t)(output->width + 2 * half) * channels;
+    const float *kernel = stage->edges ? KX : stage->kernel;
+    float *sums = ring + paddedLength * size;
+    float *sumsY = sums + rowLength;
+
+    for (int i = 0; i < size; i++)
+        ringRows[i] = -1;
+
+    for (int y = output->y; y < output->y + output->height; y++) {
+        memset(sums, 0, 2 * (size_t)rowLength * sizeof(float));
+
+        for (int kernelY = -half; kernelY <= half; kernelY++) {
+            // The window holds at most size consecutive rows, so each has its own slot
+            int row = clamp(y + kernelY, 0, imageHeight - 1);
+            float *padded = ring + (size_t)(row % size) * paddedLength;
+            if (ringRows[row % size] != row) {
+                pipelineInputRow(stage, input, row, output->x - half, output->width + 2 * half, imageWidth, padded);
+                ringRows[row % size] = row;
+            }
+
+            for (int kernelX = -half; kernelX <= half; kernelX++) {
+                const float *source = padded + (kernelX + half) * channels;
+                const int kernelIndex = (kernelY + half) * size + (kernelX + half);
+                const float weight = kernel[kernelIndex];
+                for (int i = 0; i < rowLength; i++)
+                    sums[i] += source[i] * weight;
+                if (stage->edges) {
+                    const float weightY = KY[kernelIndex];
+                    for (int i = 0; i < rowLength; i++)
+                        sumsY[i] += source[i] * weightY;
+                }
+            }
+        }
+
+        unsigned char *out = output->pixels + (size_t)(y - output->y) * output->stride;
+        if (stage->sharpen) {
+            const float *center = ring + (size_t)(y % size) * paddedLength + half * channels;
+            for (int i = 0; i < rowLength; i++)
+                out[i] = stage->outputLut[clamp((int)center[i] * 2 - (int)sums[i], 0, 255)];
+            continue;
+        }
+        for (int i = 0; i < rowLength; i++) {
+            int value = stage->edges ? (int)sqrt(sums[i] * sums[i] + sumsY[i] * sumsY[i]) : (int)sums[i];
+            out[i] = stage->outputLut[clamp(value, 0, 255)];
+        }
+    }
+}
+
+/** @brief Run every stage on some output tiles, one tile at a time
+ *
+ * Each stage computes the tile grown by the halo the later stages read, clipped to the image, into a small
+ * buffer; the last stage writes the tile into the output. Intermediate values are the same as with full images.
+ */
+static void pipelineTiles(void *context, int startTile, int endTile) {
+    PipelineTask *task = (PipelineTask *)context;
+    const int width = task->source->width;
+    const int height = task->source->height;
+    const int maxWidth = PIPELINE_TILE_WIDTH + 2 * task->halos[0];
+    const size_t regionBytes = (size_t)maxWidth * (PIPELINE_TILE_HEIGHT + 2 * task->halos[0]) * task->maxChannels;
+    const size_t ringFloats = ((size_t)task->maxSize + 2) * (maxWidth + task->maxSize) * task->maxChannels;
+
+    unsigned char *buffers = (unsigned char *)malloc(2 * regionBytes);
+    float *ring = (float *)malloc(ringFloats * sizeof(float));
+    int *ringRows = (int *)malloc(task->maxSize * sizeof(int));
+    if (!buffers || !ring || !ringRows) {
+        free(buffers);
+        free(ring);
+        free(ringRows);
+        task->failed = 1;
+        return;
+    }
+
+    for (int tile = startTile; tile < endTile; tile++) {
+        const int tileX = (tile % task->tilesX) * PIPELINE_TILE_WIDTH;
+        const int tileY = (tile / task->tilesX) * PIPELINE_TILE_HEIGHT;
+        const int tileWidth = width - tileX < PIPELINE_TILE_WIDTH ? width - tileX : PIPELINE_TILE_WIDTH;
+        const int tileHeight = height - tileY < PIPELINE_TILE_HEIGHT ? height - tileY : PIPELINE_TILE_HEIGHT;
+        PipelineRegion input = {task->source->pixels, (size_t)width * task->source->channels, 0, 0, width, height, task->source->channels};
+
+        for (int s = 0; s < task->stageCount; s++) {
+            const int halo = task->halos[s];
+            const int channels = task->stages[s].gray ? 1 : input.channels;
+            PipelineRegion output;
+            output.x = tileX - halo > 0 ? tileX - halo : 0;
+            output.y = tileY - halo > 0 ? tileY - halo : 0;
+            output.width = (tileX + tileWidth + halo < width ? tileX + tileWidth + halo : width) - output.x;
+            output.height = (tileY + tileHeight + halo < height ? tileY + tileHeight + halo : height) - output.y;
+            output.channels = channels;
+            if (s == task->stageCount - 1) {
+                output.stride = (size_t)width * channels;
+                output.pixels = task->output->pixels + (size_t)output.y * output.stride + (size_t)output.x * channels;
+            } else {
+                output.stride = (size_t)output.width * channels;
+                output.pixels = buffers + (s % 2) * regionBytes;
+            }
+
+            pipelineStageRegion(&task->stages[s], &input, &output, width, height, ring, ringRows);
+            input = output;
+        }
+    }
+
+    free(buffers);
+    free(ring);
+    free(ringRows);
+}
+
+/** @brief Compute a node of a pipeline
+ *
+ * The recorded operations are fused into as few stages as possible, then every stage runs on one tile of the
+ * image at a time (with the halo the later stages need), so the intermediate images never leave the cache.
+ * The tiles are shared between the threads. Point operations and single kernels give the same result as the
+ * functions they record. Merged kernels skip the rounding of the intermediate image and see the border pixels once
+ * instead of twice, so they can differ by a few levels, mostly at the borders. Kernels that need the clamp between
+ * them (a sharpen followed by another kernel) are not merged.
+ *
+ * @param pipeline The pipeline
+ * @param node The node that will be computed
+ *
+ * @return The image of the node, or NULL on error
+ */
+Image *pipelineRender(const Pipeline *pipeline, int node) {
+    if (node < 0 || node >= pipeline->count) {
+        printf("Pipeline node %d does not exist\n", node);
+        return NULL;
+    }
+
+    int stageCount;
+    PipelineStage *stages = planPipeline(pipeline, node, &stageCount);
+    if (!stages) {
+        printf("Error allocating memory for pipeline stages\n");
+        return NULL;
+    }
+
+    const Image *source = pipeline->source;
+    if (stageCount == 0) {
+        Image *copy = createImage(source->width, source->height, source->channels);
+        if (copy)
+            memcpy(copy->pixels, source->pixels, (size_t)source->width * source->height * source->channels);
+        freeStages(stages, stageCount);
+        return copy;
+    }
+
+    // The halo of a stage is the sum of the radii of the stages after it
+    int *halos = (int *)malloc(stageCount * sizeof(int));
+    bool gray = false;
+    int maxSize = 1;
+    for (int s = stageCount - 1; s >= 0 && halos; s--) {
+        int size = stages[s].edges ? 3 : stages[s].kernelSize;
+        halos[s] = s == stageCount - 1 ? 0 : halos[s + 1] + (stages[s + 1].edges ? 3 : stages[s + 1].kernelSize) / 2;
+        maxSize = size > maxSize ? size : maxSize;
+        gray = gray || stages[s].gray;
+    }
+
+    Image *output = halos ? createImage(source->width, source->height, gray ? 1 : source->channels) : NULL;
+    if (output) {
+        int tilesX = (source->width + PIPELINE_TILE_WIDTH - 1) / PIPELINE_TILE_WIDTH;
+        int tilesY = (source->height + PIPELINE_TILE_HEIGHT - 1) / PIPELINE_TILE_HEIGHT;
+        PipelineTask task = {stages, stageCount, halos, source, output, tilesX, source->channels, maxSize, 0};
+        parallelFor(tilesX * tilesY, 1, pipelineTiles, &task);
+        if (task.failed) {
+            printf("Error allocating memory for pipeline tiles\n");
+            freeImage(output);
+            output = NULL;
+        }
+    }
+
+    free(halos);
+    freeStages(stages, stageCount);
+    return output;
+}
+
+// Ways applyKernelWithMethod can compute a convolution
+typedef enum {
+    CONVOLUTION_AUTO,      // Pick the cheapest method for the kernel size and rank
+    CONVOLUTION_DIRECT,    // Every tap of the kernel for every pixel
+    CONVOLUTION_SEPARABLE, // A row pass and a column pass per term of the low rank decomposition of the kernel
+    CONVOLUTION_FFT,       // Products of spectra, on overlapping tiles
+} ConvolutionMethod;
+
+#define FFT_MAX_SIZE 1024        // Largest FFT tile side
+#define FFT_BUTTERFLY_COST 9.0   // Costs of a butterfly and of loading, multiplying and storing a block value,
+#define FFT_ELEMENT_COST 8.0     // relative to a kernel tap of the direct convolution (measured)
+#define SEPARABLE_PASS_COST 2.0  // Cost of going through the float buffers of a separable pass, in kernel taps
+#define KERNEL_ANALYSIS_CACHE_SIZE 16 // Number of analyzed custom kernels kept for later calls
+
+// Analyzed kernel, found again by its pointer and contents
+typedef struct {
+    const float *kernel;
+    float *weights; // Copy of the kernel when analyzed, NULL for an empty slot
+    KernelAnalysis analysis;
+} KernelAnalysisEntry;
+
+static KernelAnalysisEntry kernelAnalysisCache[KERNEL_ANALYSIS_CACHE_SIZE];
+static int kernelAnalysisNext = 0; // The slot replaced by the next analysis
+#ifndef IMAGE_NO_THREADS
+static pthread_mutex_t kernelAnalysisLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static bool copyKernelAnalysis(KernelAnalysis *copy, const KernelAnalysis *analysis) {
+    const int n = analysis->size;
+    *copy = *analysis;
+    copy->columns = (float *)malloc((size_t)2 * n * n * sizeof(float));
+    if (!copy->columns)
+        return false;
+    memcpy(copy->columns, analysis->columns, (size_t)2 * n * n * sizeof(float));
+    copy->rows = copy->columns + n * n;
+    return true;
+}
+
+/** @brief Get the analysis of a kernel, from the cache if the same array with the same weights was seen before
+ *
+ * @param kernel The kernel
+ * @param size The size of one side of the kernel
+ * @param analysis Filled with a copy owned by the caller, to be freed with freeKernelAnalysis
+ *
+ * @return True on success, false if the memory could not be allocated
+ */
+static bool getKernelAnalysis(const float *kernel, int size, KernelAnalysis *analysis) {
+    const size_t bytes = (size_t)size * size * sizeof(float);
+    bool found = false, copied = false;
+
+#ifndef IMAGE_NO_THREADS
+    pthread_mutex_lock(&kernelAnalysisLock);
+#endif
+    for (int i = 0; i < KERNEL_ANALYSIS_CACHE_SIZE && !found; i++) {
+        KernelAnalysisEntry *entry = &kernelAnalysisCache[i];
+        if (entry->weights && entry->kernel == kernel && entry->analysis.size == size && memcmp(entry->weights, kernel, bytes) == 0) {
+            found = true;
+            copied = copyKernelAnalysis(analysis, &entry->analysis);
+        }
+    }
+#ifndef IMAGE_NO_THREADS
+    pthread_mutex_unlock(&kernelAnalysisLock);
+#endif
+    if (found)
+        return copied;
+
+    if (!analyzeKernel(kernel, size, analysis))
+        return false;
+
+    // Keep a copy for later calls, the analysis is still valid if it can't be stored
+    KernelAnalysisEntry entry = {kernel, (float *)malloc(bytes), {0}};
+    if (!entry.weights || !copyKernelAnalysis(&entry.analysis, analysis)) {
+        free(entry.weights);
+        return true;
+    }
+    memcpy(entry.weights, kernel, bytes);
+
+#ifndef IMAGE_NO_THREADS
+    pthread_mutex_lock(&kernelAnalysisLock);
+#endif
+    KernelAnalysisEntry old = kernelAnalysisCache[kernelAnalysisNext];
+    kernelAnalysisCache[kernelAnalysisNext] = entry;
+    kernelAnalysisNext = (kernelAnalysisNext + 1) % KERNEL_ANALYSIS_CACHE_SIZE;
+#ifndef IMAGE_NO_THREADS
+    pthread_mutex_unlock(&kernelAnalysisLock);
+#endif
+    free(old.weights);
+    freeKernelAnalysis(&old.analysis);
+    return true;
+}
+
+// Data shared by the threads of the separable convolution, run once per term of the kernel
+typedef struct {
+    const Image *img;
+    float *rows; // The image after the row pass of the current term
+    float *sums; // The sum of the previous terms, unused for a single term
+    Image *output;
+    const float *column;
+    const float *row;
+    int size;
+    int term;
+    int rank;
+    volatile int failed;
+} SeparableTask;
+
+/** @brief Row pass of the separable convolution, from a float row padded with the border pixels
+ */
+static void separableRows(void *context, int startRow, int endRow) {
+    SeparableTask *task = (SeparableTask *)context;
+    const int width = task->img->width;
+    const int channels = task->img->channels;
+    const int half = task->size / 2;
+    const int rowLength = width * channels;
+
+    float *padded = (float *)malloc((size_t)(width + 2 * half) * channels * sizeof(float));
+    if (!padded) {
+        task->failed = 1;
+        return;
+    }
+
+    for (int y = startRow; y < endRow; y++) {
+        const unsigned char *in = task->img->pixels + (size_t)y * rowLength;
+        for (int x = -half; x < width + half; x++)
+            for (int c = 0; c < channels; c++)
+                padded[(x + half) * channels + c] = in[clamp(x, 0, width - 1) * channels + c];
+
+        float *out = task->rows + (size_t)y * rowLength;
+        memset(out, 0, rowLength * sizeof(float));
+        for (int j = 0; j < task->size; j++) {
+            const float *source = padded + j * channels;
+            const float weight = task->row[j];
+            for (int i = 0; i < rowLength; i++)
+                out[i] += source[i] * weight;
+        }
+    }
+
+    free(padded);
+}
+
+/** @brief Column pass of the separable convolution, added to the previous terms, truncated and clamped like
+ * applyKernel after the last one
+ */
+static void separableColumns(void *context, int startRow, int endRow) {
+    SeparableTask *task = (SeparableTask *)context;
+    const int height = task->img->height;
+    const int half = task->size / 2;
+    const int rowLength = task->img->width * task->img->channels;
+
+    float *sums = (float *)malloc(rowLength * sizeof(float));
+    if (!sums) {
+        task->failed = 1;
+        return;
+    }
+
+    for (int y = startRow; y < endRow; y++) {
+        float *previous = task->sums ? task->sums + (size_t)y * rowLength : NULL;
+        if (task->term > 0)
+            memcpy(sums, previous, rowLength * sizeof(float));
+        else
+            memset(sums, 0, rowLength * sizeof(float));
+        for (int j = 0; j < task->size; j++) {
+            const float *source = task->rows + (size_t)clamp(y + j - half, 0, height - 1) * rowLength;
+            const float weight = task->column[j];
+            for (int i = 0; i < rowLength; i++)
+                sums[i] += source[i] * weight;
+        }
+
+        if (task->term < task->rank - 1) {
+            memcpy(previous, sums, rowLength * sizeof(float));
+            continue;
+        }
+        unsigned char *out = task->output->pixels + (size_t)y * rowLength;
+        for (int i = 0; i < rowLength; i++)
+            out[i] = (unsigned char)clamp((int)sums[i], 0, 255);
+    }
+
+    free(sums);
+}
+
+/** @brief Convolve an image with a kernel given as a sum of products of a column and a row
+ *
+ * @return The convolved image, or NULL if the memory could not be allocated
+ */
+static Image *convolveSeparable(const Image *img, const KernelAnalysis *analysis) {
+    const size_t values = (size_t)img->width * img->height * img->channels;
+    Image *output = createImage(img->width, img->height, img->channels);
+    float *rows = (float *)malloc((analysis->rank > 1 ? 2 : 1) * values * sizeof(float));
+    if (!output || !rows) {
+        printf("Error allocating memory for separable convolution\n");
+        free(rows);
+        if (output)
+            freeImage(output);
+        return NULL;
+    }
+
+    SeparableTask task = {img, rows, analysis->rank > 1 ? rows + values : NULL, output, NULL, NULL, analysis->size, 0, analysis->rank, 0};
+    for (int t = 0; t < analysis->rank && !task.failed; t++) {
+        task.term = t;
+        task.column = analysis->columns + t * analysis->size;
+        task.row = analysis->rows + t * analysis->size;
+        parallelFor(img->height, 16, separableRows, &task);
+        if (!task.failed)
+            parallelFor(img->height, 16, separableColumns, &task);
+    }
+
+    free(rows);
+    if (task.failed) {
+        printf("Error allocating memory for separable convolution\n");
+        freeImage(output);
+        return NULL;
+    }
+    return output;
+}
+
+// Tables of a radix-2 complex FFT of one size
+typedef struct {
+    int size;
+    DispatchLevel level;
+    int *bitReverse;
+    float *twiddles; // cos and sin of -2 pi k / size, for k below size / 2
+} FftPlan;
+
+static bool createFftPlan(FftPlan *plan, int size) {
+    plan->size = size;
+    plan->level = getDispatchLevel();
+    plan->bitReverse = (int *)malloc(size * sizeof(int));
+    plan->twiddles = (float *)malloc(size * sizeof(float));
+    if (!plan->bitReverse || !plan->twiddles) {
+        free(plan->bitReverse);
+        free(plan->twiddles);
+        return false;
+    }
+
+    int bits = 0;
+    while ((1 << bits) < size)
+        bits++;
+    for (int i = 0; i < size; i++) {
+        int reversed = 0;
+        for (int b = 0; b < bits; b++)
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        plan->bitReverse[i] = reversed;
+    }
+    for (int k = 0; k < size / 2; k++) {
+        double angle = -2.0 * M_PI * k / size;
+        plan->twiddles[2 * k] = (float)cos(angle);
+        plan->twiddles[2 * k + 1] = (float)sin(angle);
+    }
+    return true;
+}
+
+static void freeFftPlan(FftPlan *plan) {
+    free(plan->bitReverse);
+    free(plan->twiddles);
+}
+
+/** @brief Butterflies between two rows of count complex values: a, b = a + w * b, a - w * b
+ */
+static void butterflyRowsScalar(float *a, float *b, int count, float wr, float wi) {
+    for (int x = 0; x < count; x++) {
+        float tr = b[2 * x] * wr - b[2 * x + 1] * wi;
+        float ti = b[2 * x] * wi + b[2 * x + 1] * wr;
+        b[2 * x] = a[2 * x] - tr;
+        b[2 * x + 1] = a[2 * x + 1] - ti;
+        a[2 * x] += tr;
+        a[2 * x + 1] += ti;
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+// Two complex values per register: w * b = wr * (re, im) + wi * (-im, re)
+__attribute__((target("sse2"))) static void butterflyRowsSSE2(float *a, float *b, int count, float wr, float wi) {
+    const __m128 real = _mm_set1_ps(wr);
+    const __m128 imaginary = _mm_setr_ps(-wi, wi, -wi, wi);
+    int x = 0;
+    for (; x + 2 <= count; x += 2) {
+        __m128 vb = _mm_loadu_ps(b + 2 * x);
+        __m128 va = _mm_loadu_ps(a + 2 * x);
+        __m128 t = _mm_add_ps(_mm_mul_ps(vb, real), _mm_mul_ps(_mm_shuffle_ps(vb, vb, _MM_SHUFFLE(2, 3, 0, 1)), imaginary));
+        _mm_storeu_ps(b + 2 * x, _mm_sub_ps(va, t));
+        _mm_storeu_ps(a + 2 * x, _mm_add_ps(va, t));
+    }
+    butterflyRowsScalar(a + 2 * x, b + 2 * x, count - x, wr, wi);
+}
+
+__attribute__((target("avx2,fma"))) static void butterflyRowsAVX2(float *a, float *b, int count, float wr, float wi) {
+    const __m256 real = _mm256_set1_ps(wr);
+    const __m256 imaginary = _mm256_setr_ps(-wi, wi, -wi, wi, -wi, wi, -wi, wi);
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m256 vb = _mm256_loadu_ps(b + 2 * x);
+        __m256 va = _mm256_loadu_ps(a + 2 * x);
+        __m256 t = _mm256_fmadd_ps(vb, real, _mm256_mul_ps(_mm256_permute_ps(vb, _MM_SHUFFLE(2, 3, 0, 1)), imaginary));
+        _mm256_storeu_ps(b + 2 * x, _mm256_sub_ps(va, t));
+        _mm256_storeu_ps(a + 2 * x, _mm256_add_ps(va, t));
+    }
+    butterflyRowsScalar(a + 2 * x, b + 2 * x, count - x, wr, wi);
+}
+#endif
+
+static void butterflyRows(float *a, float *b, int count, float wr, float wi, DispatchLevel level) {
+#ifdef IMAGE_X86_SIMD
+    if (level == DISPATCH_AVX2) {
+        butterflyRowsAVX2(a, b, count, wr, wi);
+        return;
+    }
+    if (level == DISPATCH_SSE2) {
+        butterflyRowsSSE2(a, b, count, wr, wi);
+        return;
+    }
+#endif
+    (void)level;
+    butterflyRowsScalar(a, b, count, wr, wi);
+}
+
+/** @brief In place FFT of every column of a size x size block of interleaved complex values (unscaled in both directions)
+ *
+ * Each butterfly combines two whole rows with one twiddle, which keeps the memory accesses contiguous.
+ */
+static void fftColumns(const FftPlan *plan, float *block, bool inverse) {
+    const int size = plan->size;
+    const size_t rowFloats = (size_t)2 * size;
+
+    for (int y = 0; y < size; y++) {
+        int swap = plan->bitReverse[y];
+        if (swap > y) {
+            float *a = block + y * rowFloats, *b = block + swap * rowFloats;
+            for (size_t i = 0; i < rowFloats; i++) {
+                float value = a[i];
+                a[i] = b[i];
+                b[i] = value;
+            }
+        }
+    }
+
+    const float sign = inverse ? -1.0f : 1.0f;
+    for (int length = 2; length <= size; length *= 2) {
+        const int halfLength = length / 2;
+        const int step = size / length;
+        for (int start = 0; start < size; start += length) {
+            for (int k = 0; k < halfLength; k++) {
+                const float wr = plan->twiddles[2 * k * step];
+                const float wi = sign * plan->twiddles[2 * k * step + 1];
+                butterflyRows(block + (start + k) * rowFloats, block + (start + k + halfLength) * rowFloats, size, wr, wi, plan->level);
+            }
+        }
+    }
+}
+
+/** @brief Transpose a size x size block of interleaved complex values in place, 16 x 16 values at a time
+ */
+static void transposeBlock(float *block, int size) {
+    for (int blockY = 0; blockY < size; blockY += 16) {
+        for (int blockX = blockY; blockX < size; blockX += 16) {
+            for (int y = blockY; y < blockY + 16 && y < size; y++) {
+                for (int x = blockX > y + 1 ? blockX : y + 1; x < blockX + 16 && x < size; x++) {
+                    float *a = block + 2 * ((size_t)y * size + x), *b = block + 2 * ((size_t)x * size + y);
+                    float re = a[0], im = a[1];
+                    a[0] = b[0];
+                    a[1] = b[1];
+                    b[0] = re;
+                    b[1] = im;
+                }
+            }
+        }
+    }
+}
+
+/** @brief In place 2D FFT of a size x size block of interleaved complex values
+ *
+ * The forward transform leaves the spectrum transposed and the inverse transform expects it so, which is all the
+ * convolution needs as long as the kernel spectrum is made the same way.
+ */
+static void fft2d(const FftPlan *plan, float *block, bool inverse) {
+    fftColumns(plan, block, inverse);
+    transposeBlock(block, plan->size);
+    fftColumns(plan, block, inverse);
+}
+
+// Data shared by the threads of the FFT convolution
+typedef struct {
+    const Image *img;
+    Image *output;
+    const FftPlan *plan;
+    const float *spectrum; // Spectrum of the kernel, scaled for the inverse transform
+    int half;              // Radius of the kernel
+    int tileSize;          // Output pixels per tile side: FFT size - kernel size + 1
+    int tilesX;
+    volatile int failed;
+} FftTask;
+
+/** @brief Convolve some tiles with overlap-save: each FFT block holds a tile and its halo, and only the pixels
+ * the circular convolution did not wrap are kept. Two channels go through each transform, as real and imaginary
+ * parts, since the kernel is real.
+ */
+static void fftTiles(void *context, int startTile, int endTile) {
+    FftTask *task = (FftTask *)context;
+    const int width = task->img->width;
+    const int height = task->img->height;
+    const int channels = task->img->channels;
+    const int size = task->plan->size;
+
+    float *block = (float *)malloc((size_t)2 * size * size * sizeof(float));
+    if (!block) {
+        task->failed = 1;
+        return;
+    }
+
+    for (int tile = startTile; tile < endTile; tile++) {
+        const int tileX = (tile % task->tilesX) * task->tileSize;
+        const int tileY = (tile / task->tilesX) * task->tileSize;
+        const int tileWidth = width - tileX < task->tileSize ? width - tileX : task->tileSize;
+        const int tileHeight = height - tileY < task->tileSize ? height - tileY : task->tileSize;
+
+        for (int c = 0; c < channels; c += 2) {
+            const bool pair = c + 1 < channels;
+            for (int y = 0; y < size; y++) {
+                const unsigned char *row = task->img->pixels + (size_t)clamp(tileY - task->half + y, 0, height - 1) * width * channels;
+                float *values = block + (size_t)2 * y * size;
+                for (int x = 0; x < size; x++) {
+                    const unsigned char *pixel = row + clamp(tileX - task->half + x, 0, width - 1) * channels + c;
+                    values[2 * x] = pixel[0];
+                    values[2 * x + 1] = pair ? pixel[1] : 0.0f;
+                }
+            }
+
+            fft2d(task->plan, block, false);
+            for (size_t i = 0; i < (size_t)size * size; i++) {
+                float re = block[2 * i], im = block[2 * i + 1];
+                float sr = task->spectrum[2 * i], si = task->spectrum[2 * i + 1];
+                block[2 * i] = re * sr - im * si;
+                block[2 * i + 1] = re * si + im * sr;
+            }
+            fft2d(task->plan, block, true);
+
+            for (int y = 0; y < tileHeight; y++) {
+                const float *values = block + (size_t)2 * ((y + task->half) * size + task->half);
+                unsigned char *out = task->output->pixels + ((size_t)(tileY + y) * width + tileX) * channels + c;
+                for (int x = 0; x < tileWidth; x++) {
+                    out[x * channels] = (unsigned char)clamp((int)values[2 * x], 0, 255);
+                    if (pair)
+                        out[x * channels + 1] = (unsigned char)clamp((int)values[2 * x + 1], 0, 255);
+                }
+            }
+        }
+    }
+
+    free(block);
+}
+
+/** @brief Estimate the cost of the FFT convolution of an image, and the best FFT size
+ *
+ * @param kernelSize The size of one side of the kernel
+ * @param img The image
+ * @param fftSize Set to the best FFT size
+ *
+ * @return The cost in kernel taps per pixel and channel, or -1 if the kernel is too large
+ */
+static double fftConvolutionCost(int kernelSize, const Image *img, int *fftSize) {
+    double best = -1.0;
+    for (int size = 16, bits = 4; size <= FFT_MAX_SIZE; size *= 2, bits++) {
+        int tileSize = size - kernelSize + 1;
+        if (tileSize < 1)
+            continue;
+        // Forward and inverse 2D transforms of size * size * log2(size) / 2 butterflies each, per pair of channels
+        double tiles = (double)((img->width + tileSize - 1) / tileSize) * ((img->height + tileSize - 1) / tileSize);
+        double transforms = tiles * ((img->channels + 1) / 2);
+        double perTransform = (double)size * size * (bits * FFT_BUTTERFLY_COST + FFT_ELEMENT_COST);
+        double cost = transforms * perTransform / ((double)img->width * img->height * img->channels);
+        if (best < 0.0 || cost < best) {
+            best = cost;
+            *fftSize = size;
+        }
+        if (tileSize >= img->width && tileSize >= img->height)
+            break; // Larger transforms only add padding
+    }
+    return best;
+}
+
+/** @brief Convolve an image with the FFT
+ *
+ * @return The convolved image, or NULL if the kernel is too large or the memory could not be allocated
+ */
+static Image *convolveFft(const Image *img, const float *kernel, int kernelSize) {
+    int size;
+    if (fftConvolutionCost(kernelSize, img, &size) < 0.0) {
+        printf("Kernel too large for the FFT convolution\n");
+        return NULL;
+    }
+
+    FftPlan plan;
+    if (!createFftPlan(&plan, size)) {
+        printf("Error allocating memory for FFT\n");
+        return NULL;
+    }
+    Image *output = createImage(img->width, img->height, img->channels);
+    float *spectrum = (float *)calloc((size_t)2 * size * size, sizeof(float));
+    if (!output || !spectrum) {
+        printf("Error allocating memory for FFT convolution\n");
+        free(spectrum);
+        if (output)
+            freeImage(output);
+        freeFftPlan(&plan);
+        return NULL;
+    }
+
+    // Kernel weight (i, j) goes to (half - i, half - j) modulo size, which turns the circular convolution into the
+    // correlation of applyKernel, with the output of block pixel (half + y, half + x) at tile pixel (y, x)
+    const int half = kernelSize / 2;
+    const float scale = 1.0f / ((float)size * size);
+    for (int i = 0; i < kernelSize; i++) {
+        for (int j = 0; j < kernelSize; j++) {
+            int y = (half - i + size) % size, x = (half - j + size) % size;
+            spectrum[2 * ((size_t)y * size + x)] = kernel[i * kernelSize + j] * scale;
+        }
+    }
+    fft2d(&plan, spectrum, false);
+
+    // Overlap-save keeps the outputs at block positions half + t, for t below size - 2 * half
+    const int tileSize = size - 2 * half;
+    const int tilesX = (img->width + tileSize - 1) / tileSize;
+    const int tilesY = (img->height + tileSize - 1) / tileSize;
+    FftTask task = {img, output, &plan, spectrum, half, tileSize, tilesX, 0};
+    parallelFor(tilesX * tilesY, 1, fftTiles, &task);
+
+    free(spectrum);
+    freeFftPlan(&plan);
+    if (task.failed) {
+        printf("Error allocating memory for FFT convolution\n");
+        freeImage(output);
+        return NULL;
+    }
+    return output;
+}
+
+/** @brief Convolve an 8 bit image with a method, picking the cheapest one for CONVOLUTION_AUTO
+ *
+ * @param factors The separable terms of the kernel, only used by the automatic and separable methods
+ *
+ * @return The image after the kernel has been applied, or NULL on error
+ */
+static Image *convolveWithMethod(const Image *img, const float *kernel, int kernelSize, const KernelAnalysis *factors, ConvolutionMethod method) {
+    if (method == CONVOLUTION_AUTO) {
+        // Each separable term costs a row pass and a column pass, plus the float buffers it goes through
+        int fftSize;
+        double fftCost = fftConvolutionCost(kernelSize, img, &fftSize);
+        double directCost = (double)kernelSize * kernelSize;
+        double separableCost = 2.0 * factors->rank * (kernelSize + SEPARABLE_PASS_COST);
+        if (fftCost >= 0.0 && fftCost < directCost && fftCost < separableCost)
+            method = CONVOLUTION_FFT;
+        else if (separableCost < directCost)
+            method = CONVOLUTION_SEPARABLE;
+        else
+            method = CONVOLUTION_DIRECT;
+    }
+
+    if (method == CONVOLUTION_SEPARABLE)
+        return convolveSeparable(img, factors);
+    if (method == CONVOLUTION_FFT)
+        return convolveFft(img, kernel, kernelSize);
+
+    // The pipeline runs a single kernel with the arithmetic of applyKernel, on tiles and threads
+    Pipeline *pipeline = createPipeline(img);
+    int node = pipeline ? pipelineKernel(pipeline, PIPELINE_SOURCE_NODE, kernel, kernelSize) : -1;
+    Image *output = node >= 0 ? pipelineRender(pipeline, node) : NULL;
+    if (pipeline)
+        freePipeline(pipeline);
+    return output;
+}
+
+/** @brief Apply a kernel to an image with a given method, or the cheapest one
+ *
+ * CONVOLUTION_AUTO decomposes the kernel into separable terms with an SVD (cached for the same array and weights),
+ * and compares the taps of the direct convolution with the cost of one separable pass per term and the estimated
+ * cost of the FFT. The direct method gives the same result as applyKernel; the others round differently, so
+ * values can differ by one level.
+ *
+ * @param img The image that will be applied the kernel
+ * @param kernel The kernel that will be applied to the image
+ * @param kernelSize The size of one side of the kernel (odd)
+ * @param method How the convolution is computed
+ *
+ * @return The image after the kernel has been applied, or NULL on error
+ */
+Image *applyKernelWithMethod(const Image *img, const float *kernel, int kernelSize, ConvolutionMethod method) {
+    if (kernelSize < 1 || kernelSize % 2 == 0) {
+        printf("Kernel size must be odd\n");
+        return NULL;
+    }
+    if (img->pixelType != PIXEL_U8)
+        return applyKernel(img, kernel, kernelSize);
+
+    KernelAnalysis analysis = {0};
+    if ((method == CONVOLUTION_AUTO || method == CONVOLUTION_SEPARABLE) && !getKernelAnalysis(kernel, kernelSize, &analysis)) {
+        printf("Error allocating memory for kernel analysis\n");
+        return NULL;
+    }
+
+    Image *output = convolveWithMethod(img, kernel, kernelSize, &analysis, method);
+
+    freeKernelAnalysis(&analysis);
+    return output;
+}
+
+/** @brief Apply a kernel object to an image, like applyKernelWithMethod but without analyzing the weights again
+ *
+ * @param img The image that will be applied the kernel
+ * @param kernel The kernel, from createKernel or acquireKernel
+ * @param method How the convolution is computed
+ *
+ * @return The image after the kernel has been applied, or NULL on error
+ */
+Image *applyKernelObject(const Image *img, const Kernel *kernel, ConvolutionMethod method) {
+    if (img->pixelType != PIXEL_U8)
+        return applyKernel(img, kernel->weights, kernel->size);
+    return convolveWithMethod(img, kernel->weights, kernel->size, &kernel->factors, method);
+}
+
+// Filters of resizeImage
+typedef enum {
+    RESIZE_BOX,      // Average of the covered pixels
+    RESIZE_BILINEAR, // Triangle filter
+    RESIZE_BICUBIC,  // Keys cubic with a = -0.5
+    RESIZE_LANCZOS3, // Windowed sinc with 3 lobes
+} ResizeFilter;
+
+/** @brief Evaluate a resize filter
+ *
+ * @param filter The filter
+ * @param x The signed distance from the output pixel center to the sample, in source pixels (scaled when downsizing)
+ *
+ * @return The unnormalized weight
+ */
+static double resizeFilterWeight(ResizeFilter filter, double x) {
+    const double a = -0.5;
+    // Half open, so that a sample on the edge of the box belongs to one side (the first candidate when upsizing)
+    if (filter == RESIZE_BOX)
+        return x > -0.5 && x <= 0.5 ? 1.0 : 0.0;
+    if (x < 0.0)
+        x = -x;
+    switch (filter) {
+    case RESIZE_BOX:
+        break;
+    case RESIZE_BILINEAR:
+        return x < 1.0 ? 1.0 - x : 0.0;
+    case RESIZE_BICUBIC:
+        if (x < 1.0)
+            return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+        if (x < 2.0)
+            return ((a * x - 5.0 * a) * x + 8.0 * a) * x - 4.0 * a;
+        return 0.0;
+    case RESIZE_LANCZOS3:
+        if (x == 0.0)
+            return 1.0;
+        if (x < 3.0)
+            return 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+        return 0.0;
+    }
+    return 0.0;
+}
+
+static double resizeFilterRadius(ResizeFilter filter) {
+    switch (filter) {
+    case RESIZE_BOX:
+        return 0.5;
+    case RESIZE_BILINEAR:
+        return 1.0;
+    case RESIZE_BICUBIC:
+        return 2.0;
+    case RESIZE_LANCZOS3:
+        return 3.0;
+    }
+    return 1.0;
+}
+
+// Weights of the source pixels of every output pixel along one axis
+typedef struct {
+    int taps;       // Largest number of weights of an output pixel
+    int *starts;    // First source pixel of each output pixel
+    int *counts;    // Number of weights of each output pixel
+    float *weights; // taps weights per output pixel, normalized to a sum of 1
+} ResizeCoefficients;
+
+static void freeResizeCoefficients(ResizeCoefficients *coefficients) {
+    free(coefficients->starts);
+    free(coefficients->weights);
+    coefficients->starts = NULL;
+    coefficients->weights = NULL;
+}
+
+/** @brief Compute the weights of a resize along one axis
+ *
+ * The filter is centered on each output pixel, stretched by the scale when downsizing so that every source pixel
+ * contributes, and the weights that fall outside of the image are dropped before normalizing.
+ *
+ * @param coefficients Filled with the tables, to be freed with freeResizeCoefficients
+ * @param inSize The number of source pixels
+ * @param outSize The number of output pixels
+ * @param filter The filter
+ *
+ * @return True on success, false if the memory could not be allocated
+ */
+static bool createResizeCoefficients(ResizeCoefficients *coefficients, int inSize, int outSize, ResizeFilter filter) {
+    const double scale = (double)inSize / outSize;
+    const double filterScale = scale > 1.0 ? scale : 1.0;
+    const double support = resizeFilterRadius(filter) * filterScale;
+
+    coefficients->taps = (int)ceil(support) * 2 + 1;
+    coefficients->starts = (int *)malloc((size_t)2 * outSize * sizeof(int));
+    coefficients->weights = (float *)malloc((size_t)outSize * coefficients->taps * sizeof(float));
+    if (!coefficients->starts || !coefficients->weights) {
+        freeResizeCoefficients(coefficients);
+        return false;
+    }
+    coefficients->counts = coefficients->starts + outSize;
+
+    double *values = (double *)malloc(coefficients->taps * sizeof(double));
+    if (!values) {
+        freeResizeCoefficients(coefficients);
+        return false;
+    }
+
+    for (int o = 0; o < outSize; o++) {
+        const double center = (o + 0.5) * scale;
+        int start = (int)(center - support + 0.5);
+        int end = (int)(center + support + 0.5);
+        start = start < 0 ? 0 : start;
+        end = end > inSize ? inSize : end;
+        if (end - start > coefficients->taps)
+            end = start + coefficients->taps;
+
+        double sum = 0.0;
+        for (int i = start; i < end; i++) {
+            values[i - start] = resizeFilterWeight(filter, (i + 0.5 - center) / filterScale);
+            sum += values[i - start];
+        }
+
+        // Zero weights at the ends are skipped, so that unchanged sizes take a single tap
+        int first = 0, last = end - start;
+        while (first < last - 1 && values[first] == 0.0)
+            first++;
+        while (last - 1 > first && values[last - 1] == 0.0)
+            last--;
+
+        float *weights = coefficients->weights + (size_t)o * coefficients->taps;
+        for (int i = first; i < last; i++)
+            weights[i - first] = (float)(sum != 0.0 ? values[i] / sum : 0.0);
+        coefficients->starts[o] = start + first;
+        coefficients->counts[o] = last - first;
+    }
+
+    free(values);
+    return true;
+}
+
+// Data shared by the threads of resizeImage
+typedef struct {
+    const Image *img;
+    Image *output;
+    const ResizeCoefficients *horizontal;
+    const ResizeCoefficients *vertical;
+    int lanes; // Floats per pixel in the horizontally resized rows: 4 for 3 and 4 channels, so a pixel fills an SSE register
+    DispatchLevel level;
+    volatile int failed;
+} ResizeTask;
+
+/** @brief Horizontal pass of a row with any number of lanes
+ */
+static void resizeRowScalar(const float *in, float *out, const ResizeCoefficients *coefficients, int outWidth, int lanes) {
+    for (int x = 0; x < outWidth; x++) {
+        const float *weights = coefficients->weights + (size_t)x * coefficients->taps;
+        const float *source = in + (size_t)coefficients->starts[x] * lanes;
+        for (int c = 0; c < lanes; c++) {
+            float sum = 0.0f;
+            for (int t = 0; t < coefficients->counts[x]; t++)
+                sum += source[t * lanes + c] * weights[t];
+            out[x * lanes + c] = sum;
+        }
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+/** @brief Horizontal pass of a row of 4 lanes, one pixel per register
+ */
+__attribute__((target("sse2"))) static void resizeRow4SSE2(const float *in, float *out, const ResizeCoefficients *coefficients, int outWidth) {
+    for (int x = 0; x < outWidth; x++) {
+        const float *weights = coefficients->weights + (size_t)x * coefficients->taps;
+        const float *source = in + (size_t)coefficients->starts[x] * 4;
+        __m128 sum = _mm_setzero_ps();
+        for (int t = 0; t < coefficients->counts[x]; t++)
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(source + t * 4), _mm_set1_ps(weights[t])));
+        _mm_storeu_ps(out + x * 4, sum);
+    }
+}
+#endif
+
+/** @brief Horizontal pass of a source row, widened to floats of lanes values per pixel
+ *
+ * @param in Scratch for the widened source row, with the lanes past the channels set to 0
+ */
+static void resizeHorizontalRow(const ResizeTask *task, float *in, int y, float *out) {
+    const Image *img = task->img;
+    const int lanes = task->lanes;
+    const unsigned char *pixels = img->pixels + (size_t)y * img->width * img->channels;
+    for (int x = 0; x < img->width; x++)
+        for (int c = 0; c < img->channels; c++)
+            in[x * lanes + c] = pixels[x * img->channels + c];
+
+#ifdef IMAGE_X86_SIMD
+    if (lanes == 4 && task->level != DISPATCH_SCALAR) {
+        resizeRow4SSE2(in, out, task->horizontal, task->output->width);
+        return;
+    }
+#endif
+    resizeRowScalar(in, out, task->horizontal, task->output->width, lanes);
+}
+
+/** @brief Both passes for a band of output rows, rounded and clamped to the 0-255 range
+ *
+ * The source rows under the vertical taps are resized horizontally into a ring of taps rows, each kept in slot
+ * row % taps with the row the slot holds. An output row spans at most taps consecutive source rows, so its rows
+ * never share a slot, and the rows shared with the next output rows are resized once.
+ */
+static void resizeRows(void *context, int startRow, int endRow) {
+    ResizeTask *task = (ResizeTask *)context;
+    const ResizeCoefficients *vertical = task->vertical;
+    const int taps = vertical->taps;
+    const int lanes = task->lanes;
+    const int width = task->output->width;
+    const int channels = task->output->channels;
+    const size_t rowLength = (size_t)width * lanes;
+
+    float *ring = (float *)malloc(rowLength * (taps + 1) * sizeof(float));
+    float *in = (float *)calloc((size_t)task->img->width * lanes, sizeof(float));
+    int *ringRows = (int *)malloc(taps * sizeof(int));
+    const float **rows = (const float **)malloc(taps * sizeof(float *));
+    if (!ring || !in || !ringRows || !rows) {
+        free(ring);
+        free(in);
+        free(ringRows);
+        free(rows);
+        task->failed = 1;
+        return;
+    }
+    float *sum = ring + rowLength * taps;
+    for (int i = 0; i < taps; i++)
+        ringRows[i] = -1;
+
+    for (int y = startRow; y < endRow; y++) {
+        for (int t = 0; t < vertical->counts[y]; t++) {
+            int sourceRow = vertical->starts[y] + t;
+            float *row = ring + (size_t)(sourceRow % taps) * rowLength;
+            if (ringRows[sourceRow % taps] != sourceRow) {
+                resizeHorizontalRow(task, in, sourceRow, row);
+                ringRows[sourceRow % taps] = sourceRow;
+            }
+            rows[t] = row;
+        }
+        sumRows(sum, rows, vertical->weights + (size_t)y * taps, vertical->counts[y], (int)rowLength, task->level);
+
+        unsigned char *out = task->output->pixels + (size_t)y * width * channels;
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < channels; c++) {
+                float value = sum[x * lanes + c];
+                value = value < 0.0f ? 0.0f : (value > 255.0f ? 255.0f : value);
+                out[x * channels + c] = (unsigned char)(value + 0.5f);
+            }
+        }
+    }
+
+    free(ring);
+    free(in);
+    free(ringRows);
+    free(rows);
+}
+
+/** @brief Resize an image with a separable filter
+ *
+ * The weights of each output column and row are computed once. Each thread takes a band of output rows and streams
+ * the source rows it needs through a ring of horizontally resized float rows, so besides the output it only holds
+ * as many rows as the vertical filter has taps.
+ *
+ * @param img The image that will be resized
+ * @param width The width of the resized image
+ * @param height The height of the resized image
+ * @param filter The filter used to compute the new pixels
+ *
+ * @return The resized image, or NULL on error
+ */
+Image *resizeImage(const Image *img, int width, int height, ResizeFilter filter) {
+    if (!requirePixelU8(img, "resizeImage"))
+        return NULL;
+    if (width < 1 || height < 1) {
+        printf("Resized image must be at least 1 x 1\n");
+        return NULL;
+    }
+
+    ResizeCoefficients horizontal = {0}, vertical = {0};
+    const int lanes = img->channels >= 3 ? 4 : img->channels;
+    Image *output = createImage(width, height, img->channels);
+    if (!output || !createResizeCoefficients(&horizontal, img->width, width, filter) ||
+        !createResizeCoefficients(&vertical, img->height, height, filter)) {
+        printf("Error allocating memory for resize\n");
+        freeResizeCoefficients(&horizontal);
+        freeResizeCoefficients(&vertical);
+        if (output)
+            freeImage(output);
+        return NULL;
+    }
 
-    // Traverse each pixel in the image
-    for (int imgY = 0; imgY < img->height; imgY++) {
-        for (int imgX = 0; imgX < img->width; imgX++) {
-            // Process each channel (e.g., R, G, B for RGB)
-            for (int channelIndex = 0; channelIndex < img->channels; channelIndex++) {
-                int imageIndex = (imgY * img->width + imgX) * img->channels + channelIndex;
+    ResizeTask task = {img, output, &horizontal, &vertical, lanes, getDispatchLevel(), 0};
+    parallelFor(height, 16, resizeRows, &task);
 
-                // Calculate the sharpened pixel value and clamp it to the 0-255 range
-                int sharpenedValue = clamp((img->pixels[imageIndex] * 2) - blurredImage->pixels[imageIndex], 0, 255);
+    freeResizeCoefficients(&horizontal);
+    freeResizeCoefficients(&vertical);
+    if (task.failed) {
+        printf("Error allocating memory for resize\n");
+        freeImage(output);
+        return NULL;
+    }
+    return output;
+}
 
-                // Set the output pixel value
-                sharpenedImage->pixels[imageIndex] = (unsigned char)sharpenedValue;
+/** @brief Scale the level of a blur or sharpen to a proxy image
+ *
+ * @return The level for the proxy, 0 when the kernel would be smaller than a proxy pixel
+ */
+static int scalePreviewLevel(int level, double scale) {
+    return (int)(level * scale + 0.5);
+}
+
+/** @brief Compute a node of a pipeline at a preview size, from a downscaled proxy of the source
+ *
+ * The source is reduced to the preview size with a box filter, and the operations are replayed on it with the
+ * blur and sharpen levels scaled to the proxy (dropped when they become smaller than a proxy pixel), so the work
+ * of the filters depends on the preview size instead of the source size. Custom kernels and the edge detection
+ * are applied as recorded, on proxy pixels. Previews at least as large as the source are rendered at full size
+ * and then resized.
+ *
+ * @param pipeline The pipeline
+ * @param node The node that will be computed
+ * @param width The width of the preview
+ * @param height The height of the preview
+ *
+ * @return The preview of the node, or NULL on error
+ */
+Image *pipelineRenderPreview(const Pipeline *pipeline, int node, int width, int height) {
+    if (node < 0 || node >= pipeline->count) {
+        printf("Pipeline node %d does not exist\n", node);
+        return NULL;
+    }
+    if (width < 1 || height < 1) {
+        printf("Preview must be at least 1 x 1\n");
+        return NULL;
+    }
+
+    // Kernels are square, so they are scaled by the mean of the two axes
+    const Image *source = pipeline->source;
+    const double scale = sqrt((double)width / source->width * height / source->height);
+    if (scale >= 1.0) {
+        Image *full = pipelineRender(pipeline, node);
+        if (!full || (full->width == width && full->height == height))
+            return full;
+        Image *preview = resizeImage(full, width, height, RESIZE_BILINEAR);
+        freeImage(full);
+        return preview;
+    }
+
+    Image *proxy = resizeImage(source, width, height, RESIZE_BOX);
+    Pipeline *scaled = proxy ? createPipeline(proxy) : NULL;
+    int *nodes = (int *)malloc(pipeline->count * sizeof(int));
+    if (!proxy || !scaled || !nodes) {
+        printf("Error allocating memory for preview\n");
+        free(nodes);
+        if (scaled)
+            freePipeline(scaled);
+        if (proxy)
+            freeImage(proxy);
+        return NULL;
+    }
+
+    // Nodes only read earlier nodes, so they are replayed in order
+    nodes[PIPELINE_SOURCE_NODE] = PIPELINE_SOURCE_NODE;
+    bool failed = false;
+    for (int n = 1; n <= node && !failed; n++) {
+        const PipelineNode *op = &pipeline->nodes[n];
+        const int input = nodes[op->input];
+        int level;
+        switch (op->operation) {
+        case PIPELINE_INVERT:
+            nodes[n] = pipelineInvert(scaled, input);
+            break;
+        case PIPELINE_BNW:
+            nodes[n] = pipelineBnW(scaled, input);
+            break;
+        case PIPELINE_EDGES:
+            nodes[n] = pipelineEdgeDetection(scaled, input);
+            break;
+        case PIPELINE_KERNEL:
+            if (op->blurLevel > 0) {
+                level = scalePreviewLevel(op->blurLevel, scale);
+                nodes[n] = level > 0 ? pipelineBlur(scaled, input, level) : input;
+            } else if (op->sharpenLevel > 0) {
+                level = scalePreviewLevel(op->sharpenLevel, scale);
+                nodes[n] = level > 0 ? pipelineSharpen(scaled, input, level) : input;
+            } else {
+                nodes[n] = pipelineKernel(scaled, input, op->kernel, op->kernelSize);
             }
+            break;
+        default:
+            nodes[n] = -1;
+            break;
         }
+        failed = nodes[n] < 0;
     }
 
-    freeImage(blurredImage);
-    return sharpenedImage;
+    Image *preview = failed ? NULL : pipelineRender(scaled, nodes[node]);
+
+    free(nodes);
+    freePipeline(scaled);
+    freeImage(proxy);
+    return preview;
 }
 
-/** @brief Apply an edge detection effect to an image
+#define PYRAMID_MAX_LEVELS 32 // More than enough to reach 1 x 1 from any image
+
+// What a pyramid keeps for every level
+typedef enum {
+    PYRAMID_GAUSSIAN,  // Blurred and halved images only
+    PYRAMID_LAPLACIAN, // Also the differences between each level and the expansion of the next one
+} PyramidType;
+
+typedef struct {
+    Image image;      // The Gaussian level, its pixels are in the arena (the source pixels for level 0)
+    short *laplacian; // image - expand(next level), width * height * channels values, NULL for the last level
+    bool built;
+    bool laplacianBuilt;
+} PyramidLevel;
+
+// Multi-scale versions of an image, computed when they are first requested
+typedef struct {
+    PyramidType type;
+    int count; // Number of levels, level 0 has the size of the source
+    PyramidLevel levels[PYRAMID_MAX_LEVELS];
+    unsigned char *arena; // Every level after the first, then every Laplacian level
+} Pyramid;
+
+/** @brief Create a pyramid of an image (the image must stay valid while the pyramid is used)
  *
- * @param img The image that will be applied the edge detection effect
+ * Every level is blurred with the 5-tap binomial kernel [1 4 6 4 1] / 16 and halved (rounding up). The memory of
+ * all the levels is allocated at once, but a level is only computed when it (or a level that needs it) is
+ * requested. The lazy building is not thread safe: a pyramid must be used by one thread at a time.
  *
- * @return The image after the edge detection has been applied
+ * @param source The image, which is level 0
+ * @param levels The number of levels, reduced if the image reaches 1 x 1 before
+ * @param type Whether the Laplacian levels are kept too
+ *
+ * @return The new pyramid, or NULL on error
  */
-Image *applyEdgeDetection(const Image *img) {
-    Image *outputImage = (Image *)malloc(sizeof(Image));
-    if (!outputImage) {
-        printf("Error allocating memory for output image\n");
+Pyramid *createPyramid(const Image *source, int levels, PyramidType type) {
+    if (!requirePixelU8(source, "createPyramid"))
+        return NULL;
+    if (levels < 1) {
+        printf("Pyramid must have at least one level\n");
         return NULL;
     }
 
-    outputImage->width = img->width;
-    outputImage->height = img->height;
-    outputImage->channels = img->channels;
-    outputImage->pixels = (unsigned char *)malloc(img->width * img->height * img->channels * sizeof(unsigned char));
-    if (!outputImage->pixels) {
-        free(outputImage);
-        printf("Error allocating memory for output image\n");
+    Pyramid *pyramid = (Pyramid *)calloc(1, sizeof(Pyramid));
+    if (!pyramid) {
+        printf("Error allocating memory for pyramid\n");
         return NULL;
     }
+    pyramid->type = type;
 
-    float KX[] = {
-        -1, 0, 1,
-        -2, 0, 2,
-        -1, 0, 1};
+    // Sizes first, then one allocation: the Gaussian levels, then the Laplacian ones aligned for shorts
+    int width = source->width, height = source->height;
+    size_t gaussianBytes = 0, laplacianCount = 0;
+    for (int i = 0; i < levels && i < PYRAMID_MAX_LEVELS; i++) {
+        PyramidLevel *level = &pyramid->levels[i];
+        level->image = (Image){width, height, source->channels, NULL, PIXEL_U8};
+        pyramid->count = i + 1;
+        size_t values = (size_t)width * height * source->channels;
+        if (i > 0)
+            gaussianBytes += values;
+        if (width == 1 && height == 1)
+            break;
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        if (i + 1 < levels)
+            laplacianCount += values;
+    }
+    gaussianBytes = (gaussianBytes + 15) & ~(size_t)15;
+    if (type == PYRAMID_GAUSSIAN)
+        laplacianCount = 0;
 
-    float KY[] = {
-        -1, -2, -1,
-        0, 0, 0,
-        1, 2, 1};
+    pyramid->arena = (unsigned char *)malloc(gaussianBytes + laplacianCount * sizeof(short) + 1);
+    if (!pyramid->arena) {
+        printf("Error allocating memory for pyramid\n");
+        free(pyramid);
+        return NULL;
+    }
 
-    // Traverse each pixel in the image
-    for (int imgY = 0; imgY < img->height; imgY++) {
-        for (int imgX = 0; imgX < img->width; imgX++) {
-            // Process each channel (e.g., R, G, B for RGB)
-            for (int channelIndex = 0; channelIndex < img->channels; channelIndex++) {
-                float pixelValueX = 0.0f;
-                float pixelValueY = 0.0f;
+    unsigned char *gaussian = pyramid->arena;
+    short *laplacian = (short *)(pyramid->arena + gaussianBytes);
+    for (int i = 0; i < pyramid->count; i++) {
+        PyramidLevel *level = &pyramid->levels[i];
+        size_t values = (size_t)level->image.width * level->image.height * level->image.channels;
+        if (i == 0) {
+            level->image.pixels = source->pixels;
+            level->built = true;
+        } else {
+            level->image.pixels = gaussian;
+            gaussian += values;
+        }
+        if (type == PYRAMID_LAPLACIAN && i + 1 < pyramid->count) {
+            level->laplacian = laplacian;
+            laplacian += values;
+        }
+    }
+    return pyramid;
+}
 
-                // Traverse each position in the kernel
-                for (int kernelY = -1; kernelY <= 1; kernelY++) {
-                    for (int kernelX = -1; kernelX <= 1; kernelX++) {
+/** @brief Free the memory of a pyramid (the source image is not freed)
+ *
+ * @param pyramid The pyramid that will be freed
+ */
+void freePyramid(Pyramid *pyramid) {
+    free(pyramid->arena);
+    free(pyramid);
+}
 
-                        // Calculate the position of the neighboring pixel, clamped to image boundaries
-                        int pixelX = clamp(imgX + kernelX, 0, img->width - 1);
-                        int pixelY = clamp(imgY + kernelY, 0, img->height - 1);
+// Data shared by the threads of the pyramid passes
+typedef struct {
+    const Image *input;
+    Image *output;       // The reduced image, or the reconstructed one
+    const short *detail; // The Laplacian level added by the reconstruction
+    short *laplacian;    // The Laplacian level computed by the expansion
+    DispatchLevel level;
+    volatile int failed;
+} PyramidTask;
 
-                        // Calculate the position (index) in the image and kernel
-                        int pixelIndex = (pixelY * img->width + pixelX) * img->channels + channelIndex;
-                        int kernelIndex = (kernelY + 1) * 3 + (kernelX + 1);
+/** @brief Vertical part of the binomial kernel: sums[i] = r0[i] + 4 r1[i] + 6 r2[i] + 4 r3[i] + r4[i]
+ */
+static void binomialSumsScalar(unsigned short *sums, const unsigned char *const *rows, int count) {
+    for (int i = 0; i < count; i++)
+        sums[i] = rows[0][i] + 4 * (rows[1][i] + rows[3][i]) + 6 * rows[2][i] + rows[4][i];
+}
 
-                        pixelValueX += img->pixels[pixelIndex] * KX[kernelIndex];
-                        pixelValueY += img->pixels[pixelIndex] * KY[kernelIndex];
-                    }
-                }
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("sse2"))) static void binomialSumsSSE2(unsigned short *sums, const unsigned char *const *rows, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i six = _mm_set1_epi16(6);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i r0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[0] + i)), zero);
+        __m128i r1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[1] + i)), zero);
+        __m128i r2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[2] + i)), zero);
+        __m128i r3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[3] + i)), zero);
+        __m128i r4 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[4] + i)), zero);
+        __m128i sum = _mm_add_epi16(_mm_add_epi16(r0, r4), _mm_slli_epi16(_mm_add_epi16(r1, r3), 2));
+        _mm_storeu_si128((__m128i *)(sums + i), _mm_add_epi16(sum, _mm_mullo_epi16(r2, six)));
+    }
+    const unsigned char *const tails[5] = {rows[0] + i, rows[1] + i, rows[2] + i, rows[3] + i, rows[4] + i};
+    binomialSumsScalar(sums + i, tails, count - i);
+}
 
-                // Do the calculation of the pixel value and clamp it to the 0-255 range
-                int pixelCalculatedValue = clamp(sqrt(pixelValueX * pixelValueX + pixelValueY * pixelValueY), 0, 255);
+__attribute__((target("avx2"))) static void binomialSumsAVX2(unsigned short *sums, const unsigned char *const *rows, int count) {
+    const __m256i six = _mm256_set1_epi16(6);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i r0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[0] + i)));
+        __m256i r1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[1] + i)));
+        __m256i r2 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[2] + i)));
+        __m256i r3 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[3] + i)));
+        __m256i r4 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[4] + i)));
+        __m256i sum = _mm256_add_epi16(_mm256_add_epi16(r0, r4), _mm256_slli_epi16(_mm256_add_epi16(r1, r3), 2));
+        _mm256_storeu_si256((__m256i *)(sums + i), _mm256_add_epi16(sum, _mm256_mullo_epi16(r2, six)));
+    }
+    const unsigned char *const tails[5] = {rows[0] + i, rows[1] + i, rows[2] + i, rows[3] + i, rows[4] + i};
+    binomialSumsScalar(sums + i, tails, count - i);
+}
+#endif
 
-                // Set the output pixel value
-                int outputIndex = (imgY * img->width + imgX) * img->channels + channelIndex;
-                outputImage->pixels[outputIndex] = (unsigned char)pixelCalculatedValue;
+static void binomialSums(unsigned short *sums, const unsigned char *const *rows, int count, DispatchLevel level) {
+#ifdef IMAGE_X86_SIMD
+    if (level == DISPATCH_AVX2) {
+        binomialSumsAVX2(sums, rows, count);
+        return;
+    }
+    if (level == DISPATCH_SSE2) {
+        binomialSumsSSE2(sums, rows, count);
+        return;
+    }
+#endif
+    (void)level;
+    binomialSumsScalar(sums, rows, count);
+}
+
+/** @brief Blur and decimate a range of output rows: only the kept rows and columns are computed
+ */
+static void pyramidReduceRows(void *context, int startRow, int endRow) {
+    PyramidTask *task = (PyramidTask *)context;
+    const Image *in = task->input;
+    const int channels = in->channels;
+    const int outWidth = task->output->width;
+    const size_t rowLength = (size_t)in->width * channels;
+
+    unsigned short *sums = (unsigned short *)malloc(rowLength * sizeof(unsigned short));
+    if (!sums) {
+        task->failed = 1;
+        return;
+    }
+
+    for (int y = startRow; y < endRow; y++) {
+        const unsigned char *rows[5];
+        for (int j = 0; j < 5; j++)
+            rows[j] = in->pixels + clamp(2 * y + j - 2, 0, in->height - 1) * rowLength;
+        binomialSums(sums, rows, (int)rowLength, task->level);
+
+        // Horizontal part on the even columns, rounded (the weights sum to 256)
+        unsigned char *out = task->output->pixels + (size_t)y * outWidth * channels;
+        for (int x = 0; x < outWidth; x++) {
+            const int c0 = clamp(2 * x - 2, 0, in->width - 1) * channels;
+            const int c1 = clamp(2 * x - 1, 0, in->width - 1) * channels;
+            const int c2 = clamp(2 * x, 0, in->width - 1) * channels;
+            const int c3 = clamp(2 * x + 1, 0, in->width - 1) * channels;
+            const int c4 = clamp(2 * x + 2, 0, in->width - 1) * channels;
+            for (int c = 0; c < channels; c++) {
+                int sum = sums[c0 + c] + 4 * (sums[c1 + c] + sums[c3 + c]) + 6 * sums[c2 + c] + sums[c4 + c];
+                out[x * channels + c] = (unsigned char)((sum + 128) >> 8);
             }
         }
     }
 
-    return outputImage;
+    free(sums);
 }
 
-/** @brief Compare two images to determine if they are the same (within a 1 degree of tolerance)
+/** @brief Expand a row of a level to twice its size (or the size of the previous level), rounded
  *
- * @param img1 The first image to compare
- * @param img2 The second image to compare
+ * Even positions take [1 6 1] / 8 of the nearest pixels and odd positions [1 1] / 2, on both axes.
  *
- * @return Returns true if the images are the same, and false otherwise
+ * @param small The level that is expanded
+ * @param y The row of the expanded image
+ * @param width The width of the expanded image
+ * @param expanded Set to the width * channels expanded values
+ * @param columns Scratch space for small->width * channels values
  */
-bool compareImages(const Image *img1, const Image *img2) {
-    // Ensure images are the same size
-    if (img1->width != img2->width || img1->height != img2->height) {
-        printf("Images have different dimensions. Cannot compare.\n");
-        return -1.0;
+static void pyramidExpandRow(const Image *small, int y, int width, int *expanded, int *columns) {
+    const int channels = small->channels;
+    const size_t rowLength = (size_t)small->width * channels;
+    const int k = y / 2;
+    const unsigned char *above = small->pixels + clamp(k - 1, 0, small->height - 1) * rowLength;
+    const unsigned char *center = small->pixels + (size_t)k * rowLength;
+    const unsigned char *below = small->pixels + clamp(k + 1, 0, small->height - 1) * rowLength;
+
+    if (y % 2 == 0) {
+        for (size_t i = 0; i < rowLength; i++)
+            columns[i] = above[i] + 6 * center[i] + below[i];
+    } else {
+        for (size_t i = 0; i < rowLength; i++)
+            columns[i] = 4 * (center[i] + below[i]);
     }
 
-    // If it finds a pixel that is different (with a tolerance), return false
-    for (int i = 0; i < img1->width * img1->height; ++i) {
-        if (abs(img1->pixels[i] - img2->pixels[i]) > 1) {
-            return false;
+    // Each pixel of the small row gives an even and an odd position
+    for (int kx = 0; kx * 2 < width; kx++) {
+        const int *left = columns + clamp(kx - 1, 0, small->width - 1) * channels;
+        const int *middle = columns + kx * channels;
+        const int *right = columns + clamp(kx + 1, 0, small->width - 1) * channels;
+        int *even = expanded + 2 * kx * channels;
+        for (int c = 0; c < channels; c++)
+            even[c] = (left[c] + 6 * middle[c] + right[c] + 32) >> 6;
+        if (kx * 2 + 1 < width) {
+            int *odd = even + channels;
+            for (int c = 0; c < channels; c++)
+                odd[c] = (4 * (middle[c] + right[c]) + 32) >> 6;
         }
     }
+}
 
-    return true;
+/** @brief Rows of a Laplacian level (task->laplacian = task->output - expand(task->input)), or of a reconstructed
+ * level (task->output = task->detail + expand(task->input)) when task->detail is set
+ */
+static void pyramidExpandRows(void *context, int startRow, int endRow) {
+    PyramidTask *task = (PyramidTask *)context;
+    const Image *small = task->input;
+    const int width = task->output->width;
+    const size_t rowLength = (size_t)width * small->channels;
+
+    int *expanded = (int *)malloc((rowLength + (size_t)small->width * small->channels) * sizeof(int));
+    if (!expanded) {
+        task->failed = 1;
+        return;
+    }
+    int *columns = expanded + rowLength;
+
+    for (int y = startRow; y < endRow; y++) {
+        pyramidExpandRow(small, y, width, expanded, columns);
+        unsigned char *pixels = task->output->pixels + (size_t)y * rowLength;
+        if (task->detail) {
+            const short *detail = task->detail + (size_t)y * rowLength;
+            for (size_t i = 0; i < rowLength; i++)
+                pixels[i] = (unsigned char)clamp(expanded[i] + detail[i], 0, 255);
+        } else {
+            short *laplacian = task->laplacian + (size_t)y * rowLength;
+            for (size_t i = 0; i < rowLength; i++)
+                laplacian[i] = (short)(pixels[i] - expanded[i]);
+        }
+    }
+
+    free(expanded);
 }
 
-bool compareImagesFree(Image *img1, Image *img2) {
-    bool result = compareImages(img1, img2);
-    freeImage(img1);
-    freeImage(img2);
-    return result;
+/** @brief Get a Gaussian level of a pyramid, computing it and the levels before it if needed
+ *
+ * @param pyramid The pyramid
+ * @param index The level, 0 is the source image
+ *
+ * @return The level, owned by the pyramid (not to be freed), or NULL on error
+ */
+Image *pyramidLevel(Pyramid *pyramid, int index) {
+    if (index < 0 || index >= pyramid->count) {
+        printf("Pyramid level %d does not exist\n", index);
+        return NULL;
+    }
+
+    PyramidLevel *level = &pyramid->levels[index];
+    if (level->built)
+        return &level->image;
+
+    const Image *previous = pyramidLevel(pyramid, index - 1);
+    if (!previous)
+        return NULL;
+    PyramidTask task = {previous, &level->image, NULL, NULL, getDispatchLevel(), 0};
+    parallelFor(level->image.height, 8, pyramidReduceRows, &task);
+    if (task.failed) {
+        printf("Error allocating memory for pyramid level\n");
+        return NULL;
+    }
+    level->built = true;
+    return &level->image;
+}
+
+/** @brief Get a Laplacian level of a pyramid, the details lost between a Gaussian level and the next one
+ *
+ * The values can be changed (e.g. to blend two pyramids) before calling reconstructPyramid.
+ *
+ * @param pyramid The pyramid, created with PYRAMID_LAPLACIAN
+ * @param index The level, from 0 to the number of levels minus 2 (the last level is pyramidLevel)
+ *
+ * @return The width * height * channels differences of the level, owned by the pyramid, or NULL on error
+ */
+short *pyramidLaplacian(Pyramid *pyramid, int index) {
+    if (pyramid->type != PYRAMID_LAPLACIAN) {
+        printf("Pyramid has no Laplacian levels\n");
+        return NULL;
+    }
+    if (index < 0 || index >= pyramid->count - 1) {
+        printf("Pyramid Laplacian level %d does not exist\n", index);
+        return NULL;
+    }
+
+    PyramidLevel *level = &pyramid->levels[index];
+    if (level->laplacianBuilt)
+        return level->laplacian;
+
+    Image *image = pyramidLevel(pyramid, index);
+    const Image *next = image ? pyramidLevel(pyramid, index + 1) : NULL;
+    if (!next)
+        return NULL;
+    PyramidTask task = {next, image, NULL, level->laplacian, getDispatchLevel(), 0};
+    parallelFor(image->height, 8, pyramidExpandRows, &task);
+    if (task.failed) {
+        printf("Error allocating memory for pyramid level\n");
+        return NULL;
+    }
+    level->laplacianBuilt = true;
+    return level->laplacian;
+}
+
+/** @brief Rebuild the full size image from the Laplacian levels and the last Gaussian level
+ *
+ * Without changes to the levels, the result is the source image exactly.
+ *
+ * @param pyramid The pyramid, created with PYRAMID_LAPLACIAN
+ *
+ * @return The reconstructed image, or NULL on error
+ */
+Image *reconstructPyramid(Pyramid *pyramid) {
+    if (pyramid->type != PYRAMID_LAPLACIAN) {
+        printf("Pyramid has no Laplacian levels\n");
+        return NULL;
+    }
+    for (int i = 0; i < pyramid->count - 1; i++) {
+        if (!pyramidLaplacian(pyramid, i))
+            return NULL;
+    }
+
+    const Image *top = pyramidLevel(pyramid, pyramid->count - 1);
+    Image *current = top ? createImage(top->width, top->height, top->channels) : NULL;
+    if (!current) {
+        printf("Error allocating memory for reconstruction\n");
+        return NULL;
+    }
+    memcpy(current->pixels, top->pixels, (size_t)top->width * top->height * top->channels);
+
+    for (int i = pyramid->count - 2; i >= 0; i--) {
+        const Image *level = &pyramid->levels[i].image;
+        Image *larger = createImage(level->width, level->height, level->channels);
+        if (!larger) {
+            printf("Error allocating memory for reconstruction\n");
+            freeImage(current);
+            return NULL;
+        }
+        PyramidTask task = {current, larger, pyramid->levels[i].laplacian, NULL, getDispatchLevel(), 0};
+        parallelFor(larger->height, 8, pyramidExpandRows, &task);
+        freeImage(current);
+        current = larger;
+        if (task.failed) {
+            printf("Error allocating memory for reconstruction\n");
+            freeImage(current);
+            return NULL;
+        }
+    }
+    return current;
+}
+
+// Weights of the reduced inverse DCTs, C(u) / 2 * cos((2x + 1) u pi / 2N) for N x N output pixels per block
+#define JPEG_IDCT_A 0.35355339f // u = 0, and u = 2 for N = 4
+#define JPEG_IDCT_B 0.46193977f // u = 1 and 3 for N = 4, x = 0
+#define JPEG_IDCT_C 0.19134172f // u = 1 and 3 for N = 4, x = 1
+
+/** @brief 4-point inverse DCT of the lowest 4 frequencies (even and odd halves, like the 8-point one)
+ */
+static inline void jpegIdct4Points(float *out, float f0, float f1, float f2, float f3) {
+    float even0 = JPEG_IDCT_A * (f0 + f2), even1 = JPEG_IDCT_A * (f0 - f2);
+    float odd0 = JPEG_IDCT_B * f1 + JPEG_IDCT_C * f3, odd1 = JPEG_IDCT_C * f1 - JPEG_IDCT_B * f3;
+    out[0] = even0 + odd0;
+    out[1] = even1 + odd1;
+    out[2] = even1 - odd1;
+    out[3] = even0 - odd0;
+}
+
+/** @brief Level shift, round and saturate an inverse DCT output (truncation only differs from floor below zero)
+ */
+static inline stbi_uc jpegSample(float value) {
+    return (stbi_uc)clamp((int)(value + 128.5f), 0, 255);
+}
+
+// Replacements of the 8 x 8 inverse DCT of stb_image, writing the N x N pixels of a block (each the mean of
+// a (8 / N) squared area) into its top left corner. data holds the dequantized coefficients in natural order.
+static void jpegIdctHalf(stbi_uc *out, int out_stride, short data[64]) {
+    float rows[4][4], column[4];
+    for (int v = 0; v < 4; v++)
+        jpegIdct4Points(rows[v], data[v * 8], data[v * 8 + 1], data[v * 8 + 2], data[v * 8 + 3]);
+    for (int x = 0; x < 4; x++) {
+        jpegIdct4Points(column, rows[0][x], rows[1][x], rows[2][x], rows[3][x]);
+        for (int y = 0; y < 4; y++)
+            out[y * out_stride + x] = jpegSample(column[y]);
+    }
+}
+
+#ifdef IMAGE_X86_SIMD
+// jpegIdct4Points on 4 lanes at once, in the same order of operations
+#define JPEG_IDCT4_SSE2(f0, f1, f2, f3)                                                                      \
+    do {                                                                                                     \
+        __m128 even0 = _mm_mul_ps(a, _mm_add_ps(f0, f2)), even1 = _mm_mul_ps(a, _mm_sub_ps(f0, f2));         \
+        __m128 odd0 = _mm_add_ps(_mm_mul_ps(b, f1), _mm_mul_ps(c, f3));                                      \
+        __m128 odd1 = _mm_sub_ps(_mm_mul_ps(c, f1), _mm_mul_ps(b, f3));                                      \
+        f0 = _mm_add_ps(even0, odd0);                                                                        \
+        f1 = _mm_add_ps(even1, odd1);                                                                        \
+        f2 = _mm_sub_ps(even1, odd1);                                                                        \
+        f3 = _mm_sub_ps(even0, odd0);                                                                        \
+    } while (0)
+
+__attribute__((target("sse2"))) static void jpegIdctHalfSSE2(stbi_uc *out, int out_stride, short data[64]) {
+    const __m128 a = _mm_set1_ps(JPEG_IDCT_A), b = _mm_set1_ps(JPEG_IDCT_B), c = _mm_set1_ps(JPEG_IDCT_C);
+    __m128 rows[4];
+    for (int v = 0; v < 4; v++) {
+        __m128i words = _mm_loadl_epi64((const __m128i *)(data + v * 8));
+        rows[v] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16));
+    }
+
+    // Horizontal transform with the frequencies u across the vectors, then the vertical one with v across them
+    _MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+    JPEG_IDCT4_SSE2(rows[0], rows[1], rows[2], rows[3]);
+    _MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+    JPEG_IDCT4_SSE2(rows[0], rows[1], rows[2], rows[3]);
+
+    // Truncation and saturation match jpegSample
+    const __m128 offset = _mm_set1_ps(128.5f);
+    __m128i samples[4];
+    for (int y = 0; y < 4; y++)
+        samples[y] = _mm_cvttps_epi32(_mm_add_ps(rows[y], offset));
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(samples[0], samples[1]), _mm_packs_epi32(samples[2], samples[3]));
+    for (int y = 0; y < 4; y++, bytes = _mm_srli_si128(bytes, 4)) {
+        int packed = _mm_cvtsi128_si32(bytes);
+        memcpy(out + y * out_stride, &packed, 4);
+    }
+}
+#undef JPEG_IDCT4_SSE2
+#endif
+
+static void jpegIdctQuarter(stbi_uc *out, int out_stride, short data[64]) {
+    // The 2-point transform is a sum and a difference, both weighted by A, so A * A = 1/8 overall
+    float sum0 = data[0] + data[1], diff0 = data[0] - data[1];
+    float sum1 = data[8] + data[9], diff1 = data[8] - data[9];
+    out[0] = jpegSample((sum0 + sum1) / 8.0f);
+    out[1] = jpegSample((diff0 + diff1) / 8.0f);
+    out[out_stride] = jpegSample((sum0 - sum1) / 8.0f);
+    out[out_stride + 1] = jpegSample((diff0 - diff1) / 8.0f);
+}
+
+static void jpegIdctEighth(stbi_uc *out, int out_stride, short data[64]) {
+    (void)out_stride;
+    out[0] = jpegSample(data[0] / 8.0f);
+}
+
+/** @brief Decode a JPEG file at 1/2, 1/4 or 1/8 of its size, computing only the low frequencies of each block
+ *
+ * The entropy decoding of stb_image is reused with a reduced inverse DCT, then the component planes are packed
+ * and converted at the reduced size (subsampled chroma is replicated to the nearest pixel).
+ *
+ * @return The reduced image, or NULL if the file is not a JPEG with 1 or 3 components or could not be decoded
+ */
+static Image *loadJpegReduced(const char *filename, int denominator) {
+    FILE *file = stbi__fopen(filename, "rb");
+    if (!file)
+        return NULL;
+    stbi__context context;
+    stbi__start_file(&context, file);
+    stbi__jpeg *jpeg = stbi__jpeg_test(&context) ? (stbi__jpeg *)calloc(1, sizeof(stbi__jpeg)) : NULL;
+    if (!jpeg) {
+        fclose(file);
+        return NULL;
+    }
+
+    jpeg->s = &context;
+    stbi__setup_jpeg(jpeg);
+    jpeg->idct_block_kernel = denominator == 2 ? jpegIdctHalf : denominator == 4 ? jpegIdctQuarter : jpegIdctEighth;
+#ifdef IMAGE_X86_SIMD
+    if (denominator == 2 && getDispatchLevel() != DISPATCH_SCALAR)
+        jpeg->idct_block_kernel = jpegIdctHalfSSE2;
+#endif
+    context.img_n = 0; // Makes stbi__cleanup_jpeg safe if the header is not read
+    bool decoded = stbi__decode_jpeg_image(jpeg) && (context.img_n == 1 || context.img_n == 3);
+    fclose(file);
+
+    const int blockPixels = 8 / denominator;
+    const int width = (context.img_x + denominator - 1) / denominator;
+    const int height = (context.img_y + denominator - 1) / denominator;
+    Image *img = decoded ? createImage(width, height, context.img_n) : NULL;
+    // Two chroma rows, then an RGB row with the byte of slack YCbCr_to_RGB_kernel writes past its last pixel
+    unsigned char *scratch = img ? (unsigned char *)malloc((size_t)5 * width + 1) : NULL;
+    if (!scratch) {
+        if (img)
+            freeImage(img);
+        stbi__cleanup_jpeg(jpeg);
+        free(jpeg);
+        return NULL;
+    }
+
+    // Pack the reduced blocks of every plane, in place (each pixel moves to a lower address)
+    int planeWidths[3], planeHeights[3], steps[3][2];
+    for (int k = 0; k < context.img_n; k++) {
+        int planeWidth = (jpeg->img_comp[k].x + denominator - 1) / denominator;
+        int planeHeight = (jpeg->img_comp[k].y + denominator - 1) / denominator;
+        stbi_uc *data = jpeg->img_comp[k].data;
+        for (int y = 0; y < planeHeight; y++) {
+            const stbi_uc *source = data + (size_t)((y / blockPixels) * 8 + y % blockPixels) * jpeg->img_comp[k].w2;
+            stbi_uc *target = data + (size_t)y * planeWidth;
+            for (int x = 0; x < planeWidth; x += blockPixels, source += 8) {
+                int count = planeWidth - x < blockPixels ? planeWidth - x : blockPixels;
+                for (int i = 0; i < count; i++)
+                    target[x + i] = source[i];
+            }
+        }
+        planeWidths[k] = planeWidth;
+        planeHeights[k] = planeHeight;
+        steps[k][0] = jpeg->img_h_max / jpeg->img_comp[k].h;
+        steps[k][1] = jpeg->img_v_max / jpeg->img_comp[k].v;
+    }
+
+    const bool isRgb = context.img_n == 3 && (jpeg->rgb == 3 || (jpeg->app14_color_transform == 0 && !jpeg->jfif));
+    for (int y = 0; y < height; y++) {
+        unsigned char *out = img->pixels + (size_t)y * width * img->channels;
+        const stbi_uc *rows[3];
+        for (int k = 0; k < context.img_n; k++) {
+            int planeY = y / steps[k][1] < planeHeights[k] ? y / steps[k][1] : planeHeights[k] - 1;
+            rows[k] = jpeg->img_comp[k].data + (size_t)planeY * planeWidths[k];
+        }
+        if (context.img_n == 1) {
+            memcpy(out, rows[0], width);
+            continue;
+        }
+
+        // Chroma planes at the width of the image
+        unsigned char *chroma[2] = {scratch, scratch + width};
+        for (int k = 1; k < 3; k++) {
+            for (int x = 0; x < width; x++) {
+                int planeX = x / steps[k][0];
+                chroma[k - 1][x] = rows[k][planeX < planeWidths[k] ? planeX : planeWidths[k] - 1];
+            }
+        }
+        if (isRgb) {
+            for (int x = 0; x < width; x++) {
+                out[x * 3] = rows[0][x];
+                out[x * 3 + 1] = chroma[0][x];
+                out[x * 3 + 2] = chroma[1][x];
+            }
+        } else {
+            jpeg->YCbCr_to_RGB_kernel(scratch + 2 * width, rows[0], chroma[0], chroma[1], width, 3);
+            memcpy(out, scratch + 2 * width, (size_t)width * 3);
+        }
+    }
+
+    free(scratch);
+    stbi__cleanup_jpeg(jpeg);
+    free(jpeg);
+    return img;
+}
+
+/** @brief Load an image from a file at a fraction of its size, for thumbnails
+ *
+ * JPEG files with 1 or 3 components are decoded directly at the reduced size, which skips most of the inverse DCT
+ * work; other files are decoded at full size and reduced with a box filter. The size is rounded up.
+ *
+ * @param filename The name of the file to load
+ * @param denominator The reduction: 1, 2, 4 or 8
+ *
+ * @return Returns a pointer to the loaded image, or NULL if the image could not be loaded
+ */
+Image *loadImageScaled(const char *filename, int denominator) {
+    if (denominator != 1 && denominator != 2 && denominator != 4 && denominator != 8) {
+        printf("Scale must be 1/1, 1/2, 1/4 or 1/8\n");
+        return NULL;
+    }
+    if (denominator == 1)
+        return loadImage(filename);
+
+    Image *img = loadJpegReduced(filename, denominator);
+    if (img) {
+        printf("Image loaded: %s at 1/%d, dimensions: %d x %d, channels: %d\n", filename, denominator, img->width,
+               img->height, img->channels);
+        return img;
+    }
+
+    Image *full = loadImage(filename);
+    if (!full)
+        return NULL;
+    img = resizeImage(full, (full->width + denominator - 1) / denominator, (full->height + denominator - 1) / denominator,
+                      RESIZE_BOX);
+    freeImage(full);
+    return img;
 }